@@ -20,6 +20,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include <sys/uio.h>
+
 //=====================================================================
 // KCP BASIC
 //=====================================================================
@@ -31,6 +33,10 @@ const uint32_t IKCP_CMD_PUSH = 81; // cmd: push data
 const uint32_t IKCP_CMD_ACK = 82; // cmd: ack
 const uint32_t IKCP_CMD_WASK = 83; // cmd: window probe (ask)
 const uint32_t IKCP_CMD_WINS = 84; // cmd: window size (tell)
+const uint32_t IKCP_CMD_SACK = 85; // cmd: selective ack ranges
+const uint32_t IKCP_FEAT_SACK = 0xA5; // IKCP_CMD_WINS frg, always 0 before
+const uint32_t IKCP_SACK_ADV = 16; // max times to advertise sack
+const uint32_t IKCP_SACK_MAXLEN = 256; // max ranges size in bytes
 const uint32_t IKCP_ASK_SEND = 1; // need to send IKCP_CMD_WASK
 const uint32_t IKCP_ASK_TELL = 2; // need to send IKCP_CMD_WINS
 const uint32_t IKCP_WND_SND = 32;
@@ -45,11 +51,41 @@ const uint32_t IKCP_THRESH_MIN = 2;
 const uint32_t IKCP_PROBE_INIT = 7000; // 7 secs to probe window size
 const uint32_t IKCP_PROBE_LIMIT = 120000; // up to 120 secs to probe window
 const uint32_t IKCP_FASTACK_LIMIT = 5; // max times to trigger fastack
+const uint32_t IKCP_RACK_REO_MAX = 16; // max reordering window in min rtt / 4
+const uint32_t IKCP_RACK_RECOVERIES = 16; // recoveries to reset the window
 
 //---------------------------------------------------------------------
 // encode / decode
 //---------------------------------------------------------------------
 
+/* encode unsigned varint */
+static inline char *ikcp_encode_varint(char *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		write_uint8(p++, (uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	write_uint8(p++, (uint8_t)v);
+	return p;
+}
+
+/* decode unsigned varint, returns NULL if malformed */
+static inline const char *
+ikcp_decode_varint(const char *p, const char *end, uint32_t *v)
+{
+	uint32_t x = 0;
+	int shift;
+	for (shift = 0; p < end && shift < 32; shift += 7) {
+		uint8_t c = read_uint8(p++);
+		x |= (uint32_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*v = x;
+			return p;
+		}
+	}
+	return NULL;
+}
+
 /* encode 8 bits unsigned int */
 static inline char *ikcp_encode8u(char *p, uint8_t c)
 {
@@ -135,27 +171,126 @@ static void ikcp_free(void *ptr)
 	free(ptr);
 }
 
-struct mcache *ikcp_segment_pool = NULL;
+_Thread_local struct mcache *ikcp_segment_pool[IKCP_SEGMENT_POOLS];
+_Thread_local struct mcache *ikcp_segment_ref_pool = NULL;
 
 // allocate a new kcp segment
 static IKCPSEG *ikcp_segment_new(ikcpcb *kcp, int size)
 {
-	struct mcache *restrict pool = ikcp_segment_pool;
-	assert(0 < size && (sizeof(IKCPSEG) + (size_t)size) <= pool->elem_size);
+	struct mcache *pool = NULL;
+	IKCPSEG *seg;
+	int i;
+	assert(0 < size);
+	for (i = 0; i < IKCP_SEGMENT_POOLS; i++) {
+		struct mcache *p = ikcp_segment_pool[i];
+		if (p != NULL &&
+		    sizeof(IKCPSEG) + (size_t)size <= p->elem_size) {
+			pool = p;
+			break;
+		}
+	}
+	if (pool == NULL) {
+		seg = (IKCPSEG *)ikcp_malloc(sizeof(IKCPSEG) + size);
+	} else {
+		seg = mcache_get(pool);
+	}
+	if (seg != NULL) {
+		seg->pool = pool;
+		seg->ref = NULL;
+	}
+	return seg;
+}
+
+// allocate a new kcp segment borrowing the payload
+static IKCPSEG *ikcp_segment_borrow(ikcpcb *kcp, const char *data, void *ref)
+{
+	struct mcache *restrict pool = ikcp_segment_ref_pool;
+	IKCPSEG *seg;
 	if (pool == NULL) {
-		return (IKCPSEG *)ikcp_malloc(sizeof(IKCPSEG) + size);
+		seg = (IKCPSEG *)ikcp_malloc(sizeof(IKCPSEG));
+	} else {
+		seg = mcache_get(pool);
+	}
+	if (seg != NULL) {
+		kcp->retain(ref, kcp, kcp->user);
+		seg->pool = pool;
+		seg->ref = ref;
+		seg->ref_data = data;
 	}
-	return mcache_get(pool);
+	return seg;
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-	struct mcache *restrict pool = ikcp_segment_pool;
+	struct mcache *pool = seg->pool;
+	if (seg->ref != NULL) {
+		kcp->release(seg->ref, kcp, kcp->user);
+	}
 	if (pool == NULL) {
 		ikcp_free(seg);
+		return;
+	}
+	mcache_put(pool, seg);
+}
+
+// reserve a ring for at least 'wnd' sequence numbers
+static int ikcp_ring_reserve(IKCPSEG ***ring, uint32_t *mask, uint32_t wnd)
+{
+	IKCPSEG **newring;
+	uint32_t size, i;
+	if (*ring != NULL && *mask + 1 >= wnd)
+		return 0;
+	for (size = 8; size < wnd; size <<= 1)
+		;
+	newring = (IKCPSEG **)ikcp_malloc(sizeof(IKCPSEG *) * size);
+	if (newring == NULL)
+		return -1;
+	memset(newring, 0, sizeof(IKCPSEG *) * size);
+	if (*ring != NULL) {
+		// the segments held span less than the old size
+		for (i = 0; i <= *mask; i++) {
+			IKCPSEG *seg = (*ring)[i];
+			if (seg != NULL)
+				newring[seg->sn & (size - 1)] = seg;
+		}
+		ikcp_free(*ring);
+	}
+	*ring = newring;
+	*mask = size - 1;
+	return 0;
+}
+
+// payload of a segment
+static const char *ikcp_segment_data(const IKCPSEG *seg)
+{
+	return (seg->ref != NULL) ? seg->ref_data : seg->data;
+}
+
+// free the room from ikcp_sendroom
+static void ikcp_room_free(ikcpcb *kcp)
+{
+	while (!iqueue_is_empty(&kcp->snd_room)) {
+		IKCPSEG *seg = iqueue_entry(kcp->snd_room.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+	}
+}
+
+// move available data from rcv_buf -> rcv_queue
+static void ikcp_move_rcv_buf(ikcpcb *kcp)
+{
+	while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+		IKCPSEG **slot = &kcp->rcv_ring[kcp->rcv_nxt & kcp->rcv_mask];
+		IKCPSEG *seg = *slot;
+		if (seg == NULL)
+			break;
+		*slot = NULL;
+		kcp->nrcv_buf--;
+		iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+		kcp->nrcv_que++;
+		kcp->rcv_nxt++;
 	}
-	return mcache_put(pool, seg);
 }
 
 // write log
@@ -192,6 +327,23 @@ static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 	return kcp->output((const char *)data, size, kcp, kcp->user);
 }
 
+// reserve 'need' bytes in the datagram being encoded, output it first
+// if it would exceed mtu
+static char *ikcp_reserve(ikcpcb *kcp, char **buffer, char *ptr, int need)
+{
+	char *buf = NULL;
+	if (*buffer != NULL) {
+		int size = (int)(ptr - *buffer);
+		if (size + need <= (int)kcp->mtu)
+			return ptr;
+		ikcp_output(kcp, *buffer, size);
+	}
+	if (kcp->outbuf != NULL)
+		buf = kcp->outbuf(kcp, kcp->user);
+	*buffer = (buf != NULL) ? buf : kcp->buffer;
+	return *buffer;
+}
+
 // output queue
 void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 {
@@ -243,7 +395,57 @@ ikcpcb *ikcp_create(uint32_t conv, void *user)
 	iqueue_init(&kcp->snd_queue);
 	iqueue_init(&kcp->rcv_queue);
 	iqueue_init(&kcp->snd_buf);
-	iqueue_init(&kcp->rcv_buf);
+	iqueue_init(&kcp->snd_room);
+	kcp->rcv_off = 0;
+	kcp->snd_ring = NULL;
+	kcp->rcv_ring = NULL;
+	if (ikcp_ring_reserve(&kcp->snd_ring, &kcp->snd_mask, kcp->snd_wnd) ||
+	    ikcp_ring_reserve(&kcp->rcv_ring, &kcp->rcv_mask, kcp->rcv_wnd)) {
+		ikcp_free(kcp->snd_ring);
+		ikcp_free(kcp->buffer);
+		ikcp_free(kcp);
+		return NULL;
+	}
+	kcp->ts_resend = 0;
+	kcp->fastack_due = 0;
+	kcp->fastack_seq = 0;
+	kcp->fastack_min = 0;
+	kcp->fastack_sn = 0;
+	kcp->fastack_ts = 0;
+	kcp->rack_set = 0;
+	kcp->rack_ts = 0;
+	kcp->rack_sn = 0;
+	kcp->rack_rtt = 0;
+	kcp->rack_min_rtt = 0xffffffff;
+	kcp->rack_reo_mult = 1;
+	kcp->rack_recoveries = 0;
+	kcp->ts_oldest = 0;
+	kcp->ts_xmit = 0;
+	kcp->ts_tlp = 0;
+	kcp->tlp_armed = 0;
+	kcp->tlp_out = 0;
+	kcp->ack_freq = 0;
+	kcp->ack_delay = 0;
+	kcp->ts_ack = 0;
+	kcp->ack_now = 0;
+	kcp->sack = 0;
+	kcp->rmt_sack = 0;
+	kcp->sack_adv = 0;
+	kcp->rcv_max = 0;
+	kcp->cc = &ikcp_cc_reno;
+	kcp->cc_state = NULL;
+	kcp->delivered = 0;
+	kcp->delivered_ts = 0;
+	kcp->app_limited = 0;
+	kcp->rs_acked = 0;
+	kcp->rs_delivered = 0;
+	kcp->rs_ts = 0;
+	kcp->rs_app_limited = 0;
+	kcp->pacing = IKCP_PACING_CC;
+	kcp->pacing_rate = 0;
+	kcp->ts_pacing = 0;
+	kcp->pacing_budget = 0;
+	kcp->paced = 0;
 	kcp->nrcv_buf = 0;
 	kcp->nsnd_buf = 0;
 	kcp->nrcv_que = 0;
@@ -269,6 +471,9 @@ ikcpcb *ikcp_create(uint32_t conv, void *user)
 	kcp->xmit = 0;
 	kcp->dead_link = IKCP_DEADLINK;
 	kcp->output = NULL;
+	kcp->outbuf = NULL;
+	kcp->retain = NULL;
+	kcp->release = NULL;
 	kcp->writelog = NULL;
 
 	return kcp;
@@ -282,15 +487,16 @@ void ikcp_release(ikcpcb *kcp)
 	assert(kcp);
 	if (kcp) {
 		IKCPSEG *seg;
+		uint32_t i;
 		while (!iqueue_is_empty(&kcp->snd_buf)) {
 			seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
-		while (!iqueue_is_empty(&kcp->rcv_buf)) {
-			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		for (i = 0; i <= kcp->rcv_mask; i++) {
+			seg = kcp->rcv_ring[i];
+			if (seg != NULL)
+				ikcp_segment_delete(kcp, seg);
 		}
 		while (!iqueue_is_empty(&kcp->snd_queue)) {
 			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -302,17 +508,24 @@ void ikcp_release(ikcpcb *kcp)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
+		ikcp_room_free(kcp);
 		if (kcp->buffer) {
 			ikcp_free(kcp->buffer);
 		}
 		if (kcp->acklist) {
 			ikcp_free(kcp->acklist);
 		}
+		ikcp_free(kcp->snd_ring);
+		ikcp_free(kcp->rcv_ring);
+		if (kcp->cc_state) {
+			ikcp_free(kcp->cc_state);
+		}
 
 		kcp->nrcv_buf = 0;
 		kcp->nsnd_buf = 0;
 		kcp->nrcv_que = 0;
 		kcp->nsnd_que = 0;
+		kcp->rcv_off = 0;
 		kcp->ackcount = 0;
 		kcp->buffer = NULL;
 		kcp->acklist = NULL;
@@ -330,6 +543,25 @@ void ikcp_setoutput(
 	kcp->output = output;
 }
 
+//---------------------------------------------------------------------
+// set output buffer callback, which will be invoked by kcp
+//---------------------------------------------------------------------
+void ikcp_setoutbuf(ikcpcb *kcp, char *(*outbuf)(ikcpcb *kcp, void *user))
+{
+	kcp->outbuf = outbuf;
+}
+
+//---------------------------------------------------------------------
+// set reference callbacks, which will be invoked by ikcp_input_ref
+//---------------------------------------------------------------------
+void ikcp_setref(ikcpcb *kcp,
+	void (*retain)(void *ref, ikcpcb *kcp, void *user),
+	void (*release)(void *ref, ikcpcb *kcp, void *user))
+{
+	kcp->retain = retain;
+	kcp->release = release;
+}
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -339,6 +571,8 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 	int ispeek = (len < 0) ? 1 : 0;
 	int peeksize;
 	int recover = 0;
+	// only the first segment may be partly consumed
+	uint32_t off = kcp->rcv_off;
 	IKCPSEG *seg;
 	assert(kcp);
 
@@ -366,11 +600,13 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 		p = p->next;
 
 		if (buffer) {
-			memcpy(buffer, seg->data, seg->len);
-			buffer += seg->len;
+			memcpy(buffer, ikcp_segment_data(seg) + off,
+				seg->len - off);
+			buffer += seg->len - off;
 		}
 
-		len += seg->len;
+		len += seg->len - off;
+		off = 0;
 		fragment = seg->frg;
 
 		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
@@ -383,6 +619,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 			kcp->nrcv_que--;
+			kcp->rcv_off = 0;
 		}
 
 		if (fragment == 0)
@@ -391,19 +628,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 
 	assert(len == peeksize);
 
-	// move available data from rcv_buf -> rcv_queue
-	while (!iqueue_is_empty(&kcp->rcv_buf)) {
-		seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		} else {
-			break;
-		}
-	}
+	ikcp_move_rcv_buf(kcp);
 
 	// fast recover
 	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -431,11 +656,12 @@ int ikcp_peeksize(const ikcpcb *kcp)
 
 	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
 	if (seg->frg == 0)
-		return seg->len;
+		return seg->len - kcp->rcv_off;
 
 	if (kcp->nrcv_que < seg->frg + 1)
 		return -1;
 
+	length = -(int)kcp->rcv_off;
 	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
 		seg = iqueue_entry(p, IKCPSEG, node);
 		length += seg->len;
@@ -446,6 +672,136 @@ int ikcp_peeksize(const ikcpcb *kcp)
 	return length;
 }
 
+//---------------------------------------------------------------------
+// stream mode: the received data in place
+//---------------------------------------------------------------------
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int n)
+{
+	const struct IQUEUEHEAD *p;
+	uint32_t off = kcp->rcv_off;
+	int i = 0;
+
+	assert(kcp);
+
+	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue && i < n;
+		p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		iov[i].iov_base = (void *)(ikcp_segment_data(seg) + off);
+		iov[i].iov_len = seg->len - off;
+		off = 0;
+		i++;
+	}
+
+	return i;
+}
+
+//---------------------------------------------------------------------
+// stream mode: release the data handled in place, the segments are
+// deleted once all of their bytes are consumed
+//---------------------------------------------------------------------
+int ikcp_consume(ikcpcb *kcp, int len)
+{
+	int recover = 0;
+	int n = 0;
+	IKCPSEG *seg;
+	assert(kcp);
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	while (!iqueue_is_empty(&kcp->rcv_queue)) {
+		int k;
+		seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+		k = (int)(seg->len - kcp->rcv_off);
+
+		if (k > len - n) {
+			// partially consumed
+			kcp->rcv_off += (uint32_t)(len - n);
+			n = len;
+			break;
+		}
+
+		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+			ikcp_log(
+				kcp, IKCP_LOG_RECV, "recv sn=%lu",
+				(unsigned long)seg->sn);
+		}
+
+		n += k;
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+		kcp->nrcv_que--;
+		kcp->rcv_off = 0;
+	}
+
+	ikcp_move_rcv_buf(kcp);
+
+	// fast recover
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		// ready to send back IKCP_CMD_WINS in ikcp_flush
+		// tell remote my window size
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return n;
+}
+
+//---------------------------------------------------------------------
+// stream mode: room to write the data to be sent in place
+//---------------------------------------------------------------------
+int ikcp_sendroom(ikcpcb *kcp, int len, struct iovec *iov, int n)
+{
+	IKCPSEG *seg;
+	int count, i;
+
+	assert(kcp->mss > 0 && kcp->stream != 0);
+	if (len <= 0)
+		return -1;
+
+	count = (len + kcp->mss - 1) / kcp->mss;
+	if (count > n)
+		return -1;
+
+	// the room not committed last time is given up
+	ikcp_room_free(kcp);
+
+	for (i = 0; i < count; i++) {
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		seg = ikcp_segment_new(kcp, size);
+		if (seg == NULL) {
+			ikcp_room_free(kcp);
+			return -2;
+		}
+		iqueue_add_tail(&seg->node, &kcp->snd_room);
+		iov[i].iov_base = seg->data;
+		iov[i].iov_len = size;
+		len -= size;
+	}
+
+	return count;
+}
+
+int ikcp_sendcommit(ikcpcb *kcp, int len)
+{
+	IKCPSEG *seg;
+	int sent = 0;
+
+	while (len > 0 && !iqueue_is_empty(&kcp->snd_room)) {
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		seg = iqueue_entry(kcp->snd_room.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		seg->len = size;
+		seg->frg = 0;
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que++;
+		len -= size;
+		sent += size;
+	}
+
+	ikcp_room_free(kcp);
+	return sent;
+}
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
@@ -552,6 +908,8 @@ static void ikcp_update_ack(ikcpcb *kcp, int32_t rtt)
 	}
 	rto = kcp->rx_srtt + _imax_(kcp->interval, 4 * kcp->rx_rttval);
 	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+	if ((uint32_t)rtt < kcp->rack_min_rtt)
+		kcp->rack_min_rtt = (uint32_t)rtt;
 }
 
 static void ikcp_shrink_buf(ikcpcb *kcp)
@@ -565,26 +923,94 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
 	}
 }
 
+// account a segment acknowledged by this input, the most recently sent
+// one determines the rate sample
+static void ikcp_on_delivered(ikcpcb *kcp, const IKCPSEG *seg)
+{
+	kcp->delivered += IKCP_OVERHEAD + seg->len;
+	if (kcp->rs_acked++ == 0 ||
+	    _itimediff(seg->delivered, kcp->rs_delivered) > 0) {
+		kcp->rs_delivered = seg->delivered;
+		kcp->rs_ts = seg->delivered_ts;
+		kcp->rs_app_limited = seg->app_limited != 0;
+	}
+	// rack follows the most recently sent segment that was delivered
+	if (!kcp->rack_set || _itimediff(seg->ts, kcp->rack_ts) > 0 ||
+	    (seg->ts == kcp->rack_ts &&
+	     _itimediff(seg->sn, kcp->rack_sn) > 0)) {
+		int32_t rtt = _itimediff(kcp->current, seg->ts);
+		// too fast, must be the ack of an earlier transmission
+		if (seg->xmit > 1 && rtt < (int32_t)kcp->rack_min_rtt)
+			return;
+		kcp->rack_set = 1;
+		kcp->rack_ts = seg->ts;
+		kcp->rack_sn = seg->sn;
+		kcp->rack_rtt = rtt > 0 ? (uint32_t)rtt : 0;
+	}
+}
+
+// an ack echoing an earlier transmission than the latest one shows that
+// the retransmission was spurious, so widen the reordering window
+static void ikcp_rack_spurious(ikcpcb *kcp, uint32_t sn, uint32_t ts)
+{
+	IKCPSEG *seg;
+	if (_itimediff(sn, kcp->snd_una) < 0 ||
+	    _itimediff(sn, kcp->snd_nxt) >= 0)
+		return;
+	seg = kcp->snd_ring[sn & kcp->snd_mask];
+	if (seg == NULL || seg->xmit < 2 || _itimediff(ts, seg->ts) >= 0)
+		return;
+	if (kcp->rack_reo_mult < IKCP_RACK_REO_MAX)
+		kcp->rack_reo_mult++;
+	kcp->rack_recoveries = 0;
+}
+
+// millisec a segment may still be reordered, 0 if it is lost, -1 if it
+// was not sent before any delivered segment
+static int32_t ikcp_rack_wait(const ikcpcb *kcp, const IKCPSEG *seg,
+	uint32_t reo_wnd)
+{
+	int32_t wait;
+	if (!kcp->rack_set || seg->xmit == 0)
+		return -1;
+	if (_itimediff(seg->ts, kcp->rack_ts) > 0 ||
+	    (seg->ts == kcp->rack_ts &&
+	     _itimediff(seg->sn, kcp->rack_sn) >= 0))
+		return -1;
+	wait = _itimediff(seg->ts + kcp->rack_rtt + reo_wnd, kcp->current);
+	return wait > 0 ? wait : 0;
+}
+
+static uint32_t ikcp_rack_reo_wnd(const ikcpcb *kcp)
+{
+	uint32_t wnd;
+	if (kcp->rack_min_rtt == 0xffffffff)
+		return 1;
+	wnd = kcp->rack_min_rtt * kcp->rack_reo_mult / 4;
+	if (kcp->rx_srtt > 0 && wnd > (uint32_t)kcp->rx_srtt)
+		wnd = (uint32_t)kcp->rx_srtt;
+	// the clock is in millisec
+	return wnd > 0 ? wnd : 1;
+}
+
 static void ikcp_parse_ack(ikcpcb *kcp, uint32_t sn)
 {
-	struct IQUEUEHEAD *p, *next;
+	IKCPSEG **slot;
+	IKCPSEG *seg;
 
 	if (_itimediff(sn, kcp->snd_una) < 0 ||
 	    _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
+	slot = &kcp->snd_ring[sn & kcp->snd_mask];
+	seg = *slot;
+	if (seg != NULL) {
+		assert(seg->sn == sn);
+		*slot = NULL;
+		ikcp_on_delivered(kcp, seg);
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+		kcp->nsnd_buf--;
 	}
 }
 
@@ -595,6 +1021,8 @@ static void ikcp_parse_una(ikcpcb *kcp, uint32_t una)
 		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
 		next = p->next;
 		if (_itimediff(una, seg->sn) > 0) {
+			kcp->snd_ring[seg->sn & kcp->snd_mask] = NULL;
+			ikcp_on_delivered(kcp, seg);
 			iqueue_del(p);
 			ikcp_segment_delete(kcp, seg);
 			kcp->nsnd_buf--;
@@ -604,28 +1032,110 @@ static void ikcp_parse_una(ikcpcb *kcp, uint32_t una)
 	}
 }
 
+// marks the segments acked beyond for the first time, indexed by sn so that
+// an input costs no more than the segments it passes; the others are marked
+// in ikcp_flush
 static void ikcp_parse_fastack(ikcpcb *kcp, uint32_t sn, uint32_t ts)
 {
-	struct IQUEUEHEAD *p, *next;
+	uint32_t i;
 
 	if (_itimediff(sn, kcp->snd_una) < 0 ||
 	    _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		} else if (sn != seg->sn) {
-#ifndef IKCP_FASTACK_CONSERVE
-			seg->fastack++;
-#else
-			if (_itimediff(ts, seg->ts) >= 0)
-				seg->fastack++;
+	if (++kcp->fastack_seq == 0)
+		kcp->fastack_seq = 1;
+	i = kcp->fastack_sn;
+	if (_itimediff(i, kcp->snd_una) < 0)
+		i = kcp->snd_una;
+	if (_itimediff(sn, i) >= 0) {
+		for (; i != sn; i++) {
+			IKCPSEG *seg = kcp->snd_ring[i & kcp->snd_mask];
+			if (seg == NULL || seg->fastack != 0)
+				continue;
+#ifdef IKCP_FASTACK_CONSERVE
+			if (_itimediff(ts, seg->ts) < 0)
+				continue;
 #endif
+			seg->fastack = kcp->fastack_seq;
+			if (kcp->fastack_min == 0)
+				kcp->fastack_min = kcp->fastack_seq;
+		}
+		kcp->fastack_sn = sn;
+	}
+	if (_itimediff(ts, kcp->fastack_ts) > 0)
+		kcp->fastack_ts = ts;
+	if (kcp->fastresend > 0 && kcp->fastack_min != 0 &&
+	    kcp->fastack_seq - kcp->fastack_min + 1 >=
+		    (uint32_t)kcp->fastresend)
+		kcp->fastack_due = 1;
+}
+
+// the inputs that acked beyond the segment
+static uint32_t ikcp_fastack(const ikcpcb *kcp, const IKCPSEG *seg)
+{
+	if (seg->fastack == 0)
+		return 0;
+	return kcp->fastack_seq - seg->fastack + 1;
+}
+
+// ranges are pairs of (gap from the previous end, count), starting at una
+static int
+ikcp_parse_sack(ikcpcb *kcp, uint32_t una, const char *data, uint32_t len,
+		uint32_t *maxsn)
+{
+	const char *end = data + len;
+	uint32_t first = una, gap, count, lo, hi;
+	while (data < end) {
+		data = ikcp_decode_varint(data, end, &gap);
+		if (data == NULL)
+			return -1;
+		data = ikcp_decode_varint(data, end, &count);
+		if (data == NULL)
+			return -1;
+		first += gap;
+		lo = first;
+		hi = first + count;
+		first = hi;
+		if (_itimediff(lo, kcp->snd_una) < 0)
+			lo = kcp->snd_una;
+		if (_itimediff(hi, kcp->snd_nxt) > 0)
+			hi = kcp->snd_nxt;
+		if (_itimediff(lo, hi) >= 0)
+			continue;
+		if (_itimediff(hi - 1, *maxsn) > 0)
+			*maxsn = hi - 1;
+		for (; lo != hi; lo++)
+			ikcp_parse_ack(kcp, lo);
+	}
+	return 0;
+}
+
+// encode the segments in rcv_buf as ranges, returns the size
+static int ikcp_encode_sack(const ikcpcb *kcp, char *p, int cap)
+{
+	const char *start = p;
+	uint32_t sn = kcp->rcv_nxt, prev = kcp->rcv_nxt;
+	uint32_t end = kcp->rcv_max + 1;
+	uint32_t first;
+	if (kcp->nrcv_buf == 0)
+		return 0;
+	while (_itimediff(sn, end) < 0) {
+		if (kcp->rcv_ring[sn & kcp->rcv_mask] == NULL) {
+			sn++;
+			continue;
 		}
+		first = sn;
+		while (sn != end && kcp->rcv_ring[sn & kcp->rcv_mask] != NULL)
+			sn++;
+		// 2 varints take at most 10 bytes
+		if (cap - (int)(p - start) < 10)
+			break;
+		p = ikcp_encode_varint(p, first - prev);
+		p = ikcp_encode_varint(p, sn - first);
+		prev = sn;
 	}
+	return (int)(p - start);
 }
 
 //---------------------------------------------------------------------
@@ -636,6 +1146,9 @@ static void ikcp_ack_push(ikcpcb *kcp, uint32_t sn, uint32_t ts)
 	uint32_t newsize = kcp->ackcount + 1;
 	uint32_t *ptr;
 
+	if (kcp->ackcount == 0)
+		kcp->ts_ack = kcp->current;
+
 	if (newsize > kcp->ackblock) {
 		uint32_t *acklist;
 		uint32_t newblock;
@@ -682,9 +1195,8 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, uint32_t *sn, uint32_t *ts)
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-	struct IQUEUEHEAD *p, *prev;
 	uint32_t sn = newseg->sn;
-	int repeat = 0;
+	IKCPSEG **slot;
 
 	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
 	    _itimediff(sn, kcp->rcv_nxt) < 0) {
@@ -692,44 +1204,18 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		return;
 	}
 
-	for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		prev = p->prev;
-		if (seg->sn == sn) {
-			repeat = 1;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) > 0) {
-			break;
-		}
-	}
-
-	if (repeat == 0) {
-		iqueue_init(&newseg->node);
-		iqueue_add(&newseg->node, p);
+	slot = &kcp->rcv_ring[sn & kcp->rcv_mask];
+	if (*slot == NULL) {
+		if (kcp->nrcv_buf == 0 || _itimediff(sn, kcp->rcv_max) > 0)
+			kcp->rcv_max = sn;
+		*slot = newseg;
 		kcp->nrcv_buf++;
 	} else {
+		// repeat
 		ikcp_segment_delete(kcp, newseg);
 	}
 
-#if 0
-	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
-	// move available data from rcv_buf -> rcv_queue
-	while (!iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		} else {
-			break;
-		}
-	}
+	ikcp_move_rcv_buf(kcp);
 
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
@@ -746,9 +1232,16 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 // input data
 //---------------------------------------------------------------------
 int ikcp_input(ikcpcb *kcp, const char *data, long size)
+{
+	return ikcp_input_ref(kcp, data, size, NULL);
+}
+
+int ikcp_input_ref(ikcpcb *kcp, const char *data, long size, void *ref)
 {
 	uint32_t prev_una = kcp->snd_una;
+	uint32_t prior_inflight = kcp->snd_nxt - kcp->snd_una;
 	uint32_t maxack = 0, latest_ts = 0;
+	int32_t rtt = -1;
 	int flag = 0;
 
 	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
@@ -758,6 +1251,8 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 	if (data == NULL || (int)size < (int)IKCP_OVERHEAD)
 		return -1;
 
+	kcp->rs_acked = 0;
+
 	while (1) {
 		uint32_t ts, sn, len, una, conv;
 		uint16_t wnd;
@@ -785,32 +1280,45 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 			return -2;
 
 		if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-		    cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS)
+		    cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS &&
+		    cmd != IKCP_CMD_SACK)
 			return -3;
 
 		kcp->rmt_wnd = wnd;
+		// before the acked segment is released
+		if (cmd == IKCP_CMD_ACK || cmd == IKCP_CMD_SACK)
+			ikcp_rack_spurious(kcp, sn, ts);
 		ikcp_parse_una(kcp, una);
 		ikcp_shrink_buf(kcp);
 
-		if (cmd == IKCP_CMD_ACK) {
+		if (cmd == IKCP_CMD_ACK || cmd == IKCP_CMD_SACK) {
+			// 'sn' and 'ts' are from the latest segment received
+			uint32_t maxsn = sn;
+			if (cmd == IKCP_CMD_SACK) {
+				if (ikcp_parse_sack(kcp, una, data, len, &maxsn))
+					return -2;
+				// the peer knows that we support it
+				kcp->rmt_sack = 1;
+				kcp->sack_adv = IKCP_SACK_ADV;
+			}
 			if (_itimediff(kcp->current, ts) >= 0) {
-				ikcp_update_ack(
-					kcp, _itimediff(kcp->current, ts));
+				rtt = _itimediff(kcp->current, ts);
+				ikcp_update_ack(kcp, rtt);
 			}
 			ikcp_parse_ack(kcp, sn);
 			ikcp_shrink_buf(kcp);
 			if (flag == 0) {
 				flag = 1;
-				maxack = sn;
+				maxack = maxsn;
 				latest_ts = ts;
 			} else {
-				if (_itimediff(sn, maxack) > 0) {
+				if (_itimediff(maxsn, maxack) > 0) {
 #ifndef IKCP_FASTACK_CONSERVE
-					maxack = sn;
+					maxack = maxsn;
 					latest_ts = ts;
 #else
 					if (_itimediff(ts, latest_ts) > 0) {
-						maxack = sn;
+						maxack = maxsn;
 						latest_ts = ts;
 					}
 #endif
@@ -832,9 +1340,17 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					(unsigned long)sn, (unsigned long)ts);
 			}
 			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+				// a gap, a duplicate or the repair of a gap
+				if (sn != kcp->rcv_nxt || kcp->nrcv_buf > 0)
+					kcp->ack_now = 1;
 				ikcp_ack_push(kcp, sn, ts);
 				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
-					seg = ikcp_segment_new(kcp, len);
+					if (ref != NULL && len > 0) {
+						seg = ikcp_segment_borrow(
+							kcp, data, ref);
+					} else {
+						seg = ikcp_segment_new(kcp, len);
+					}
 					seg->conv = conv;
 					seg->cmd = cmd;
 					seg->frg = frg;
@@ -844,7 +1360,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					seg->una = una;
 					seg->len = len;
 
-					if (len > 0) {
+					if (len > 0 && seg->ref == NULL) {
 						memcpy(seg->data, data, len);
 					}
 
@@ -859,7 +1375,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
 			}
 		} else if (cmd == IKCP_CMD_WINS) {
-			// do nothing
+			// older versions always send frg=0 and never set it
+			if (frg == IKCP_FEAT_SACK)
+				kcp->rmt_sack = 1;
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_WINS)) {
 				ikcp_log(
 					kcp, IKCP_LOG_IN_WINS,
@@ -878,31 +1396,41 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		ikcp_parse_fastack(kcp, maxack, latest_ts);
 	}
 
-	if (_itimediff(kcp->snd_una, prev_una) > 0) {
-		if (kcp->cwnd < kcp->rmt_wnd) {
-			uint32_t mss = kcp->mss;
-			if (kcp->cwnd < kcp->ssthresh) {
-				kcp->cwnd++;
-				kcp->incr += mss;
-			} else {
-				if (kcp->incr < mss)
-					kcp->incr = mss;
-				kcp->incr +=
-					(mss * mss) / kcp->incr + (mss / 16);
-				if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-#if 1
-					kcp->cwnd = (kcp->incr + mss - 1) /
-						    ((mss > 0) ? mss : 1);
-#else
-					kcp->cwnd++;
-#endif
-				}
-			}
-			if (kcp->cwnd > kcp->rmt_wnd) {
-				kcp->cwnd = kcp->rmt_wnd;
-				kcp->incr = kcp->rmt_wnd * mss;
-			}
+	// the segments sent before the delivered ones are lost once the
+	// reordering window has passed, the earliest one goes first
+	if (kcp->rs_acked > 0 && kcp->nsnd_buf > 0 && kcp->rack_set &&
+	    _itimediff(kcp->ts_oldest, kcp->rack_ts) <= 0) {
+		uint32_t ts = kcp->ts_oldest + kcp->rack_rtt +
+			      ikcp_rack_reo_wnd(kcp);
+		if (_itimediff(ts, kcp->ts_resend) < 0)
+			kcp->ts_resend = ts;
+	}
+
+	// the probe, if any, has done its job
+	if (kcp->rs_acked > 0) {
+		kcp->tlp_out = 0;
+	}
+
+	if (kcp->rs_acked > 0 || _itimediff(kcp->snd_una, prev_una) > 0) {
+		struct IKCPRS rs;
+		rs.acked = kcp->rs_acked;
+		rs.delivered = 0;
+		rs.interval = 0;
+		rs.app_limited = 0;
+		if (kcp->rs_acked > 0) {
+			rs.delivered = kcp->delivered - kcp->rs_delivered;
+			rs.interval = _itimediff(kcp->current, kcp->rs_ts);
+			rs.app_limited = kcp->rs_app_limited;
+			kcp->delivered_ts = kcp->current;
 		}
+		rs.rtt = rtt;
+		rs.prior_inflight = prior_inflight;
+		rs.una_advanced = _itimediff(kcp->snd_una, prev_una) > 0;
+		if (kcp->app_limited != 0 &&
+		    _itimediff(kcp->delivered, kcp->app_limited) > 0) {
+			kcp->app_limited = 0;
+		}
+		kcp->cc->on_ack(kcp, kcp->cc_state, &rs);
 	}
 
 	return 0;
@@ -932,20 +1460,81 @@ static int ikcp_wnd_unused(const ikcpcb *kcp)
 	return 0;
 }
 
+//---------------------------------------------------------------------
+// pacing: new segments spend a budget refilled at pacing_rate
+//---------------------------------------------------------------------
+uint32_t ikcp_pacing_rate(const ikcpcb *kcp)
+{
+	uint32_t wnd;
+	uint64_t rate;
+	if (kcp->nocwnd == 0 && kcp->pacing_rate > 0)
+		return kcp->pacing_rate;
+	if (kcp->pacing == IKCP_PACING_CC || kcp->rx_srtt <= 0)
+		return 0;
+	wnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+	if (kcp->nocwnd == 0)
+		wnd = _imin_(kcp->cwnd, wnd);
+	// twice the window per srtt, so the window is never paced down
+	rate = (uint64_t)wnd * (kcp->mss + IKCP_OVERHEAD) * 2000 /
+		(uint32_t)kcp->rx_srtt;
+	if (rate == 0)
+		return 1;
+	return rate < 0xffffffff ? (uint32_t)rate : 0xffffffff;
+}
+
+static void ikcp_pacing_refill(ikcpcb *kcp, uint32_t rate, uint32_t current)
+{
+	int32_t elapsed = _itimediff(current, kcp->ts_pacing);
+	uint64_t credit, burst;
+	if (elapsed <= 0)
+		return;
+	credit = (uint64_t)rate * (uint32_t)elapsed / 1000;
+	// keep the elapsed time until it is worth at least a byte
+	if (credit == 0)
+		return;
+	kcp->ts_pacing = current;
+	// burst up to 2 millisec of sending, but at least 2 segments
+	burst = (uint64_t)rate * 2 / 1000;
+	if (burst < 2 * kcp->mtu)
+		burst = 2 * kcp->mtu;
+	if (kcp->pacing_budget + (int64_t)credit > (int64_t)burst)
+		kcp->pacing_budget = (int32_t)_imin_(burst, 0x7fffffff);
+	else
+		kcp->pacing_budget += (int32_t)credit;
+}
+
+// millisec until the budget allows the next segment
+static int32_t ikcp_pacing_wait(const ikcpcb *kcp, uint32_t current)
+{
+	int64_t deficit = 1 - (int64_t)kcp->pacing_budget;
+	uint32_t rate = ikcp_pacing_rate(kcp);
+	int64_t wait;
+	if (deficit <= 0 || rate == 0)
+		return 0;
+	wait = (deficit * 1000 + rate - 1) / rate;
+	wait -= _itimediff(current, kcp->ts_pacing);
+	return wait > 0 ? (int32_t)wait : 0;
+}
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
 void ikcp_flush(ikcpcb *kcp)
 {
 	uint32_t current = kcp->current;
-	char *buffer = kcp->buffer;
-	char *ptr = buffer;
+	char *buffer = NULL;
+	char *ptr = NULL;
 	int count, size, i;
 	uint32_t resent, cwnd;
-	uint32_t rtomin;
-	struct IQUEUEHEAD *p;
+	uint32_t rtomin, ts_resend, reo_wnd, fastack_min = 0;
+	uint32_t ts_oldest = current;
+	struct IQUEUEHEAD *p, *last;
+	IKCPSEG *probe = NULL;
 	int change = 0;
 	int lost = 0;
+	int scan;
+	uint32_t rate;
+	int pacing;
 	IKCPSEG seg;
 
 	// 'ikcp_update' haven't been called.
@@ -963,17 +1552,32 @@ void ikcp_flush(ikcpcb *kcp)
 
 	// flush acknowledges
 	count = kcp->ackcount;
-	for (i = 0; i < count; i++) {
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+	if (count > 0 && kcp->sack && kcp->rmt_sack) {
+		int cap = _imin_(IKCP_SACK_MAXLEN, kcp->mss);
+		ptr = ikcp_reserve(kcp, &buffer, ptr, (int)IKCP_OVERHEAD + cap);
+		seg.cmd = IKCP_CMD_SACK;
+		ikcp_ack_get(kcp, count - 1, &seg.sn, &seg.ts);
+		seg.len = ikcp_encode_sack(kcp, ptr + IKCP_OVERHEAD, cap);
+		ptr = ikcp_encode_seg(ptr, &seg) + seg.len;
+		seg.len = 0;
+	} else {
+		for (i = 0; i < count; i++) {
+			ptr = ikcp_reserve(
+				kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
+			ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
+			ptr = ikcp_encode_seg(ptr, &seg);
 		}
-		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-		ptr = ikcp_encode_seg(ptr, &seg);
 	}
 
 	kcp->ackcount = 0;
+	kcp->ack_now = 0;
+
+	// advertise sack while data is flowing
+	if (kcp->sack && kcp->sack_adv < IKCP_SACK_ADV &&
+	    (count > 0 || kcp->nsnd_buf > 0 || kcp->nsnd_que > 0)) {
+		kcp->probe |= IKCP_ASK_TELL;
+		kcp->sack_adv++;
+	}
 
 	// probe window size (if remote window size equals zero)
 	if (kcp->rmt_wnd == 0) {
@@ -999,37 +1603,52 @@ void ikcp_flush(ikcpcb *kcp)
 	// flush window probing commands
 	if (kcp->probe & IKCP_ASK_SEND) {
 		seg.cmd = IKCP_CMD_WASK;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
+		ptr = ikcp_reserve(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
 		ptr = ikcp_encode_seg(ptr, &seg);
 	}
 
 	// flush window probing commands
 	if (kcp->probe & IKCP_ASK_TELL) {
 		seg.cmd = IKCP_CMD_WINS;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
+		seg.frg = kcp->sack ? IKCP_FEAT_SACK : 0;
+		ptr = ikcp_reserve(kcp, &buffer, ptr, (int)IKCP_OVERHEAD);
 		ptr = ikcp_encode_seg(ptr, &seg);
+		seg.frg = 0;
 	}
 
 	kcp->probe = 0;
 
 	// calculate window size
 	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
-	if (kcp->nocwnd == 0)
+	if (kcp->nocwnd == 0) {
 		cwnd = _imin_(kcp->cwnd, cwnd);
+	}
+	rate = 0;
+	if (kcp->pacing != IKCP_PACING_EXTERNAL) {
+		rate = ikcp_pacing_rate(kcp);
+	}
+	pacing = rate > 0;
+	if (pacing) {
+		ikcp_pacing_refill(kcp, rate, current);
+	}
+	kcp->paced = 0;
+
+	// the delivery rate is sampled from the start of a flight
+	if (kcp->nsnd_buf == 0)
+		kcp->delivered_ts = current;
+
+	// segments moved in are all behind the current tail
+	last = kcp->snd_buf.prev;
 
 	// move data from snd_queue to snd_buf
 	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
 		IKCPSEG *newseg;
 		if (iqueue_is_empty(&kcp->snd_queue))
 			break;
+		if (pacing && kcp->pacing_budget <= 0) {
+			kcp->paced = 1;
+			break;
+		}
 
 		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
@@ -1048,16 +1667,49 @@ void ikcp_flush(ikcpcb *kcp)
 		newseg->rto = kcp->rx_rto;
 		newseg->fastack = 0;
 		newseg->xmit = 0;
+		kcp->snd_ring[newseg->sn & kcp->snd_mask] = newseg;
+		if (pacing)
+			kcp->pacing_budget -= IKCP_OVERHEAD + newseg->len;
+	}
+
+	// samples taken while short of data do not reflect the path
+	if (iqueue_is_empty(&kcp->snd_queue) &&
+	    _itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+		uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
+		kcp->app_limited = (kcp->delivered + inflight * kcp->mss) | 1;
 	}
 
 	// calculate resent
 	resent = (kcp->fastresend > 0) ? (uint32_t)kcp->fastresend : 0xffffffff;
 	rtomin = (kcp->nodelay == 0) ? (kcp->rx_rto >> 3) : 0;
+	reo_wnd = ikcp_rack_reo_wnd(kcp);
+
+	// probe with the tail if the flight is silent and nothing new is sent
+	if (kcp->tlp_armed && !kcp->tlp_out && last != &kcp->snd_buf &&
+	    last == kcp->snd_buf.prev &&
+	    _itimediff(current, kcp->ts_tlp) >= 0) {
+		probe = iqueue_entry(last, IKCPSEG, node);
+		kcp->tlp_out = 1;
+	}
+
+	// only visit the new segments unless some others are due
+	if (last == &kcp->snd_buf || kcp->fastack_due || probe != NULL ||
+	    _itimediff(current, kcp->ts_resend) >= 0) {
+		p = kcp->snd_buf.next;
+		ts_resend = current + 0x7fffffff;
+		kcp->fastack_due = 0;
+		scan = 1;
+	} else {
+		p = last->next;
+		ts_resend = kcp->ts_resend;
+		scan = 0;
+	}
 
 	// flush data segments
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+	for (; p != &kcp->snd_buf; p = p->next) {
 		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
 		int needsend = 0;
+		int32_t wait = -1;
 		if (segment->xmit == 0) {
 			needsend = 1;
 			segment->xmit++;
@@ -1079,7 +1731,13 @@ void ikcp_flush(ikcpcb *kcp)
 			}
 			segment->resendts = current + segment->rto;
 			lost = 1;
-		} else if (segment->fastack >= resent) {
+		} else if ((wait = ikcp_rack_wait(kcp, segment, reo_wnd)) == 0) {
+			needsend = 1;
+			segment->xmit++;
+			segment->fastack = 0;
+			segment->resendts = current + segment->rto;
+			change++;
+		} else if (ikcp_fastack(kcp, segment) >= resent) {
 			if ((int)segment->xmit <= kcp->fastlimit ||
 			    kcp->fastlimit <= 0) {
 				needsend = 1;
@@ -1088,6 +1746,10 @@ void ikcp_flush(ikcpcb *kcp)
 				segment->resendts = current + segment->rto;
 				change++;
 			}
+		} else if (segment == probe) {
+			needsend = 1;
+			segment->xmit++;
+			segment->resendts = current + segment->rto;
 		}
 
 		if (needsend) {
@@ -1095,15 +1757,13 @@ void ikcp_flush(ikcpcb *kcp)
 			segment->ts = current;
 			segment->wnd = seg.wnd;
 			segment->una = kcp->rcv_nxt;
+			segment->delivered = kcp->delivered;
+			segment->delivered_ts = kcp->delivered_ts;
+			segment->app_limited = kcp->app_limited != 0;
+			kcp->ts_xmit = current;
 
-			size = (int)(ptr - buffer);
 			need = IKCP_OVERHEAD + segment->len;
-
-			if (size + need > (int)kcp->mtu) {
-				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
-			}
-
+			ptr = ikcp_reserve(kcp, &buffer, ptr, need);
 			ptr = ikcp_encode_seg(ptr, segment);
 
 			if (segment->len > 0) {
@@ -1115,30 +1775,70 @@ void ikcp_flush(ikcpcb *kcp)
 				kcp->state = (uint32_t)-1;
 			}
 		}
+
+		if (_itimediff(segment->resendts, ts_resend) < 0)
+			ts_resend = segment->resendts;
+		if (wait > 0 && _itimediff(current + wait, ts_resend) < 0)
+			ts_resend = current + wait;
+
+		if (scan && !needsend && segment->fastack == 0 &&
+		    kcp->fastack_seq != 0 &&
+		    _itimediff(segment->sn, kcp->fastack_sn) < 0) {
+			// resent since ikcp_parse_fastack has passed it
+#ifdef IKCP_FASTACK_CONSERVE
+			if (_itimediff(kcp->fastack_ts, segment->ts) >= 0)
+#endif
+				segment->fastack = kcp->fastack_seq;
+		}
+		if (scan && segment->fastack != 0 &&
+		    ((int)segment->xmit <= kcp->fastlimit ||
+		     kcp->fastlimit <= 0) &&
+		    (fastack_min == 0 ||
+		     _itimediff(segment->fastack, fastack_min) < 0))
+			fastack_min = segment->fastack;
+		if (_itimediff(segment->ts, ts_oldest) < 0)
+			ts_oldest = segment->ts;
 	}
+	// the new segments are sent no earlier than the others
+	if (scan) {
+		kcp->fastack_min = fastack_min;
+		kcp->ts_oldest = ts_oldest;
+	}
+
+	// the probe is due 2 srtt after the latest transmission
+	kcp->tlp_armed = 0;
+	if (kcp->nsnd_buf == 0) {
+		kcp->tlp_out = 0;
+	} else if (!kcp->tlp_out && kcp->rx_srtt > 0) {
+		uint32_t pto = 2 * (uint32_t)kcp->rx_srtt;
+		// a single segment may wait for a delayed ack, assuming that
+		// the peer uses the same ack policy
+		if (kcp->nsnd_buf == 1)
+			pto += kcp->ack_freq > 0 ? kcp->ack_delay : kcp->interval;
+		kcp->ts_tlp = kcp->ts_xmit + pto;
+		kcp->tlp_armed = 1;
+		if (_itimediff(kcp->ts_tlp, ts_resend) < 0)
+			ts_resend = kcp->ts_tlp;
+	}
+	kcp->ts_resend = ts_resend;
 
 	// flash remain segments
-	size = (int)(ptr - buffer);
-	if (size > 0) {
+	if (buffer != NULL) {
+		size = (int)(ptr - buffer);
 		ikcp_output(kcp, buffer, size);
 	}
 
-	// update ssthresh
+	// let the congestion control react
 	if (change) {
-		uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
-		kcp->ssthresh = inflight / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = kcp->ssthresh + resent;
-		kcp->incr = kcp->cwnd * kcp->mss;
+		if (++kcp->rack_recoveries >= IKCP_RACK_RECOVERIES) {
+			kcp->rack_reo_mult = 1;
+			kcp->rack_recoveries = 0;
+		}
+		kcp->cc->on_loss(kcp, kcp->cc_state, IKCP_LOSS_FAST, cwnd);
 	}
 
 	if (lost) {
-		kcp->ssthresh = cwnd / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = 1;
-		kcp->incr = kcp->mss;
+		kcp->cc->on_loss(kcp, kcp->cc_state, IKCP_LOSS_RTO, cwnd);
 	}
 
 	if (kcp->cwnd < 1) {
@@ -1176,6 +1876,14 @@ void ikcp_update(ikcpcb *kcp, uint32_t current)
 			kcp->ts_flush = kcp->current + kcp->interval;
 		}
 		ikcp_flush(kcp);
+	} else if (kcp->nsnd_buf > 0 &&
+		   _itimediff(current, kcp->ts_resend) >= 0) {
+		// retransmissions are not delayed to the next interval
+		ikcp_flush(kcp);
+	} else if (ikcp_ack_wait(kcp, current) == 0) {
+		ikcp_flush(kcp);
+	} else if (kcp->paced && ikcp_pacing_wait(kcp, current) == 0) {
+		ikcp_flush(kcp);
 	}
 }
 
@@ -1194,7 +1902,6 @@ uint32_t ikcp_check(const ikcpcb *kcp, uint32_t current)
 	int32_t tm_flush = 0x7fffffff;
 	int32_t tm_packet = 0x7fffffff;
 	uint32_t minimal = 0;
-	struct IQUEUEHEAD *p;
 
 	if (kcp->updated == 0) {
 		return current;
@@ -1211,14 +1918,30 @@ uint32_t ikcp_check(const ikcpcb *kcp, uint32_t current)
 
 	tm_flush = _itimediff(ts_flush, current);
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		int32_t diff = _itimediff(seg->resendts, current);
+	if (kcp->nsnd_buf > 0) {
+		int32_t diff = _itimediff(kcp->ts_resend, current);
 		if (diff <= 0) {
 			return current;
 		}
-		if (diff < tm_packet)
-			tm_packet = diff;
+		tm_packet = diff;
+	}
+
+	if (kcp->paced) {
+		int32_t wait = ikcp_pacing_wait(kcp, current);
+		if (wait <= 0) {
+			return current;
+		}
+		if (wait < tm_packet)
+			tm_packet = wait;
+	}
+
+	if (kcp->ackcount > 0) {
+		int32_t wait = ikcp_ack_wait(kcp, current);
+		if (wait == 0) {
+			return current;
+		}
+		if (wait > 0 && wait < tm_packet)
+			tm_packet = wait;
 	}
 
 	minimal = (uint32_t)(tm_packet < tm_flush ? tm_packet : tm_flush);
@@ -1228,9 +1951,49 @@ uint32_t ikcp_check(const ikcpcb *kcp, uint32_t current)
 	return current + minimal;
 }
 
+// stream mode: split a queued segment larger than mss
+static int ikcp_split(ikcpcb *kcp, IKCPSEG *seg)
+{
+	struct IQUEUEHEAD pieces;
+	IKCPSEG *piece;
+	uint32_t off, size;
+	int count = 0;
+	assert(seg->ref == NULL);
+	iqueue_init(&pieces);
+	for (off = 0; off < seg->len; off += size) {
+		size = _imin_(seg->len - off, kcp->mss);
+		piece = ikcp_segment_new(kcp, (int)size);
+		if (piece == NULL) {
+			while (!iqueue_is_empty(&pieces)) {
+				piece = iqueue_entry(pieces.next, IKCPSEG, node);
+				iqueue_del(&piece->node);
+				ikcp_segment_delete(kcp, piece);
+			}
+			return -2;
+		}
+		memcpy(piece->data, seg->data + off, size);
+		piece->len = size;
+		piece->frg = 0;
+		iqueue_add_tail(&piece->node, &pieces);
+		count++;
+	}
+	// in place of the segment, keeping the order
+	while (!iqueue_is_empty(&pieces)) {
+		piece = iqueue_entry(pieces.next, IKCPSEG, node);
+		iqueue_del(&piece->node);
+		iqueue_add_tail(&piece->node, &seg->node);
+	}
+	iqueue_del(&seg->node);
+	ikcp_segment_delete(kcp, seg);
+	kcp->nsnd_que += count - 1;
+	return 0;
+}
+
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
+	struct IQUEUEHEAD *p, *next;
 	char *buffer;
+	int oversized = 0;
 	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD)
 		return -1;
 	buffer = (char *)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
@@ -1240,7 +2003,21 @@ int ikcp_setmtu(ikcpcb *kcp, int mtu)
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
 	ikcp_free(kcp->buffer);
 	kcp->buffer = buffer;
-	return 0;
+	for (p = kcp->snd_queue.next; p != &kcp->snd_queue; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		next = p->next;
+		if (seg->len <= kcp->mss)
+			continue;
+		if (kcp->stream == 0 || ikcp_split(kcp, seg) != 0)
+			oversized = 1;
+	}
+	// segments already sent can only be retransmitted as they are
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		if (seg->len > kcp->mss)
+			oversized = 1;
+	}
+	return oversized;
 }
 
 int ikcp_interval(ikcpcb *kcp, int interval)
@@ -1253,6 +2030,42 @@ int ikcp_interval(ikcpcb *kcp, int interval)
 	return 0;
 }
 
+int ikcp_sack(ikcpcb *kcp, int sack)
+{
+	kcp->sack = sack;
+	return 0;
+}
+
+int ikcp_ackpolicy(ikcpcb *kcp, int freq, int delay)
+{
+	if (freq < 0 || delay < 0)
+		return -1;
+	kcp->ack_freq = (uint32_t)freq;
+	kcp->ack_delay = (uint32_t)delay;
+	return 0;
+}
+
+int32_t ikcp_ack_wait(const ikcpcb *kcp, uint32_t current)
+{
+	int32_t wait;
+	if (kcp->ack_freq == 0 || kcp->ackcount == 0)
+		return -1;
+	if (kcp->ack_now || kcp->ackcount >= kcp->ack_freq)
+		return 0;
+	wait = _itimediff(kcp->ts_ack + kcp->ack_delay, current);
+	return wait > 0 ? wait : 0;
+}
+
+int ikcp_pacing(ikcpcb *kcp, int pacing)
+{
+	if (pacing < IKCP_PACING_CC || pacing > IKCP_PACING_EXTERNAL)
+		return -1;
+	kcp->pacing = pacing;
+	kcp->pacing_budget = 0;
+	kcp->paced = 0;
+	return 0;
+}
+
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 {
 	if (nodelay >= 0) {
@@ -1283,10 +2096,17 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 {
 	if (kcp) {
 		if (sndwnd > 0) {
+			if (ikcp_ring_reserve(
+				    &kcp->snd_ring, &kcp->snd_mask, sndwnd))
+				return -2;
 			kcp->snd_wnd = sndwnd;
 		}
 		if (rcvwnd > 0) { // must >= max fragment size
-			kcp->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
+			rcvwnd = _imax_(rcvwnd, IKCP_WND_RCV);
+			if (ikcp_ring_reserve(
+				    &kcp->rcv_ring, &kcp->rcv_mask, rcvwnd))
+				return -2;
+			kcp->rcv_wnd = rcvwnd;
 		}
 	}
 	return 0;
@@ -1304,3 +2124,423 @@ uint32_t ikcp_getconv(const void *ptr)
 	ikcp_decode32u((const char *)ptr, &conv);
 	return conv;
 }
+
+uint32_t ikcp_getuna(const void *ptr)
+{
+	uint32_t una;
+	ikcp_decode32u((const char *)ptr + 16, &una);
+	return una;
+}
+
+long ikcp_span(const void *ptr, long size)
+{
+	const char *data = (const char *)ptr;
+	uint32_t first, conv, len;
+	long pos = 0;
+	if (size < (long)IKCP_OVERHEAD)
+		return size;
+	ikcp_decode32u(data, &first);
+	while (size - pos >= (long)IKCP_OVERHEAD) {
+		ikcp_decode32u(data + pos, &conv);
+		if (conv != first)
+			return pos;
+		ikcp_decode32u(data + pos + 20, &len);
+		// malformed, leave it to ikcp_input
+		if (len > (uint32_t)(size - pos) - IKCP_OVERHEAD)
+			return size;
+		pos += (long)IKCP_OVERHEAD + (long)len;
+	}
+	// trailing bytes are ignored by ikcp_input
+	return size;
+}
+
+
+//=====================================================================
+// CONGESTION CONTROL
+//=====================================================================
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc)
+{
+	void *state = NULL;
+	if (cc->size > 0) {
+		state = ikcp_malloc(cc->size);
+		if (state == NULL)
+			return -2;
+		memset(state, 0, cc->size);
+	}
+	if (kcp->cc_state) {
+		ikcp_free(kcp->cc_state);
+	}
+	kcp->cc = cc;
+	kcp->cc_state = state;
+	kcp->cwnd = 0;
+	kcp->incr = 0;
+	kcp->ssthresh = IKCP_THRESH_INIT;
+	kcp->pacing_rate = 0;
+	kcp->pacing_budget = 0;
+	kcp->paced = 0;
+	if (cc->init) {
+		cc->init(kcp, state);
+	}
+	return 0;
+}
+
+const struct IKCPCC *ikcp_findcc(const char *name)
+{
+	static const struct IKCPCC *const builtin[] = {
+		&ikcp_cc_reno,
+		&ikcp_cc_bbr,
+	};
+	size_t i;
+	for (i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+		if (strcmp(builtin[i]->name, name) == 0)
+			return builtin[i];
+	}
+	return NULL;
+}
+
+//---------------------------------------------------------------------
+// reno: slow start and congestion avoidance, collapses on timeout
+//---------------------------------------------------------------------
+static void ikcp_reno_on_ack(ikcpcb *kcp, void *state,
+	const struct IKCPRS *rs)
+{
+	uint32_t mss = kcp->mss;
+	(void)state;
+	if (!rs->una_advanced || kcp->cwnd >= kcp->rmt_wnd)
+		return;
+	if (kcp->cwnd < kcp->ssthresh) {
+		kcp->cwnd++;
+		kcp->incr += mss;
+	} else {
+		if (kcp->incr < mss)
+			kcp->incr = mss;
+		kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+		if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+			kcp->cwnd = (kcp->incr + mss - 1) / ((mss > 0) ? mss : 1);
+		}
+	}
+	if (kcp->cwnd > kcp->rmt_wnd) {
+		kcp->cwnd = kcp->rmt_wnd;
+		kcp->incr = kcp->rmt_wnd * mss;
+	}
+}
+
+static void ikcp_reno_on_loss(ikcpcb *kcp, void *state, int kind,
+	uint32_t wnd)
+{
+	(void)state;
+	if (kind == IKCP_LOSS_FAST) {
+		uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
+		kcp->ssthresh = inflight / 2;
+		if (kcp->ssthresh < IKCP_THRESH_MIN)
+			kcp->ssthresh = IKCP_THRESH_MIN;
+		kcp->cwnd = kcp->ssthresh + (uint32_t)kcp->fastresend;
+		kcp->incr = kcp->cwnd * kcp->mss;
+	} else {
+		kcp->ssthresh = wnd / 2;
+		if (kcp->ssthresh < IKCP_THRESH_MIN)
+			kcp->ssthresh = IKCP_THRESH_MIN;
+		kcp->cwnd = 1;
+		kcp->incr = kcp->mss;
+	}
+}
+
+const struct IKCPCC ikcp_cc_reno = {
+	"reno", 0, NULL, ikcp_reno_on_ack, ikcp_reno_on_loss,
+};
+
+//---------------------------------------------------------------------
+// bbr: model based, the window and the pacing rate follow the max
+// delivery rate and the min rtt, random loss is not a congestion signal
+//---------------------------------------------------------------------
+#define IKCP_BBR_UNIT		256	// fixed point of gains
+#define IKCP_BBR_HIGH_GAIN	(IKCP_BBR_UNIT * 2885 / 1000 + 1)
+#define IKCP_BBR_DRAIN_GAIN	(IKCP_BBR_UNIT * 1000 / 2885)
+#define IKCP_BBR_CWND_GAIN	(IKCP_BBR_UNIT * 2)
+#define IKCP_BBR_CYCLE_LEN	8
+#define IKCP_BBR_BW_ROUNDS	10	// max filter, in round trips
+#define IKCP_BBR_RTT_WIN	10000	// min filter, in millisec
+#define IKCP_BBR_PROBE_RTT_TIME	200	// millisec at the minimal window
+#define IKCP_BBR_FULL_ROUNDS	3
+#define IKCP_BBR_CWND_MIN	4
+#define IKCP_BBR_CWND_INIT	10
+
+enum {
+	IKCP_BBR_STARTUP,
+	IKCP_BBR_DRAIN,
+	IKCP_BBR_PROBE_BW,
+	IKCP_BBR_PROBE_RTT,
+};
+
+static const uint32_t ikcp_bbr_cycle[IKCP_BBR_CYCLE_LEN] = {
+	IKCP_BBR_UNIT * 5 / 4, IKCP_BBR_UNIT * 3 / 4,
+	IKCP_BBR_UNIT, IKCP_BBR_UNIT, IKCP_BBR_UNIT,
+	IKCP_BBR_UNIT, IKCP_BBR_UNIT, IKCP_BBR_UNIT,
+};
+
+struct IKCPBBR
+{
+	int mode;
+	// max delivery rate of each recent round, bytes per second
+	uint32_t bw[IKCP_BBR_BW_ROUNDS];
+	uint32_t round, next_round_delivered;
+	uint32_t min_rtt, ts_min_rtt;
+	uint32_t full_bw;
+	int full_bw_cnt, filled_pipe;
+	int cycle_idx;
+	uint32_t ts_cycle;
+	int probe_rtt_armed, probe_rtt_round_done;
+	uint32_t ts_probe_rtt_done;
+	uint32_t pacing_gain, cwnd_gain;
+	// packet conservation after a loss, until the round ends
+	int recovery;
+	uint32_t recovery_round;
+	uint32_t prior_cwnd;
+};
+
+static uint32_t ikcp_bbr_max_bw(const struct IKCPBBR *bbr)
+{
+	uint32_t bw = 0;
+	int i;
+	for (i = 0; i < IKCP_BBR_BW_ROUNDS; i++) {
+		if (bbr->bw[i] > bw)
+			bw = bbr->bw[i];
+	}
+	return bw;
+}
+
+// segments in flight to reach gain * bdp
+static uint32_t ikcp_bbr_target(const ikcpcb *kcp,
+	const struct IKCPBBR *bbr, uint32_t gain)
+{
+	uint32_t bw = ikcp_bbr_max_bw(bbr);
+	uint32_t size = kcp->mss + IKCP_OVERHEAD;
+	uint64_t bdp;
+	if (bw == 0 || bbr->min_rtt == 0xffffffff)
+		return IKCP_BBR_CWND_INIT;
+	bdp = (uint64_t)bw * bbr->min_rtt / 1000;
+	bdp = bdp * gain / IKCP_BBR_UNIT;
+	// acks are delayed by up to an interval
+	bdp += (uint64_t)bw * kcp->interval / 1000;
+	bdp = (bdp + size - 1) / size;
+	if (bdp < IKCP_BBR_CWND_MIN)
+		return IKCP_BBR_CWND_MIN;
+	return bdp < 0xffffffff ? (uint32_t)bdp : 0xffffffff;
+}
+
+static void ikcp_bbr_set_pacing(ikcpcb *kcp, const struct IKCPBBR *bbr)
+{
+	uint32_t bw = ikcp_bbr_max_bw(bbr);
+	uint64_t rate;
+	if (bw == 0) {
+		// the initial window over the smoothed rtt
+		uint32_t rtt = kcp->rx_srtt > 0 ? (uint32_t)kcp->rx_srtt : 1;
+		rate = (uint64_t)IKCP_BBR_CWND_INIT *
+			(kcp->mss + IKCP_OVERHEAD) * 1000 / rtt;
+		rate = rate * IKCP_BBR_HIGH_GAIN / IKCP_BBR_UNIT;
+	} else {
+		rate = (uint64_t)bw * bbr->pacing_gain / IKCP_BBR_UNIT;
+	}
+	if (rate > 0xffffffff)
+		rate = 0xffffffff;
+	if (rate == 0)
+		rate = 1;
+	// do not slow down before the pipe is filled
+	if (bbr->filled_pipe || rate > kcp->pacing_rate)
+		kcp->pacing_rate = (uint32_t)rate;
+}
+
+static void ikcp_bbr_enter_probe_bw(ikcpcb *kcp, struct IKCPBBR *bbr)
+{
+	bbr->mode = IKCP_BBR_PROBE_BW;
+	bbr->cwnd_gain = IKCP_BBR_CWND_GAIN;
+	// start at a random phase other than draining
+	bbr->cycle_idx = 2 + (int)((kcp->conv ^ kcp->current) %
+		(IKCP_BBR_CYCLE_LEN - 2));
+	bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle_idx];
+	bbr->ts_cycle = kcp->current;
+}
+
+static void ikcp_bbr_enter_startup(struct IKCPBBR *bbr)
+{
+	bbr->mode = IKCP_BBR_STARTUP;
+	bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+	bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+}
+
+static void ikcp_bbr_update_cycle(ikcpcb *kcp, struct IKCPBBR *bbr,
+	uint32_t inflight)
+{
+	uint32_t gain = bbr->pacing_gain;
+	int next = _itimediff(kcp->current, bbr->ts_cycle) >
+		(long)bbr->min_rtt;
+	if (gain > IKCP_BBR_UNIT) {
+		// probe until the extra data is actually in flight
+		next = next && inflight >= ikcp_bbr_target(kcp, bbr, gain);
+	} else if (gain < IKCP_BBR_UNIT) {
+		// drain early once the queue is gone
+		next = next ||
+			inflight <= ikcp_bbr_target(kcp, bbr, IKCP_BBR_UNIT);
+	}
+	if (!next)
+		return;
+	bbr->cycle_idx = (bbr->cycle_idx + 1) % IKCP_BBR_CYCLE_LEN;
+	bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle_idx];
+	bbr->ts_cycle = kcp->current;
+}
+
+static void ikcp_bbr_init(ikcpcb *kcp, void *state)
+{
+	struct IKCPBBR *bbr = (struct IKCPBBR *)state;
+	ikcp_bbr_enter_startup(bbr);
+	bbr->min_rtt = 0xffffffff;
+	bbr->ts_min_rtt = kcp->current;
+	bbr->next_round_delivered = kcp->delivered;
+	kcp->cwnd = IKCP_BBR_CWND_INIT;
+	kcp->incr = kcp->cwnd * kcp->mss;
+	ikcp_bbr_set_pacing(kcp, bbr);
+}
+
+static void ikcp_bbr_on_ack(ikcpcb *kcp, void *state,
+	const struct IKCPRS *rs)
+{
+	struct IKCPBBR *bbr = (struct IKCPBBR *)state;
+	uint32_t current = kcp->current;
+	uint32_t inflight = kcp->nsnd_buf;
+	uint32_t cwnd = kcp->cwnd, target;
+	int round_start = 0;
+	int expired;
+
+	// a round trip ends when data sent after its start is delivered
+	if (rs->acked > 0 && _itimediff(kcp->delivered - rs->delivered,
+		bbr->next_round_delivered) >= 0) {
+		bbr->next_round_delivered = kcp->delivered;
+		bbr->round++;
+		bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS] = 0;
+		round_start = 1;
+	}
+
+	// the sample is invalid if it is shorter than the min rtt,
+	// since the acks have been compressed
+	if (rs->acked > 0 && rs->interval > 0 &&
+	    (uint32_t)rs->interval >= bbr->min_rtt) {
+		uint64_t bw = (uint64_t)rs->delivered * 1000 /
+			(uint32_t)rs->interval;
+		uint32_t *slot = &bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS];
+		if (bw > 0xffffffff)
+			bw = 0xffffffff;
+		if (!rs->app_limited || bw >= ikcp_bbr_max_bw(bbr)) {
+			if (bw > *slot)
+				*slot = (uint32_t)bw;
+		}
+	}
+
+	// the clock may not be running when the state is created
+	expired = bbr->min_rtt != 0xffffffff &&
+		_itimediff(current, bbr->ts_min_rtt) > IKCP_BBR_RTT_WIN;
+	if (rs->rtt >= 0 && ((uint32_t)rs->rtt < bbr->min_rtt || expired)) {
+		bbr->min_rtt = rs->rtt > 0 ? (uint32_t)rs->rtt : 1;
+		bbr->ts_min_rtt = current;
+	}
+
+	// the pipe is full if the bandwidth stops growing by 25%
+	if (!bbr->filled_pipe && round_start && !rs->app_limited) {
+		uint32_t bw = ikcp_bbr_max_bw(bbr);
+		if ((uint64_t)bw * 4 >= (uint64_t)bbr->full_bw * 5) {
+			bbr->full_bw = bw;
+			bbr->full_bw_cnt = 0;
+		} else if (++bbr->full_bw_cnt >= IKCP_BBR_FULL_ROUNDS) {
+			bbr->filled_pipe = 1;
+		}
+	}
+
+	if (bbr->mode == IKCP_BBR_STARTUP && bbr->filled_pipe) {
+		bbr->mode = IKCP_BBR_DRAIN;
+		bbr->pacing_gain = IKCP_BBR_DRAIN_GAIN;
+		bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+	}
+	if (bbr->mode == IKCP_BBR_DRAIN &&
+	    inflight <= ikcp_bbr_target(kcp, bbr, IKCP_BBR_UNIT)) {
+		ikcp_bbr_enter_probe_bw(kcp, bbr);
+	}
+	if (bbr->mode == IKCP_BBR_PROBE_BW) {
+		ikcp_bbr_update_cycle(kcp, bbr, inflight);
+	}
+
+	// refresh the min rtt with a minimal window
+	if (bbr->mode != IKCP_BBR_PROBE_RTT && expired) {
+		bbr->mode = IKCP_BBR_PROBE_RTT;
+		bbr->pacing_gain = IKCP_BBR_UNIT;
+		bbr->cwnd_gain = IKCP_BBR_UNIT;
+		if (!bbr->recovery)
+			bbr->prior_cwnd = cwnd;
+		bbr->probe_rtt_armed = 0;
+	}
+	if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+		if (!bbr->probe_rtt_armed && inflight <= IKCP_BBR_CWND_MIN) {
+			bbr->probe_rtt_armed = 1;
+			bbr->probe_rtt_round_done = 0;
+			bbr->ts_probe_rtt_done = current + IKCP_BBR_PROBE_RTT_TIME;
+			bbr->next_round_delivered = kcp->delivered;
+		} else if (bbr->probe_rtt_armed) {
+			if (round_start)
+				bbr->probe_rtt_round_done = 1;
+			if (bbr->probe_rtt_round_done &&
+			    _itimediff(current, bbr->ts_probe_rtt_done) >= 0) {
+				bbr->ts_min_rtt = current;
+				cwnd = _imax_(cwnd, bbr->prior_cwnd);
+				if (bbr->filled_pipe)
+					ikcp_bbr_enter_probe_bw(kcp, bbr);
+				else
+					ikcp_bbr_enter_startup(bbr);
+			}
+		}
+	}
+
+	ikcp_bbr_set_pacing(kcp, bbr);
+
+	target = ikcp_bbr_target(kcp, bbr, bbr->cwnd_gain);
+	if (bbr->recovery && round_start &&
+	    bbr->round != bbr->recovery_round) {
+		bbr->recovery = 0;
+		cwnd = _imax_(cwnd, bbr->prior_cwnd);
+	}
+	if (bbr->recovery) {
+		// send one segment for each one delivered
+		uint32_t span = kcp->snd_nxt - kcp->snd_una;
+		cwnd = _imax_(cwnd, span + rs->acked);
+	} else if (bbr->filled_pipe) {
+		cwnd = _imin_(cwnd + rs->acked, target);
+	} else if (cwnd < target ||
+		kcp->delivered < IKCP_BBR_CWND_INIT * kcp->mtu) {
+		cwnd += rs->acked;
+	}
+	if (bbr->mode == IKCP_BBR_PROBE_RTT)
+		cwnd = _imin_(cwnd, IKCP_BBR_CWND_MIN);
+	cwnd = _imax_(cwnd, IKCP_BBR_CWND_MIN);
+	kcp->cwnd = cwnd;
+	kcp->incr = cwnd * kcp->mss;
+}
+
+static void ikcp_bbr_on_loss(ikcpcb *kcp, void *state, int kind,
+	uint32_t wnd)
+{
+	struct IKCPBBR *bbr = (struct IKCPBBR *)state;
+	uint32_t span = kcp->snd_nxt - kcp->snd_una;
+	(void)kind;
+	(void)wnd;
+	if (!bbr->recovery) {
+		bbr->recovery = 1;
+		bbr->recovery_round = bbr->round;
+		if (bbr->mode != IKCP_BBR_PROBE_RTT)
+			bbr->prior_cwnd = kcp->cwnd;
+	}
+	// no new data until something is delivered
+	kcp->cwnd = _imin_(kcp->cwnd, _imax_(span, IKCP_BBR_CWND_MIN));
+	kcp->incr = kcp->cwnd * kcp->mss;
+}
+
+const struct IKCPCC ikcp_cc_bbr = {
+	"bbr", sizeof(struct IKCPBBR), ikcp_bbr_init, ikcp_bbr_on_ack,
+	ikcp_bbr_on_loss,
+};
@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+struct iovec;
 
 //=====================================================================
 // QUEUE DEFINITION                                                  
@@ -130,12 +131,60 @@ struct IKCPSEG
 	uint32_t len;
 	uint32_t resendts;
 	uint32_t rto;
+	// 'fastack_seq' of the input that first acked beyond it, 0 if none
 	uint32_t fastack;
 	uint32_t xmit;
+	// delivery state when last sent, for rate samples
+	uint32_t delivered;
+	uint32_t delivered_ts;
+	uint32_t app_limited;
+	// allocator of the segment, NULL if from malloc
+	struct mcache *pool;
+	// owner of the borrowed payload, NULL if the payload is inline
+	void *ref;
+	const char *ref_data;
 	char data[1];
 };
 
 
+//---------------------------------------------------------------------
+// congestion control
+//---------------------------------------------------------------------
+struct IKCPCB;
+
+// rate sample of an input which acknowledged segments
+struct IKCPRS
+{
+	uint32_t acked;          // segments newly acknowledged
+	uint32_t delivered;      // bytes delivered during the interval
+	int32_t interval;        // millisec, 0 if not sampled
+	int32_t rtt;             // latest rtt in millisec, -1 if none
+	uint32_t prior_inflight; // segments in flight before the input
+	int una_advanced;        // the cumulative ack moved forward
+	int app_limited;         // the sender was short of data
+};
+
+#define IKCP_LOSS_FAST		1	// fast retransmit
+#define IKCP_LOSS_RTO		2	// retransmission timeout
+
+#define IKCP_PACING_CC		0	// only at the rate set by cc
+#define IKCP_PACING_WINDOW	1	// otherwise spread the window over srtt
+#define IKCP_PACING_EXTERNAL	2	// rate is only reported, see ikcp_pacing_rate
+
+struct IKCPCC
+{
+	const char *name;
+	// size of the per connection state
+	size_t size;
+	void (*init)(struct IKCPCB *kcp, void *state);
+	void (*on_ack)(struct IKCPCB *kcp, void *state,
+		const struct IKCPRS *rs);
+	// 'wnd' is the window used by the flush
+	void (*on_loss)(struct IKCPCB *kcp, void *state, int kind,
+		uint32_t wnd);
+};
+
+
 //---------------------------------------------------------------------
 // IKCPCB
 //---------------------------------------------------------------------
@@ -155,7 +204,52 @@ struct IKCPCB
 	struct IQUEUEHEAD snd_queue;
 	struct IQUEUEHEAD rcv_queue;
 	struct IQUEUEHEAD snd_buf;
-	struct IQUEUEHEAD rcv_buf;
+	// bytes of the first segment in rcv_queue already consumed
+	uint32_t rcv_off;
+	// segments handed out by ikcp_sendroom, not yet in snd_queue
+	struct IQUEUEHEAD snd_room;
+	// sequence number indexed, the size is a power of 2 and at least
+	// the window size
+	struct IKCPSEG **snd_ring, **rcv_ring;
+	uint32_t snd_mask, rcv_mask;
+	// no segment in snd_buf is due before, may be earlier than needed
+	uint32_t ts_resend;
+	int fastack_due;
+	// inputs acking beyond a segment are counted from the one that marked
+	// it, 'fastack_min' is the earliest mark, may be of an acked segment;
+	// the highest sn and the latest transmission acked
+	uint32_t fastack_seq, fastack_min, fastack_sn, fastack_ts;
+	// time based loss detection: a segment is lost once one sent after
+	// it is delivered and the reordering window has passed, see RFC 8985
+	int rack_set;
+	uint32_t rack_ts, rack_sn, rack_rtt, rack_min_rtt;
+	uint32_t rack_reo_mult, rack_recoveries;
+	// the earliest transmission in snd_buf, may be of an acked segment
+	uint32_t ts_oldest;
+	// tail loss probe: resend the last segment when the flight is silent
+	// for 2 srtt, so that a lost tail is not left for the rto
+	uint32_t ts_xmit, ts_tlp;
+	int tlp_armed, tlp_out;
+	// ack frequency, disabled if 'ack_freq' is 0: acks are due once
+	// 'ack_freq' segments are pending, 'ack_delay' millisec after the
+	// first one, or at once when the data arrived out of order
+	uint32_t ack_freq, ack_delay, ts_ack;
+	int ack_now;
+	// selective ack, only sent after the peer advertised it
+	int sack, rmt_sack;
+	uint32_t sack_adv, rcv_max;
+	// congestion control, sets cwnd and optionally the pacing rate
+	const struct IKCPCC *cc;
+	void *cc_state;
+	// delivery rate estimation
+	uint32_t delivered, delivered_ts, app_limited;
+	uint32_t rs_acked, rs_delivered, rs_ts;
+	int rs_app_limited;
+	// pacing of new segments, disabled if the rate (bytes/s) is 0
+	int pacing;
+	uint32_t pacing_rate, ts_pacing;
+	int32_t pacing_budget;
+	int paced;
 	uint32_t *acklist;
 	uint32_t ackcount;
 	uint32_t ackblock;
@@ -166,6 +260,9 @@ struct IKCPCB
 	int nocwnd, stream;
 	int logmask;
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
+	char *(*outbuf)(struct IKCPCB *kcp, void *user);
+	void (*retain)(void *ref, struct IKCPCB *kcp, void *user);
+	void (*release)(void *ref, struct IKCPCB *kcp, void *user);
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
 };
 
@@ -205,9 +302,38 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len, 
 	ikcpcb *kcp, void *user));
 
+// set output buffer callback, which returns at least 'mtu' bytes for kcp
+// to encode the next datagram into, it is then passed to the output
+// callback as 'buf'. returning NULL falls back to the internal buffer
+void ikcp_setoutbuf(ikcpcb *kcp, char *(*outbuf)(ikcpcb *kcp, void *user));
+
+// set reference callbacks for ikcp_input_ref, 'retain' is invoked for
+// each data segment borrowing the input buffer and 'release' when it
+// is deleted
+void ikcp_setref(ikcpcb *kcp,
+	void (*retain)(void *ref, ikcpcb *kcp, void *user),
+	void (*release)(void *ref, ikcpcb *kcp, void *user));
+
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
+// stream mode: the received data in place, fills up to 'n' iovecs with
+// the segments from the front of rcv_queue, returns the number filled
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int n);
+
+// stream mode: releases 'len' bytes from the front of rcv_queue once the
+// upper level is done with them, returns the number released
+int ikcp_consume(ikcpcb *kcp, int len);
+
+// stream mode: room for 'len' bytes to be sent, written in place in new
+// segments of up to mss bytes each: fills up to 'n' iovecs and returns the
+// number filled, returns below zero for error
+int ikcp_sendroom(ikcpcb *kcp, int len, struct iovec *iov, int n);
+
+// stream mode: sends the first 'len' bytes written to the room from
+// ikcp_sendroom and frees the rest, returns the number sent
+int ikcp_sendcommit(ikcpcb *kcp, int len);
+
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
@@ -228,13 +354,20 @@ uint32_t ikcp_check(const ikcpcb *kcp, uint32_t current);
 // when you received a low level packet (eg. UDP packet), call it
 int ikcp_input(ikcpcb *kcp, const char *data, long size);
 
+// same as ikcp_input, but data segments borrow the payload from 'data'
+// instead of copying it, 'ref' is passed to the reference callbacks and
+// 'data' must stay valid until the last release
+int ikcp_input_ref(ikcpcb *kcp, const char *data, long size, void *ref);
+
 // flush pending data
 void ikcp_flush(ikcpcb *kcp);
 
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
-// change MTU size, default is 1400
+// change MTU size, default is 1400. in stream mode, the data queued is split
+// for a smaller mss; returns 1 if there are larger segments left, mostly the
+// ones already sent
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
@@ -250,15 +383,58 @@ uint32_t ikcp_waitsnd(const ikcpcb *kcp);
 // nc: 0:normal congestion control(default), 1:disable congestion control
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc);
 
+// sack: 0:per segment ack, 1:advertise and use selective ack ranges once
+// the peer has advertised them too. disabled after ikcp_create
+int ikcp_sack(ikcpcb *kcp, int sack);
+
+// built-in congestion controls, only used when nc is 0
+// reno: the original loss based window (default)
+// bbr: estimates the bottleneck bandwidth and min rtt, and paces new
+// segments at the estimated rate
+extern const struct IKCPCC ikcp_cc_reno;
+extern const struct IKCPCC ikcp_cc_bbr;
+
+// find a built-in congestion control by name, NULL if not found
+const struct IKCPCC *ikcp_findcc(const char *name);
+
+// change the congestion control, returns below zero if out of memory
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc);
+
+// pacing: IKCP_PACING_CC(default), IKCP_PACING_WINDOW or
+// IKCP_PACING_EXTERNAL when the output schedules the packets itself
+int ikcp_pacing(ikcpcb *kcp, int pacing);
+
+// ack frequency: freq=0 leaves acks to the flush (default), otherwise
+// ikcp_update flushes them by the policy
+int ikcp_ackpolicy(ikcpcb *kcp, int freq, int delay);
+
+// millisec until the pending acks are due, 0 if they are due now,
+// -1 if there is none or the policy is disabled
+int32_t ikcp_ack_wait(const ikcpcb *kcp, uint32_t current);
+
+// the rate that output should be spread at in bytes/s, 0 if unknown
+uint32_t ikcp_pacing_rate(const ikcpcb *kcp);
+
 
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 
-// setup segment allocator
-extern struct mcache *ikcp_segment_pool;
+// setup segment allocators by size, from the smallest, a segment is
+// taken from the first one large enough or from malloc
+#define IKCP_SEGMENT_POOLS 3
+extern _Thread_local struct mcache *ikcp_segment_pool[IKCP_SEGMENT_POOLS];
+// allocator for segments with borrowed payload
+extern _Thread_local struct mcache *ikcp_segment_ref_pool;
 
 // read conv
 uint32_t ikcp_getconv(const void *ptr);
 
+// read una of the first segment, nonzero once the peer has received data
+uint32_t ikcp_getuna(const void *ptr);
+
+// size of the leading segments with the same conv, a datagram may carry
+// segments of several convs back to back
+long ikcp_span(const void *ptr, long size);
+
 
 #ifdef __cplusplus
 }
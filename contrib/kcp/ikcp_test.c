@@ -0,0 +1,95 @@
+//=====================================================================
+//
+// ikcp_test.c - partial consumption of a fragmented message
+//
+//=====================================================================
+#include "ikcp.h"
+
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define MSG_LEN 4000
+#define CONSUMED 10
+
+static ikcpcb *peer[2];
+
+// deliver to the other end at once
+static int output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	(void)kcp;
+	ikcp_input(peer[(long)user], buf, len);
+	return 0;
+}
+
+#define CHECK(cond)                                                            \
+	do {                                                                   \
+		if (!(cond)) {                                                 \
+			fprintf(stderr, "%s:%d: check failed: %s\n",           \
+				__FILE__, __LINE__, #cond);                    \
+			return 1;                                              \
+		}                                                              \
+	} while (0)
+
+int main(void)
+{
+	static char msg[MSG_LEN], buf[MSG_LEN];
+	const int expect = MSG_LEN - CONSUMED;
+	struct iovec iov[8];
+	uint32_t t;
+	int i, n, len;
+
+	for (i = 0; i < MSG_LEN; i++)
+		msg[i] = (char)(i * 7 + i / 251);
+
+	// peer[0] sends to peer[1] and the other way around
+	for (i = 0; i < 2; i++) {
+		peer[i] = ikcp_create(1, (void *)(long)(1 - i));
+		CHECK(peer[i] != NULL);
+		peer[i]->stream = 0;
+		ikcp_setoutput(peer[i], output);
+		ikcp_nodelay(peer[i], 1, 10, 2, 1);
+	}
+
+	CHECK(ikcp_send(peer[0], msg, MSG_LEN) == MSG_LEN);
+	for (t = 0; t < 1000 && peer[1]->nrcv_que < 3; t += 10) {
+		ikcp_update(peer[0], t);
+		ikcp_update(peer[1], t);
+	}
+	// the message takes several fragments
+	CHECK(peer[1]->nrcv_que == 3);
+	CHECK(ikcp_peeksize(peer[1]) == MSG_LEN);
+
+	// the front of the first fragment is handled in place
+	n = ikcp_peekv(peer[1], iov, 8);
+	CHECK(n == 3);
+	CHECK(memcmp(iov[0].iov_base, msg, iov[0].iov_len) == 0);
+	CHECK(ikcp_consume(peer[1], CONSUMED) == CONSUMED);
+
+	n = ikcp_peekv(peer[1], iov, 8);
+	CHECK(n == 3);
+	for (i = 0, len = 0; i < n; i++) {
+		CHECK(memcmp(iov[i].iov_base, msg + CONSUMED + len,
+			     iov[i].iov_len) == 0);
+		len += (int)iov[i].iov_len;
+	}
+	CHECK(len == expect);
+	CHECK(ikcp_peeksize(peer[1]) == expect);
+
+	// peeking leaves the message in place
+	memset(buf, 0, sizeof(buf));
+	CHECK(ikcp_recv(peer[1], buf, -MSG_LEN) == expect);
+	CHECK(memcmp(buf, msg + CONSUMED, expect) == 0);
+	CHECK(peer[1]->nrcv_que == 3);
+
+	memset(buf, 0, sizeof(buf));
+	CHECK(ikcp_recv(peer[1], buf, MSG_LEN) == expect);
+	CHECK(memcmp(buf, msg + CONSUMED, expect) == 0);
+	CHECK(peer[1]->nrcv_que == 0);
+	CHECK(ikcp_peeksize(peer[1]) < 0);
+
+	ikcp_release(peer[0]);
+	ikcp_release(peer[1]);
+	return 0;
+}
@@ -3,7 +3,11 @@
 
 #include "conf.h"
 
+#include "fec.h"
+#include "ikcp.h"
 #include "jsonutil.h"
+#include "pktqueue.h"
+#include "session.h"
 #include "util.h"
 
 #include "utils/slog.h"
@@ -100,6 +104,44 @@ kcp_scope_cb(void *ud, const char *key, const struct jutil_value *value)
 	if (strcmp(key, "flush") == 0) {
 		return jutil_get_int(value, &conf->kcp_flush);
 	}
+	if (strcmp(key, "ackfreq") == 0) {
+		return jutil_get_int(value, &conf->kcp_ackfreq);
+	}
+	if (strcmp(key, "ackdelay") == 0) {
+		return jutil_get_int(value, &conf->kcp_ackdelay);
+	}
+	if (strcmp(key, "sack") == 0) {
+		return jutil_get_bool(value, &conf->kcp_sack);
+	}
+	if (strcmp(key, "pack") == 0) {
+		return jutil_get_bool(value, &conf->kcp_pack);
+	}
+	if (strcmp(key, "mux") == 0) {
+		return jutil_get_bool(value, &conf->kcp_mux);
+	}
+	if (strcmp(key, "autotune") == 0) {
+		return jutil_get_bool(value, &conf->kcp_autotune);
+	}
+	if (strcmp(key, "budget") == 0) {
+		return jutil_get_int(value, &conf->kcp_budget);
+	}
+	if (strcmp(key, "pmtud") == 0) {
+		return jutil_get_bool(value, &conf->kcp_pmtud);
+	}
+	if (strcmp(key, "stripe") == 0) {
+		return jutil_get_int(value, &conf->kcp_stripe);
+	}
+	if (strcmp(key, "datashard") == 0) {
+		return jutil_get_int(value, &conf->kcp_datashard);
+	}
+	if (strcmp(key, "parityshard") == 0) {
+		return jutil_get_int(value, &conf->kcp_parityshard);
+	}
+	if (strcmp(key, "cc") == 0) {
+		UTIL_SAFE_FREE(conf->kcp_cc);
+		conf->kcp_cc = jutil_get_string(value);
+		return conf->kcp_cc != NULL;
+	}
 	LOGW_F("unknown config: \"kcp.%s\"", key);
 	return true;
 }
@@ -134,6 +176,18 @@ udp_scope_cb(void *ud, const char *key, const struct jutil_value *value)
 	if (strcmp(key, "reuseport") == 0) {
 		return jutil_get_bool(value, &conf->udp_reuseport);
 	}
+	if (strcmp(key, "gro") == 0) {
+		return jutil_get_bool(value, &conf->udp_gro);
+	}
+	if (strcmp(key, "io_uring") == 0) {
+		return jutil_get_bool(value, &conf->udp_io_uring);
+	}
+	if (strcmp(key, "pacing") == 0) {
+		return jutil_get_bool(value, &conf->udp_pacing);
+	}
+	if (strcmp(key, "txtime") == 0) {
+		return jutil_get_bool(value, &conf->udp_txtime);
+	}
 	if (strcmp(key, "sndbuf") == 0) {
 		return jutil_get_int(value, &conf->udp_sndbuf);
 	}
@@ -217,6 +271,9 @@ main_scope_cb(void *ud, const char *key, const struct jutil_value *value)
 	if (strcmp(key, "time_wait") == 0) {
 		return jutil_get_int(value, &conf->time_wait);
 	}
+	if (strcmp(key, "workers") == 0) {
+		return jutil_get_int(value, &conf->workers);
+	}
 	if (strcmp(key, "loglevel") == 0) {
 		return jutil_get_int(value, &conf->log_level);
 	}
@@ -252,14 +309,30 @@ static struct config conf_default(void)
 		.kcp_resend = 0,
 		.kcp_nc = 1,
 		.kcp_flush = 1,
+		.kcp_ackfreq = 2,
+		.kcp_ackdelay = 10,
+		.kcp_sack = true,
+		.kcp_pack = false,
+		.kcp_mux = false,
+		.kcp_stripe = 1,
+		.kcp_autotune = false,
+		.kcp_budget = 256,
+		.kcp_pmtud = false,
+		.kcp_datashard = 10,
+		.kcp_parityshard = 0,
 		.timeout = 600,
 		.linger = 30,
 		.keepalive = 25,
 		.time_wait = 120,
+		.workers = 1,
 		.tcp_reuseport = false,
 		.tcp_keepalive = false,
 		.tcp_nodelay = true,
 		.udp_reuseport = false,
+		.udp_gro = false,
+		.udp_io_uring = false,
+		.udp_pacing = false,
+		.udp_txtime = false,
 		.log_level = LOG_LEVEL_NOTICE,
 	};
 }
@@ -326,7 +399,7 @@ static bool conf_check(struct config *restrict conf)
 
 	/* 3. range check */
 	const bool range_ok =
-		RANGE_CHECK("kcp.mtu", conf->kcp_mtu, 300, 1500) &&
+		RANGE_CHECK("kcp.mtu", conf->kcp_mtu, 300, MAX_PACKET_SIZE) &&
 		RANGE_CHECK("kcp.sndwnd", conf->kcp_sndwnd, 16, 65536) &&
 		RANGE_CHECK("kcp.rcvwnd", conf->kcp_rcvwnd, 16, 65536) &&
 		RANGE_CHECK("kcp.nodelay", conf->kcp_nodelay, 0, 2) &&
@@ -334,16 +407,42 @@ static bool conf_check(struct config *restrict conf)
 		RANGE_CHECK("kcp.resend", conf->kcp_resend, 0, 100) &&
 		RANGE_CHECK("kcp.nc", conf->kcp_nc, 0, 1) &&
 		RANGE_CHECK("kcp.flush", conf->kcp_flush, 0, 2) &&
+		RANGE_CHECK("kcp.ackfreq", conf->kcp_ackfreq, 1, 64) &&
+		RANGE_CHECK("kcp.ackdelay", conf->kcp_ackdelay, 0, 500) &&
+		RANGE_CHECK("kcp.stripe", conf->kcp_stripe, 1, STRIPE_MAX) &&
+		RANGE_CHECK("kcp.budget", conf->kcp_budget, 0, 65536) &&
+		RANGE_CHECK(
+			"kcp.datashard", conf->kcp_datashard, 1,
+			FEC_MAX_DATA_SHARDS) &&
+		RANGE_CHECK(
+			"kcp.parityshard", conf->kcp_parityshard, 0,
+			FEC_MAX_PARITY_SHARDS) &&
 		RANGE_CHECK("timeout", conf->timeout, 60, 86400) &&
 		RANGE_CHECK("linger", conf->linger, 5, 600) &&
 		RANGE_CHECK("keepalive", conf->keepalive, 0, 600) &&
 		RANGE_CHECK("time_wait", conf->time_wait, 5, 3600) &&
+		RANGE_CHECK("workers", conf->workers, 1, 256) &&
 		RANGE_CHECK(
 			"log_level", conf->log_level, LOG_LEVEL_SILENCE,
 			LOG_LEVEL_VERYVERBOSE);
 	if (!range_ok) {
 		return false;
 	}
+	if (conf->kcp_cc != NULL && ikcp_findcc(conf->kcp_cc) == NULL) {
+		LOGE_F("config: unknown congestion control \"%s\"",
+		       conf->kcp_cc);
+		return false;
+	}
+	if (conf->kcp_cc != NULL && conf->kcp_nc) {
+		LOGW("config: kcp.cc has no effect when kcp.nc is enabled");
+	}
+	if (conf->kcp_pack && conf->kcp_parityshard > 0) {
+		LOGW("config: kcp.pack has no effect when fec is enabled");
+	}
+	if (conf->kcp_stripe > 1) {
+		/* the chunks are carried as stream messages */
+		conf->kcp_mux = true;
+	}
 
 	if ((conf->tcp_sndbuf != 0 && conf->tcp_sndbuf < 4096) ||
 	    (conf->tcp_rcvbuf != 0 && conf->tcp_rcvbuf < 4096)) {
@@ -353,6 +452,24 @@ static bool conf_check(struct config *restrict conf)
 	    (conf->udp_rcvbuf != 0 && conf->udp_rcvbuf < 4096)) {
 		LOGW("config: probably too small udp buffer");
 	}
+	if (conf->workers > 1) {
+		bool sharded = (mode & MODE_RENDEZVOUS) == 0;
+#if WITH_OBFS
+		sharded = sharded && conf->obfs == NULL;
+#endif
+		if (sharded) {
+			/* every worker binds the same addresses */
+			conf->tcp_reuseport = true;
+			conf->udp_reuseport = true;
+		} else {
+			LOGW("config: workers is ignored in rendezvous mode or with obfs");
+			conf->workers = 1;
+		}
+	}
+	if (conf->udp_gro && conf->udp_io_uring) {
+		LOGW("config: udp.gro is ignored when udp.io_uring is enabled");
+		conf->udp_gro = false;
+	}
 	return true;
 }
 
@@ -388,6 +505,7 @@ void conf_free(struct config *conf)
 	UTIL_SAFE_FREE(conf->connect);
 	UTIL_SAFE_FREE(conf->kcp_bind);
 	UTIL_SAFE_FREE(conf->kcp_connect);
+	UTIL_SAFE_FREE(conf->kcp_cc);
 	UTIL_SAFE_FREE(conf->rendezvous_server);
 	UTIL_SAFE_FREE(conf->http_listen);
 	UTIL_SAFE_FREE(conf->netdev);
@@ -26,12 +26,19 @@ struct config {
 	int mode;
 	int kcp_mtu, kcp_sndwnd, kcp_rcvwnd;
 	int kcp_nodelay, kcp_interval, kcp_resend, kcp_nc;
-	int kcp_flush;
+	int kcp_flush, kcp_ackfreq, kcp_ackdelay;
+	bool kcp_sack, kcp_pack, kcp_mux;
+	int kcp_stripe;
+	bool kcp_autotune;
+	int kcp_budget;
+	bool kcp_pmtud;
+	int kcp_datashard, kcp_parityshard;
+	char *kcp_cc;
 
 	/* socket options */
 	bool tcp_reuseport, tcp_keepalive, tcp_nodelay;
 	int tcp_sndbuf, tcp_rcvbuf;
-	bool udp_reuseport;
+	bool udp_reuseport, udp_gro, udp_io_uring, udp_pacing, udp_txtime;
 	int udp_sndbuf, udp_rcvbuf;
 
 #if WITH_CRYPTO
@@ -45,6 +52,7 @@ struct config {
 #endif
 
 	int timeout, linger, keepalive, time_wait;
+	int workers;
 	int log_level;
 	char *user;
 };
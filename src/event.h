@@ -14,12 +14,15 @@ struct session;
 struct ev_loop;
 struct ev_io;
 struct ev_timer;
+struct ev_prepare;
 struct IKCPCB;
+struct iovec;
 
 void tcp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 void tcp_socket_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 void pkt_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 void pkt_write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void pkt_flush_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents);
 void kcp_update_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents);
 void listener_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents);
 void keepalive_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents);
@@ -30,14 +33,36 @@ void http_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 bool kcp_cansend(struct session *ss);
 bool kcp_canrecv(struct session *ss);
 
+char *kcp_outbuf(struct IKCPCB *kcp, void *user);
 int kcp_output(const char *buf, int len, struct IKCPCB *kcp, void *user);
+void kcp_retain(void *ref, struct IKCPCB *kcp, void *user);
+void kcp_release(void *ref, struct IKCPCB *kcp, void *user);
 bool kcp_sendmsg(struct session *ss, uint16_t msg);
 bool kcp_push(struct session *ss);
-void kcp_recv(struct session *ss);
+/* a pushed message read in place: the room in the kcp segments, iov[0]
+ * starts with the header; then the payload of n bytes is sent, or the room
+ * is given back if there is nothing to send */
+int kcp_push_reserve(struct session *ss, struct iovec *iov, int n);
+bool kcp_push_commit(struct session *ss, const struct iovec *iov, size_t n);
+void kcp_push_cancel(struct session *ss);
+bool stream_sendmsg(struct session *mux, uint32_t id, uint16_t msg);
+bool stream_sendwnd(struct session *mux, uint32_t id, uint32_t n);
+bool stream_sendeof(struct session *mux, uint32_t id, uint32_t off);
+bool stream_senddial(
+	struct session *mux, uint32_t id, const uint32_t *convs, size_t n);
+void kcp_consume(struct session *ss, size_t n);
+void kcp_notify_update(struct session *ss);
+void kcp_notify_ack(struct session *ss);
+void kcp_autotune(struct session *ss);
 
 void tcp_flush(struct session *ss);
 void tcp_notify(struct session *ss);
 
 void pkt_notify_send(struct server *s);
 
+#if WITH_IO_URING
+bool pkt_uring_start(struct server *s);
+void pkt_uring_stop(struct server *s);
+#endif
+
 #endif /* EVENT_H */
@@ -404,21 +404,24 @@ http_serve_stats(struct http_ctx *restrict ctx, struct url *restrict uri)
 	}
 #endif
 #if MCACHE_STATS
-	if (msgpool != NULL) {
-		static size_t last_hit = 0;
-		static size_t last_query = 0;
-		const size_t hit = msgpool->hit - last_hit;
-		const size_t query = msgpool->query - last_query;
+	static size_t last_hit[MSGPOOL_CLASSES] = { 0 };
+	static size_t last_query[MSGPOOL_CLASSES] = { 0 };
+	for (int i = 0; i < MSGPOOL_CLASSES; i++) {
+		const struct mcache *restrict pool = msgpool[i];
+		if (pool == NULL) {
+			continue;
+		}
+		const size_t hit = pool->hit - last_hit[i];
+		const size_t query = pool->query - last_query[i];
 		buf = VBUF_APPENDF(
 			buf,
-			"msgpool: %zu/%zu; %zu hit, %zu miss (%.1lf%%); total %zu hit, %zu miss (%.1lf%%)\n",
-			msgpool->num_elem, msgpool->cache_size, hit,
+			"msgpool %zu: %zu/%zu; %zu hit, %zu miss (%.1lf%%); total %zu hit, %zu miss (%.1lf%%)\n",
+			msgpool_size(i), pool->num_elem, pool->cache_size, hit,
 			query - hit, (double)hit / ((double)query) * 100.0,
-			msgpool->hit, msgpool->query - msgpool->hit,
-			(double)msgpool->hit / ((double)msgpool->query) *
-				100.0);
-		last_hit = msgpool->hit;
-		last_query = msgpool->query;
+			pool->hit, pool->query - pool->hit,
+			(double)pool->hit / ((double)pool->query) * 100.0);
+		last_hit[i] = pool->hit;
+		last_query[i] = pool->query;
 	}
 #endif
 
@@ -1,19 +1,22 @@
 /* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
  * This code is licensed under MIT license (see LICENSE for details) */
 
+#include "conf.h"
 #include "event.h"
+#include "fec.h"
 #include "pktqueue.h"
 #include "server.h"
 #include "session.h"
 #include "util.h"
 
-#include "algo/hashtable.h"
 #include "utils/debug.h"
+#include "utils/minmax.h"
 #include "utils/slog.h"
 
 #include "ikcp.h"
 
 #include <ev.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <inttypes.h>
@@ -22,29 +25,134 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#if HAVE_SO_TXTIME
+#include <time.h>
+#endif
 
-int kcp_output(const char *buf, int len, ikcpcb *kcp, void *user)
+/* room for the fec data header in front of the kcp packet */
+static size_t kcp_headroom(const struct session *restrict ss)
+{
+	return ss->fec != NULL ? FEC_DATA_HEADER_SIZE : 0;
+}
+
+/* let kcp encode in place, leaving the headroom for sealing */
+char *kcp_outbuf(ikcpcb *kcp, void *user)
 {
 	UNUSED(kcp);
 	struct session *restrict ss = (struct session *)user;
-	struct server *restrict s = ss->server;
-	struct msgframe *restrict msg = msgframe_new(s->pkt.queue);
+	const size_t headroom = kcp_headroom(ss);
+	struct msgframe *restrict msg =
+		msgframe_alloc(ss->server->pkt.queue, headroom + kcp->mtu);
 	if (msg == NULL) {
-		LOGOOM();
-		return -1;
+		return NULL;
 	}
+	assert(kcp->mtu + msg->off + headroom <= msg->cap);
+	return (char *)msg->buf + msg->off + headroom;
+}
+
+#if HAVE_SO_TXTIME
+/* spread the packets of a session at the kcp pacing rate, the kernel holds
+ * each one until its departure time */
+static void kcp_set_txtime(
+	struct session *restrict ss, struct msgframe *restrict msg,
+	const size_t len)
+{
+	if (!ss->server->pkt.txtime) {
+		return;
+	}
+	const uint32_t rate = ikcp_pacing_rate(ss->kcp);
+	if (rate == 0) {
+		return;
+	}
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t)) {
+		return;
+	}
+	const uint64_t now =
+		(uint64_t)t.tv_sec * UINT64_C(1000000000) + (uint64_t)t.tv_nsec;
+	/* idle time is not saved up for a burst */
+	if (ss->tx_next < now) {
+		ss->tx_next = now;
+	}
+	msg->txtime = ss->tx_next;
+	ss->tx_next += (uint64_t)len * UINT64_C(1000000000) / rate;
+}
+#else
+#define kcp_set_txtime(ss, msg, len) ((void)0)
+#endif
+
+static bool kcp_send_fec(
+	struct session *restrict ss, struct msgframe *restrict msg)
+{
+	struct server *restrict s = ss->server;
+	struct pktqueue *restrict q = s->pkt.queue;
+	/* parity is computed before sealing modifies the frame */
+	struct msgframe *parity[FEC_MAX_PARITY_SHARDS];
+	const size_t n = fec_encode(ss->fec, q, msg, ss->conv, parity);
+	bool ok = queue_send(s, msg);
+	for (size_t i = 0; i < n; i++) {
+		parity[i]->addr = ss->raddr;
+		kcp_set_txtime(ss, parity[i], parity[i]->len);
+		ok = queue_send(s, parity[i]) && ok;
+	}
+	return ok;
+}
+
+int kcp_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	struct session *restrict ss = (struct session *)user;
+	struct server *restrict s = ss->server;
+	struct pktqueue *restrict q = s->pkt.queue;
+	const size_t headroom = kcp_headroom(ss);
+	struct msgframe *restrict msg;
+	if (buf != kcp->buffer) {
+		/* encoded in the frame from kcp_outbuf */
+		msg = (struct msgframe *)(buf - headroom - q->msg_offset -
+					  offsetof(struct msgframe, buf));
+		assert(msg->off == q->msg_offset);
+	} else {
+		/* mostly acks, which fit in a small frame */
+		msg = msgframe_alloc(q, headroom + len);
+		if (msg == NULL) {
+			LOGOOM();
+			return -1;
+		}
+		assert(len + msg->off + headroom <= msg->cap);
+		memcpy(msg->buf + msg->off + headroom, buf, len);
+	}
+	assert(len > 0);
 	msg->addr = ss->raddr;
-	assert(len > 0 && len + msg->off <= MAX_PACKET_SIZE);
-	unsigned char *dst = msg->buf + msg->off;
-	memcpy(dst, buf, len);
 	msg->len = len;
 	s->stats.kcp_tx += len;
 	ss->stats.kcp_tx += len;
-	return queue_send(s, msg) ? len : -1;
+	kcp_set_txtime(ss, msg, len);
+	if (ss->fec != NULL) {
+		return kcp_send_fec(ss, msg) ? len : -1;
+	}
+	return queue_pack(s, msg) ? len : -1;
+}
+
+/* received segments hold the frame instead of copying the payload */
+void kcp_retain(void *ref, ikcpcb *kcp, void *user)
+{
+	UNUSED(kcp);
+	UNUSED(user);
+	msgframe_ref((struct msgframe *)ref);
+}
+
+void kcp_release(void *ref, ikcpcb *kcp, void *user)
+{
+	UNUSED(kcp);
+	struct session *restrict ss = (struct session *)user;
+	msgframe_unref(ss->server->pkt.queue, (struct msgframe *)ref);
 }
 
 bool kcp_cansend(struct session *restrict ss)
 {
+	if (ss->is_stream) {
+		/* limited by both the peer window and the carriers */
+		return ss->stream.credit > 0 && stream_carrier(ss) != NULL;
+	}
 	struct IKCPCB *restrict kcp = ss->kcp;
 	return kcp != NULL && ikcp_waitsnd(kcp) < kcp->snd_wnd;
 }
@@ -59,6 +167,7 @@ static bool kcp_send(
 	struct session *restrict ss, const unsigned char *buf, const size_t len)
 {
 	assert(len <= INT_MAX);
+	kcp_notify_update(ss);
 	const int r = ikcp_send(ss->kcp, (char *)buf, (int)len);
 	if (r < 0) {
 		return false;
@@ -79,75 +188,327 @@ bool kcp_sendmsg(struct session *restrict ss, const uint16_t msg)
 	return kcp_send(ss, buf, TLV_HEADER_SIZE);
 }
 
-bool kcp_push(struct session *restrict ss)
+static bool stream_send(
+	struct session *restrict mux, const uint32_t id, unsigned char *buf,
+	const uint16_t msg, const size_t len)
 {
-	assert(ss->rbuf->len <= SESSION_BUF_SIZE - TLV_HEADER_SIZE);
-	const size_t len = TLV_HEADER_SIZE + ss->rbuf->len;
 	struct tlv_header header = {
-		.msg = SMSG_PUSH,
+		.msg = msg,
 		.len = (uint16_t)len,
 	};
-	tlv_header_write(ss->rbuf->data, header);
-	ss->rbuf->len = 0;
-	return kcp_send(ss, ss->rbuf->data, len);
+	tlv_header_write(buf, header);
+	write_uint32(buf + TLV_HEADER_SIZE, id);
+	return kcp_send(mux, buf, len);
 }
 
-void kcp_recv(struct session *restrict ss)
+bool stream_sendmsg(
+	struct session *restrict mux, const uint32_t id, const uint16_t msg)
 {
-	unsigned char *start = ss->wbuf->data + ss->wbuf->len;
-	size_t cap = SESSION_BUF_SIZE - ss->wbuf->len;
-	size_t nrecv = 0;
-	while (cap > 0) {
-		int r = ikcp_recv(ss->kcp, (char *)start, (int)cap);
-		if (r <= 0) {
-			break;
-		}
-		nrecv += r;
-		start += r;
-		cap -= r;
+	unsigned char buf[STREAM_HEADER_SIZE];
+	return stream_send(mux, id, buf, msg, STREAM_HEADER_SIZE);
+}
+
+bool stream_sendwnd(
+	struct session *restrict mux, const uint32_t id, const uint32_t n)
+{
+	unsigned char buf[STREAM_HEADER_SIZE + sizeof(uint32_t)];
+	write_uint32(buf + STREAM_HEADER_SIZE, n);
+	return stream_send(mux, id, buf, SMSG_STREAM_WINDOW, sizeof(buf));
+}
+
+bool stream_sendeof(
+	struct session *restrict mux, const uint32_t id, const uint32_t off)
+{
+	unsigned char buf[STREAM_HEADER_SIZE + sizeof(uint32_t)];
+	write_uint32(buf + STREAM_HEADER_SIZE, off);
+	return stream_send(mux, id, buf, SMSG_STREAM_EOF, sizeof(buf));
+}
+
+bool stream_senddial(
+	struct session *restrict mux, const uint32_t id,
+	const uint32_t *restrict convs, const size_t n)
+{
+	unsigned char buf[STREAM_HEADER_SIZE + STRIPE_MAX * sizeof(uint32_t)];
+	assert(n <= STRIPE_MAX);
+	for (size_t i = 0; i < n; i++) {
+		write_uint32(
+			buf + STREAM_HEADER_SIZE + i * sizeof(uint32_t),
+			convs[i]);
+	}
+	return stream_send(
+		mux, id, buf, SMSG_STREAM_DIAL,
+		STREAM_HEADER_SIZE + n * sizeof(uint32_t));
+}
+
+static bool stream_push(struct session *restrict ss, const size_t n)
+{
+	assert(n <= ss->stream.credit);
+	ss->stream.credit -= n;
+	ss->last_send = ev_now(ss->server->loop);
+	if (!ss->stream.is_striped) {
+		return stream_send(
+			ss->stream.mux, ss->conv,
+			ss->rbuf->data + CHUNK_HEADER_SIZE - STREAM_HEADER_SIZE,
+			SMSG_STREAM_PUSH, STREAM_HEADER_SIZE + n);
+	}
+	struct session *restrict mux = stream_carrier(ss);
+	if (mux == NULL) {
+		mux = ss->stream.mux;
+	}
+	unsigned char *buf = ss->rbuf->data;
+	write_uint32(buf + STREAM_HEADER_SIZE, ss->stream.snd_off);
+	ss->stream.snd_off += (uint32_t)n;
+	return stream_send(
+		mux, ss->conv, buf, SMSG_STREAM_CHUNK, CHUNK_HEADER_SIZE + n);
+}
+
+bool kcp_push(struct session *restrict ss)
+{
+	const size_t n = ss->rbuf->len;
+	assert(ss->is_stream);
+	assert(n <= SESSION_BUF_SIZE - CHUNK_HEADER_SIZE);
+	ss->rbuf->len = 0;
+	if (ss->stream.mux == NULL) {
+		return false;
 	}
-	if (nrecv > 0) {
-		ss->wbuf->len += nrecv;
-		ss->last_recv = ev_now(ss->server->loop);
-		LOGV_F("session [%08" PRIX32 "] kcp: "
-		       "recv %zu bytes, cap: %zu bytes",
-		       ss->conv, nrecv, cap);
+	return stream_push(ss, n);
+}
+
+int kcp_push_reserve(
+	struct session *restrict ss, struct iovec *restrict iov, const int n)
+{
+	const size_t mss = ss->kcp->mss;
+	/* in whole segments if possible, the next message starts a new one */
+	size_t len = MIN(TLV_MAX_LENGTH / mss, (size_t)n) * mss;
+	if (len == 0) {
+		len = TLV_MAX_LENGTH;
 	}
+	return ikcp_sendroom(ss->kcp, (int)len, iov, n);
+}
+
+void kcp_push_cancel(struct session *restrict ss)
+{
+	(void)ikcp_sendcommit(ss->kcp, 0);
 }
 
-static void kcp_update(struct session *restrict ss)
+bool kcp_push_commit(
+	struct session *restrict ss, const struct iovec *restrict iov,
+	const size_t n)
 {
 	switch (ss->kcp_state) {
 	case STATE_CONNECT:
 	case STATE_CONNECTED:
-	case STATE_LINGER:
 		break;
 	default:
-		return;
+		kcp_push_cancel(ss);
+		return false;
 	}
+	const size_t len = TLV_HEADER_SIZE + n;
+	assert(len <= TLV_MAX_LENGTH);
+	struct tlv_header header = {
+		.msg = SMSG_PUSH,
+		.len = (uint16_t)len,
+	};
+	tlv_header_write(iov[0].iov_base, header);
+	kcp_notify_update(ss);
+	const int r = ikcp_sendcommit(ss->kcp, (int)len);
+	if ((size_t)r != len) {
+		return false;
+	}
+	LOGV_F("session [%08" PRIX32 "] kcp: send %zu bytes", ss->conv, len);
+	ss->last_send = ev_now(ss->server->loop);
+	return true;
+}
+
+/* the data received is handled in place, the segments are released
+ * after that */
+void kcp_consume(struct session *restrict ss, const size_t n)
+{
+	assert(n <= INT_MAX);
+	const int r = ikcp_consume(ss->kcp, (int)n);
+	assert((size_t)r == n);
+	/* ikcp_consume may ask to tell the window */
+	kcp_notify_update(ss);
+	ss->last_recv = ev_now(ss->server->loop);
+	LOGV_F("session [%08" PRIX32 "] kcp: recv %d bytes, queue: %" PRIu32
+	       " segments",
+	       ss->conv, r, ss->kcp->nrcv_que);
+}
+
+/* millisec, tuning more often only follows the noise */
+#define AUTOTUNE_PERIOD 100
+
+/* the window for twice the segments moved in a round trip */
+static uint32_t autotune_target(
+	const uint32_t moved, const uint32_t rtt, const uint32_t elapsed,
+	const uint32_t lo, const uint32_t hi)
+{
+	const uint64_t wnd = (uint64_t)moved * rtt * 2 / elapsed;
+	return (uint32_t)CLAMP(wnd, (uint64_t)lo, (uint64_t)hi);
+}
+
+/* a lull is not a smaller path, so shrink slowly unless it was idle */
+static uint32_t autotune_next(
+	const uint32_t wnd, const uint32_t target, const bool idle)
+{
+	if (target >= wnd || idle) {
+		return target;
+	}
+	return wnd - (wnd - target + 3) / 4;
+}
+
+/* size the windows by the measured bandwidth-delay product, within the
+ * configured windows and the memory budget of the server */
+void kcp_autotune(struct session *restrict ss)
+{
 	struct server *restrict s = ss->server;
-	const ev_tstamp now = ev_now(s->loop);
-	const uint32_t now_ms = TSTAMP2MS(now);
-	ikcp_update(ss->kcp, now_ms);
-	tcp_notify(ss);
+	const struct config *restrict conf = s->conf;
+	struct IKCPCB *restrict kcp = ss->kcp;
+	/* rto is no less than the rtt, which also holds on the receiver that
+	 * has not measured it; an underestimate would shrink the window that
+	 * limits the rate */
+	const uint32_t rtt =
+		(uint32_t)MAX(kcp->rx_rto, (int32_t)kcp->interval);
+	/* once per round trip */
+	const int32_t period =
+		MAX(kcp->rx_srtt > 0 ? kcp->rx_srtt : kcp->rx_rto,
+		    AUTOTUNE_PERIOD);
+	const uint32_t now_ms = TSTAMP2MS(ev_now(s->loop));
+	const uint32_t elapsed = now_ms - ss->tune.ts;
+	if ((int32_t)elapsed < period) {
+		return;
+	}
+	const bool idle = (int32_t)elapsed > 4 * period;
+	const uint32_t sent = kcp->snd_una - ss->tune.snd_una;
+	const uint32_t recv = kcp->rcv_nxt - ss->tune.rcv_nxt;
+	ss->tune.ts = now_ms;
+	ss->tune.snd_una = kcp->snd_una;
+	ss->tune.rcv_nxt = kcp->rcv_nxt;
+
+	const uint32_t snd_wnd = kcp->snd_wnd, rcv_wnd = kcp->rcv_wnd;
+	uint32_t snd = autotune_next(
+		snd_wnd,
+		autotune_target(
+			sent, rtt, elapsed, AUTOTUNE_SNDWND_FLOOR(conf),
+			(uint32_t)conf->kcp_sndwnd),
+		idle);
+	uint32_t rcv = autotune_next(
+		rcv_wnd,
+		autotune_target(
+			recv, rtt, elapsed, AUTOTUNE_RCVWND_FLOOR(conf),
+			(uint32_t)conf->kcp_rcvwnd),
+		idle);
+	const size_t grow = (snd > snd_wnd ? snd - snd_wnd : 0) +
+			    (rcv > rcv_wnd ? rcv - rcv_wnd : 0);
+	if (grow > 0 && conf->kcp_budget > 0) {
+		/* shrinking one window leaves room for the other */
+		const size_t shrink = (snd < snd_wnd ? snd_wnd - snd : 0) +
+				      (rcv < rcv_wnd ? rcv_wnd - rcv : 0);
+		const size_t budget =
+			(size_t)conf->kcp_budget * 1048576 / kcp->mtu + shrink;
+		const size_t room =
+			budget > s->wnd_total ? budget - s->wnd_total : 0;
+		if (grow > room) {
+			/* share what is left */
+			if (snd > snd_wnd) {
+				const uint64_t d = snd - snd_wnd;
+				snd = snd_wnd + (uint32_t)(d * room / grow);
+			}
+			if (rcv > rcv_wnd) {
+				const uint64_t d = rcv - rcv_wnd;
+				rcv = rcv_wnd + (uint32_t)(d * room / grow);
+			}
+		}
+	}
+	if (snd == snd_wnd && rcv == rcv_wnd) {
+		return;
+	}
+	if (ikcp_wndsize(kcp, (int)snd, (int)rcv) != 0) {
+		LOGOOM();
+	}
+	s->wnd_total += kcp->snd_wnd + kcp->rcv_wnd;
+	s->wnd_total -= snd_wnd + rcv_wnd;
+	LOGV_F("session [%08" PRIX32 "] kcp: window %" PRIu32 "/%" PRIu32
+	       ", total %zu",
+	       ss->conv, kcp->snd_wnd, kcp->rcv_wnd, s->wnd_total);
 }
 
-static bool kcp_update_iter(
-	const struct hashtable *t, const struct hashkey key, void *element,
-	void *user)
+/* nothing to send, retransmit, ack or probe */
+static bool kcp_is_idle(const struct IKCPCB *restrict kcp)
 {
-	UNUSED(t);
-	UNUSED(user);
-	struct session *restrict ss = element;
-	(void)key, assert(key.data == ss->key);
-	kcp_update(ss);
-	return true;
+	return kcp->nsnd_que == 0 && kcp->nsnd_buf == 0 &&
+	       kcp->ackcount == 0 && kcp->probe == 0 && kcp->rmt_wnd != 0;
+}
+
+static void kcp_schedule(
+	struct ev_loop *loop, struct ev_timer *restrict w_update,
+	const uint32_t now_ms, const uint32_t next_ms)
+{
+	const int32_t delay = (int32_t)(next_ms - now_ms);
+	ev_timer_set(w_update, delay > 0 ? delay * 1e-3 : 0.0, 0.0);
+	ev_timer_start(loop, w_update);
+}
+
+/* called before ikcp_input/ikcp_send/ikcp_flush */
+void kcp_notify_update(struct session *restrict ss)
+{
+	struct IKCPCB *restrict kcp = ss->kcp;
+	struct ev_loop *loop = ss->server->loop;
+	const uint32_t now_ms = TSTAMP2MS(ev_now(loop));
+	/* the clock is not advanced while idle */
+	kcp->current = now_ms;
+	struct ev_timer *restrict w_update = &ss->w_update;
+	if (ev_is_active(w_update)) {
+		return;
+	}
+	kcp_schedule(
+		loop, w_update, now_ms, kcp->updated ? kcp->ts_flush : now_ms);
+}
+
+/* called after ikcp_input, the acks may be due before the next update */
+void kcp_notify_ack(struct session *restrict ss)
+{
+	struct IKCPCB *restrict kcp = ss->kcp;
+	const int32_t wait = ikcp_ack_wait(kcp, kcp->current);
+	if (wait < 0) {
+		return;
+	}
+	if (wait == 0) {
+		session_kcp_flush(ss);
+		return;
+	}
+	struct ev_loop *loop = ss->server->loop;
+	struct ev_timer *restrict w_update = &ss->w_update;
+	if (ev_is_active(w_update) &&
+	    ev_timer_remaining(loop, w_update) <= wait * 1e-3) {
+		return;
+	}
+	ev_timer_stop(loop, w_update);
+	kcp_schedule(loop, w_update, kcp->current, kcp->current + wait);
 }
 
 void kcp_update_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents)
 {
-	UNUSED(loop);
 	CHECK_REVENTS(revents, EV_TIMER);
-	struct server *restrict s = watcher->data;
-	table_iterate(s->sessions, kcp_update_iter, NULL);
+	struct session *restrict ss = watcher->data;
+	switch (ss->kcp_state) {
+	case STATE_CONNECT:
+	case STATE_CONNECTED:
+	case STATE_LINGER:
+		break;
+	default:
+		return;
+	}
+	struct IKCPCB *restrict kcp = ss->kcp;
+	const uint32_t now_ms = TSTAMP2MS(ev_now(loop));
+	ikcp_update(kcp, now_ms);
+	if (ss->server->conf->kcp_autotune) {
+		kcp_autotune(ss);
+	}
+	tcp_notify(ss);
+	if (kcp_is_idle(kcp)) {
+		/* until next kcp_notify_update */
+		return;
+	}
+	kcp_schedule(loop, watcher, now_ms, ikcp_check(kcp, now_ms));
 }
@@ -6,8 +6,10 @@
 #include "pktqueue.h"
 #include "server.h"
 #include "sockutil.h"
+#include "uring.h"
 #include "util.h"
 
+#include "utils/arraysize.h"
 #include "utils/buffer.h"
 #include "utils/debug.h"
 #include "utils/minmax.h"
@@ -16,11 +18,22 @@
 #include <ev.h>
 
 #include <sys/socket.h>
+#if WITH_IO_URING
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#if HAVE_UDP_GSO || HAVE_UDP_GRO
+#include <netinet/udp.h>
+#endif
 
+#include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PKT_LOGV(what, msg)                                                    \
@@ -45,8 +58,8 @@ static void udp_reset(struct server *restrict s)
 }
 
 #if HAVE_RECVMMSG || HAVE_SENDMMSG
-static struct iovec iovecs[MMSG_BATCH_SIZE];
-static struct mmsghdr mmsgs[MMSG_BATCH_SIZE];
+static _Thread_local struct iovec iovecs[MMSG_BATCH_SIZE];
+static _Thread_local struct mmsghdr mmsgs[MMSG_BATCH_SIZE];
 #endif
 
 #define RECVMSG_HDR(msg, iov)                                                  \
@@ -63,13 +76,190 @@ static struct mmsghdr mmsgs[MMSG_BATCH_SIZE];
 #define RECVMSG_IOV(msg)                                                       \
 	((struct iovec){                                                       \
 		.iov_base = (msg)->buf,                                        \
-		.iov_len = sizeof((msg)->buf),                                 \
+		.iov_len = (msg)->cap,                                         \
 	})
 
+#if HAVE_UDP_GRO || WITH_IO_URING
+/* enqueue a received frame, make some room if mq_recv is full */
+static void pkt_enqueue(struct server *restrict s, struct msgframe *msg)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	if (q->mq_recv_len >= q->mq_recv_cap) {
+		(void)queue_dispatch(s);
+	}
+	q->mq_recv[q->mq_recv_len++] = msg;
+	PKT_LOGV("pkt recv", msg);
+}
+#endif
+
+#if HAVE_UDP_GRO
+
+/* UDP_GRO_CNT_MAX in linux/udp.h */
+#define GRO_MAX_SEGMENTS 64
+
+static _Thread_local struct iovec gro_iovecs[GRO_BATCH_SIZE][2];
+static _Thread_local struct mmsghdr gro_mmsgs[GRO_BATCH_SIZE];
+static _Thread_local alignas(struct cmsghdr) unsigned char
+	gro_cmsgs[GRO_BATCH_SIZE][CMSG_SPACE(sizeof(int))];
+
+static size_t gro_get_segment(struct msghdr *restrict hdr)
+{
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_UDP ||
+		    cmsg->cmsg_type != UDP_GRO) {
+			continue;
+		}
+		int segsize;
+		memcpy(&segsize, CMSG_DATA(cmsg), sizeof(segsize));
+		return segsize > 0 ? (size_t)segsize : 0;
+	}
+	return 0;
+}
+
+/* split a coalesced datagram into frames:
+ *   the first segment stays in place, the others are copied out of the frame
+ * tail and the receive area that follows it
+ */
+static size_t gro_split(
+	struct server *restrict s, struct msgframe *restrict msg,
+	const unsigned char *restrict area, const size_t len,
+	const size_t segsize)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	struct msgframe *frames[GRO_MAX_SEGMENTS];
+	frames[0] = msg;
+	size_t n = 1;
+	for (size_t off = segsize; off < len && n < GRO_MAX_SEGMENTS;
+	     off += segsize) {
+		struct msgframe *restrict seg = msgframe_new(q);
+		if (seg == NULL) {
+			LOGOOM();
+			break;
+		}
+		const size_t seglen = MIN(segsize, len - off);
+		seg->addr = msg->addr;
+		seg->len = seglen;
+		seg->ts = msg->ts;
+		unsigned char *dst = seg->buf;
+		size_t pos = off, remain = seglen;
+		if (pos < msg->cap) {
+			const size_t k = MIN(remain, msg->cap - pos);
+			memcpy(dst, msg->buf + pos, k);
+			dst += k, pos += k, remain -= k;
+		}
+		memcpy(dst, area + (pos - msg->cap), remain);
+		frames[n++] = seg;
+	}
+	msg->len = segsize;
+	for (size_t i = 0; i < n; i++) {
+		pkt_enqueue(s, frames[i]);
+	}
+	return n;
+}
+
+static size_t pkt_recv_gro(struct server *restrict s, const int fd)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	if (q->mq_recv_len >= q->mq_recv_cap) {
+		return 0;
+	}
+	const ev_tstamp now = ev_now(s->loop);
+	size_t nrecv = 0, nbrecv = 0;
+	size_t nbatch;
+	do {
+		nbatch = GRO_BATCH_SIZE;
+		struct msgframe *frames[GRO_BATCH_SIZE];
+		for (size_t i = 0; i < nbatch; i++) {
+			struct msgframe *restrict msg = msgframe_new(q);
+			if (msg == NULL) {
+				LOGOOM();
+				if (i == 0) {
+					/* no frame could be allocated */
+					return nrecv;
+				}
+				nbatch = i;
+				break;
+			}
+			frames[i] = msg;
+			gro_iovecs[i][0] = RECVMSG_IOV(msg);
+			gro_iovecs[i][1] = (struct iovec){
+				.iov_base = q->gro_area + i * GRO_AREA_SIZE,
+				.iov_len = GRO_AREA_SIZE,
+			};
+			struct msghdr *restrict hdr = &gro_mmsgs[i].msg_hdr;
+			*hdr = RECVMSG_HDR(msg, gro_iovecs[i]);
+			hdr->msg_iovlen = 2;
+			hdr->msg_control = gro_cmsgs[i];
+			hdr->msg_controllen = sizeof(gro_cmsgs[i]);
+			gro_mmsgs[i].msg_len = 0;
+		}
+
+		const int ret = recvmmsg(fd, gro_mmsgs, nbatch, 0, NULL);
+		if (ret < 0) {
+			for (size_t i = 0; i < nbatch; i++) {
+				msgframe_delete(q, frames[i]);
+			}
+			const int err = errno;
+			if (IS_TRANSIENT_ERROR(err)) {
+				break;
+			}
+			if (err == ECONNREFUSED || err == ECONNRESET) {
+				udp_reset(s);
+				break;
+			}
+			LOGE_F("recvmmsg: %s", strerror(err));
+			break;
+		}
+		const size_t n = (size_t)ret;
+		for (size_t i = 0; i < n; i++) {
+			struct msgframe *restrict msg = frames[i];
+			struct msghdr *restrict hdr = &gro_mmsgs[i].msg_hdr;
+			const size_t len = (size_t)gro_mmsgs[i].msg_len;
+			const size_t segsize = gro_get_segment(hdr);
+			msg->ts = now;
+			nbrecv += len;
+			if ((hdr->msg_flags & MSG_TRUNC) != 0 ||
+			    segsize > msg->cap ||
+			    (segsize == 0 && len > msg->cap)) {
+				LOGV_F("pkt recv: %zu bytes discarded", len);
+				msgframe_delete(q, msg);
+				continue;
+			}
+			if (segsize == 0 || len <= segsize) {
+				msg->len = len;
+				pkt_enqueue(s, msg);
+				nrecv++;
+				continue;
+			}
+			nrecv += gro_split(
+				s, msg, q->gro_area + i * GRO_AREA_SIZE, len,
+				segsize);
+		}
+		/* collect unused frames */
+		for (size_t i = n; i < nbatch; i++) {
+			msgframe_delete(q, frames[i]);
+		}
+		if (n < nbatch) {
+			/* the socket is drained */
+			break;
+		}
+	} while (q->mq_recv_len < q->mq_recv_cap);
+	s->stats.pkt_rx += nbrecv;
+	return nrecv;
+}
+
+#endif /* HAVE_UDP_GRO */
+
 #if HAVE_RECVMMSG
 
 static size_t pkt_recv(struct server *restrict s, const int fd)
 {
+#if HAVE_UDP_GRO
+	if (s->pkt.gro) {
+		return pkt_recv_gro(s, fd);
+	}
+#endif
 	struct pktqueue *restrict q = s->pkt.queue;
 	size_t navail = q->mq_recv_cap - q->mq_recv_len;
 	if (navail == 0) {
@@ -228,6 +418,136 @@ static size_t pkt_send_drop(struct pktqueue *restrict q)
 		.msg_flags = 0,                                                \
 	})
 
+#if HAVE_UDP_GSO
+
+/* UDP_MAX_SEGMENTS in linux/udp.h */
+#define GSO_MAX_SEGMENTS 64
+/* maximum UDP payload over IPv4 */
+#define GSO_MAX_SIZE 65507
+
+/* returns the number of frames that can be sent as one GSO datagram:
+ *   all frames go to the same peer, all segments have the same size except
+ * that the last one may be shorter
+ */
+static size_t
+gso_count(struct msgframe *restrict *restrict frames, const size_t n)
+{
+	const struct msgframe *restrict first = frames[0];
+	if (first->probe || first->nogso) {
+		return 1;
+	}
+	const size_t segsize = first->len;
+	size_t total = segsize;
+	size_t i;
+	for (i = 1; i < n && i < GSO_MAX_SEGMENTS; i++) {
+		const struct msgframe *restrict msg = frames[i];
+		if (msg->probe || msg->nogso || msg->len > segsize ||
+		    total + msg->len > GSO_MAX_SIZE ||
+		    !sa_equals(&msg->addr.sa, &first->addr.sa)) {
+			break;
+		}
+#if HAVE_SO_TXTIME
+		/* paced frames leave one by one */
+		if (msg->txtime != first->txtime) {
+			break;
+		}
+#endif
+		total += msg->len;
+		if (msg->len < segsize) {
+			i++;
+			break;
+		}
+	}
+	return i;
+}
+
+/* errors indicating that the kernel or the device refused to segment */
+#define IS_GSO_ERROR(err)                                                      \
+	((err) == EIO || (err) == EINVAL || (err) == EOPNOTSUPP)
+
+/* a segment of the group may still fit the local mtu on its own */
+static void
+gso_split(struct msgframe *restrict *restrict frames, const size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		frames[i]->nogso = true;
+	}
+}
+
+#endif /* HAVE_UDP_GSO */
+
+#if HAVE_UDP_GSO || HAVE_SO_TXTIME
+
+#if HAVE_UDP_GSO
+#define GSO_CMSG_SIZE CMSG_SPACE(sizeof(uint16_t))
+#else
+#define GSO_CMSG_SIZE 0
+#endif
+#if HAVE_SO_TXTIME
+#define TXTIME_CMSG_SIZE CMSG_SPACE(sizeof(uint64_t))
+#else
+#define TXTIME_CMSG_SIZE 0
+#endif
+#define SEND_CMSG_SIZE (GSO_CMSG_SIZE + TXTIME_CMSG_SIZE)
+
+static _Thread_local alignas(struct cmsghdr) unsigned char
+	send_cmsgs[MMSG_BATCH_SIZE][SEND_CMSG_SIZE];
+
+/* attach the segment size of n > 1 frames and the departure time */
+static void send_set_control(
+	const struct server *restrict s, struct msghdr *restrict hdr,
+	unsigned char control[SEND_CMSG_SIZE],
+	struct msgframe *restrict *restrict frames, const size_t n)
+{
+	size_t len = 0;
+#if HAVE_UDP_GSO
+	const bool gso = n > 1;
+	if (gso) {
+		len += GSO_CMSG_SIZE;
+	}
+#else
+	UNUSED(n);
+#endif
+#if HAVE_SO_TXTIME
+	const uint64_t txtime = frames[0]->txtime;
+	const bool paced = s->pkt.txtime && txtime != 0;
+	if (paced) {
+		len += TXTIME_CMSG_SIZE;
+	}
+#else
+	UNUSED(s);
+	UNUSED(frames);
+#endif
+	if (len == 0) {
+		return;
+	}
+	/* CMSG_NXTHDR reads the length of the next header */
+	memset(control, 0, len);
+	hdr->msg_control = control;
+	hdr->msg_controllen = len;
+	struct cmsghdr *restrict cmsg = CMSG_FIRSTHDR(hdr);
+#if HAVE_UDP_GSO
+	if (gso) {
+		const uint16_t segsize = frames[0]->len;
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+		cmsg = CMSG_NXTHDR(hdr, cmsg);
+	}
+#endif
+#if HAVE_SO_TXTIME
+	if (paced) {
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+	}
+#endif
+}
+
+#endif /* HAVE_UDP_GSO || HAVE_SO_TXTIME */
+
 #if HAVE_SENDMMSG
 
 static size_t pkt_send(struct server *restrict s, const int fd)
@@ -239,33 +559,80 @@ static size_t pkt_send(struct server *restrict s, const int fd)
 	}
 	bool drop = false;
 	size_t nsend = 0, nbsend = 0;
-	size_t nbatch;
 	do {
-		nbatch = MIN(navail, MMSG_BATCH_SIZE);
-		for (size_t i = 0; i < nbatch; i++) {
-			struct msgframe *restrict msg = q->mq_send[nsend + i];
-			iovecs[i] = SENDMSG_IOV(msg);
-			mmsgs[i] = (struct mmsghdr){
-				.msg_hdr = SENDMSG_HDR(msg, &iovecs[i]),
-				.msg_len = msg->len,
-			};
+		/* number of frames in each message */
+		size_t nframes[MMSG_BATCH_SIZE];
+		const size_t nbatch = MIN(navail, MMSG_BATCH_SIZE);
+		size_t nmsgs = 0;
+		for (size_t i = 0; i < nbatch;) {
+			struct msgframe **frames = q->mq_send + nsend + i;
+			size_t n = 1;
+#if HAVE_UDP_GSO
+			if (s->pkt.gso) {
+				n = gso_count(frames, nbatch - i);
+			}
+#endif
+			for (size_t j = 0; j < n; j++) {
+				iovecs[i + j] = SENDMSG_IOV(frames[j]);
+			}
+			struct msghdr *restrict hdr = &mmsgs[nmsgs].msg_hdr;
+			*hdr = SENDMSG_HDR(frames[0], &iovecs[i]);
+			hdr->msg_iovlen = n;
+#if HAVE_UDP_GSO || HAVE_SO_TXTIME
+			send_set_control(s, hdr, send_cmsgs[nmsgs], frames, n);
+#endif
+			mmsgs[nmsgs].msg_len = 0;
+			nframes[nmsgs++] = n;
+			i += n;
 		}
 
-		const int ret = sendmmsg(fd, mmsgs, nbatch, 0);
+		int ret = sendmmsg(fd, mmsgs, nmsgs, 0);
 		if (ret < 0) {
 			const int err = errno;
 			if (IS_TRANSIENT_ERROR(err)) {
 				break;
 			}
-			LOGE_F("sendmmsg: %s", strerror(err));
-			/* clear the send queue if the error is persistent */
-			drop = true;
-			break;
+#if HAVE_UDP_GSO
+			/* only a segmented message tells about gso */
+			if (nframes[0] > 1 && IS_GSO_ERROR(err)) {
+				LOGW_F("sendmmsg: %s, udp gso disabled",
+				       strerror(err));
+				s->pkt.gso = false;
+				continue;
+			}
+#endif
+			if (err == EMSGSIZE) {
+#if HAVE_UDP_GSO
+				if (nframes[0] > 1) {
+					LOGD_F("sendmmsg: %s, send unsegmented",
+					       strerror(err));
+					gso_split(q->mq_send + nsend,
+						  nframes[0]);
+					continue;
+				}
+#endif
+				if (q->mq_send[nsend]->probe) {
+					/* a path mtu probe too large for the
+					 * link, skip */
+					LOGD_F("sendmmsg: %s", strerror(err));
+					ret = 1;
+				}
+			}
+			if (ret < 0) {
+				LOGE_F("sendmmsg: %s", strerror(err));
+				/* clear the send queue if the error is
+				 * persistent */
+				drop = true;
+				break;
+			}
 		}
 		if (ret == 0) {
 			break;
 		}
-		const size_t n = (size_t)ret;
+		size_t n = 0;
+		for (size_t i = 0; i < (size_t)ret; i++) {
+			n += nframes[i];
+		}
 		/* delete sent messages */
 		for (size_t i = 0; i < n; i++) {
 			struct msgframe *restrict msg = q->mq_send[nsend + i];
@@ -311,6 +678,12 @@ static size_t pkt_send(struct server *restrict s, const int fd)
 			if (IS_TRANSIENT_ERROR(err)) {
 				break;
 			}
+			if (err == EMSGSIZE && msg->probe) {
+				/* a path mtu probe too large for the link */
+				LOGD_F("sendmsg: %s", strerror(err));
+				nsend++;
+				continue;
+			}
 			LOGE_F("sendmsg: %s", strerror(err));
 			/* clear the send queue if the error is persistent */
 			drop = true;
@@ -341,8 +714,434 @@ static size_t pkt_send(struct server *restrict s, const int fd)
 
 #endif /* HAVE_SENDMMSG */
 
+#if WITH_IO_URING
+
+/* provided receive buffers, must be a power of 2 */
+#define URING_RECV_BUFS 256
+#define URING_SEND_SLOTS MMSG_BATCH_SIZE
+#define URING_ENTRIES (URING_SEND_SLOTS * 2)
+#define URING_CQ_ENTRIES (URING_RECV_BUFS * 4)
+#define URING_BGID 0
+#define URING_DATA_RECV UINT64_C(0xFFFFFFFFFFFFFFFF)
+#define URING_DATA_CANCEL UINT64_C(0xFFFFFFFFFFFFFFFE)
+
+/* the kernel writes the recvmsg header, the source address and the payload
+ * back to back, so each provided buffer is laid over a msgframe */
+static_assert(
+	offsetof(struct msgframe, addr) ==
+		offsetof(struct msgframe, uring_hdr) +
+			sizeof(struct io_uring_recvmsg_out),
+	"msgframe layout is incompatible with io_uring");
+static_assert(
+	offsetof(struct msgframe, buf) ==
+		offsetof(struct msgframe, addr) + sizeof(union sockaddr_max),
+	"msgframe layout is incompatible with io_uring");
+#define URING_RECV_BUFSIZE(msg)                                                \
+	(sizeof(struct io_uring_recvmsg_out) + sizeof(union sockaddr_max) +    \
+	 (msg)->cap)
+
+#if HAVE_UDP_GSO
+#define URING_SEND_FRAMES GSO_MAX_SEGMENTS
+#else
+#define URING_SEND_FRAMES 1
+#endif
+
+struct uring_send {
+	struct msghdr hdr;
+#if HAVE_UDP_GSO || HAVE_SO_TXTIME
+	alignas(struct cmsghdr) unsigned char control[SEND_CMSG_SIZE];
+#endif
+	size_t n;
+	struct msgframe *frames[URING_SEND_FRAMES];
+	struct iovec iov[URING_SEND_FRAMES];
+};
+
+struct pkt_uring {
+	struct uring ring;
+	struct uring_buf_ring bufs;
+	struct ev_io w_event;
+	int efd;
+	bool recv_armed : 1;
+	bool recv_failed : 1;
+	bool stopping : 1;
+	struct msghdr recv_hdr;
+	/* frames currently provided to the kernel, indexed by buffer id */
+	struct msgframe *recv_frames[URING_RECV_BUFS];
+	uint16_t recv_empty[URING_RECV_BUFS];
+	size_t recv_nempty;
+	uint16_t send_free[URING_SEND_SLOTS];
+	size_t send_nfree;
+	struct uring_send send[URING_SEND_SLOTS];
+};
+
+static void uring_recv_provide(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	struct pktqueue *restrict q = s->pkt.queue;
+	if (u->recv_nempty == 0 || u->stopping) {
+		return;
+	}
+	while (u->recv_nempty > 0) {
+		struct msgframe *restrict msg = msgframe_new(q);
+		if (msg == NULL) {
+			LOGOOM();
+			break;
+		}
+		const uint16_t bid = u->recv_empty[--u->recv_nempty];
+		u->recv_frames[bid] = msg;
+		uring_buf_ring_add(
+			&u->bufs, msg->uring_hdr, URING_RECV_BUFSIZE(msg), bid);
+	}
+	uring_buf_ring_commit(&u->bufs);
+}
+
+static void uring_recv_arm(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	if (u->recv_armed || u->recv_failed || u->stopping) {
+		return;
+	}
+	struct io_uring_sqe *restrict sqe = uring_get_sqe(&u->ring);
+	if (sqe == NULL) {
+		/* retry after the next completion */
+		return;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s->pkt.fd;
+	sqe->addr = (uint64_t)(uintptr_t)&u->recv_hdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_DATA_RECV;
+	u->recv_armed = true;
+}
+
+static void uring_recv_complete(
+	struct server *restrict s, const struct io_uring_cqe *restrict cqe)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	struct pktqueue *restrict q = s->pkt.queue;
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+		u->recv_armed = false;
+	}
+	if (cqe->res < 0) {
+		const int err = -cqe->res;
+		if (IS_TRANSIENT_ERROR(err) || err == ECANCELED) {
+			return;
+		}
+		if (err == ECONNREFUSED || err == ECONNRESET) {
+			udp_reset(s);
+			return;
+		}
+		/* multishot recvmsg needs Linux 6.0 */
+		LOGE_F("io_uring recvmsg: %s, fallback to recvmmsg",
+		       strerror(err));
+		u->recv_failed = true;
+		ev_io_start(s->loop, &s->pkt.w_read);
+		return;
+	}
+	if ((cqe->flags & IORING_CQE_F_BUFFER) == 0) {
+		return;
+	}
+	const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	struct msgframe *restrict msg = u->recv_frames[bid];
+	u->recv_frames[bid] = NULL;
+	u->recv_empty[u->recv_nempty++] = bid;
+	struct io_uring_recvmsg_out out;
+	memcpy(&out, msg->uring_hdr, sizeof(out));
+	if (u->stopping || (out.flags & MSG_TRUNC) != 0 ||
+	    out.payloadlen > msg->cap) {
+		msgframe_delete(q, msg);
+		return;
+	}
+	msg->len = (uint16_t)out.payloadlen;
+	msg->ts = ev_now(s->loop);
+	s->stats.pkt_rx += out.payloadlen;
+	pkt_enqueue(s, msg);
+}
+
+static void uring_send_complete(
+	struct server *restrict s, const struct io_uring_cqe *restrict cqe)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	struct pktqueue *restrict q = s->pkt.queue;
+	const uint16_t i = (uint16_t)cqe->user_data;
+	struct uring_send *restrict slot = &u->send[i];
+	const int err = cqe->res < 0 ? -cqe->res : 0;
+	bool retry = false;
+	if (err == 0) {
+		s->stats.pkt_tx += (uintmax_t)cqe->res;
+	}
+#if HAVE_UDP_GSO
+	else if (slot->n > 1 && IS_GSO_ERROR(err)) {
+		if (s->pkt.gso) {
+			LOGW_F("io_uring sendmsg: %s, udp gso disabled",
+			       strerror(err));
+			s->pkt.gso = false;
+		}
+		gso_split(slot->frames, slot->n);
+		retry = true;
+	} else if (slot->n > 1 && err == EMSGSIZE) {
+		LOGD_F("io_uring sendmsg: %s, send unsegmented",
+		       strerror(err));
+		gso_split(slot->frames, slot->n);
+		retry = true;
+	}
+#endif
+	else if (err == EMSGSIZE && slot->n == 1 && slot->frames[0]->probe) {
+		/* a path mtu probe too large for the link */
+		LOGD_F("io_uring sendmsg: %s", strerror(err));
+	} else if (IS_TRANSIENT_ERROR(err)) {
+		retry = true;
+	} else if (err != ECANCELED) {
+		LOGE_F("io_uring sendmsg: %s", strerror(err));
+	}
+	if (retry && !u->stopping &&
+	    q->mq_send_len + slot->n <= q->mq_send_cap) {
+		/* send the frames again ahead of the queue, the caller
+		 * rearms the send, see pkt_uring_cb */
+		memmove(q->mq_send + slot->n, q->mq_send,
+			q->mq_send_len * sizeof(struct msgframe *));
+		memcpy(q->mq_send, slot->frames,
+		       slot->n * sizeof(struct msgframe *));
+		q->mq_send_len += slot->n;
+		slot->n = 0;
+	}
+	for (size_t j = 0; j < slot->n; j++) {
+		struct msgframe *restrict msg = slot->frames[j];
+		PKT_LOGV("pkt send", msg);
+		msgframe_delete(q, msg);
+	}
+	slot->n = 0;
+	u->send_free[u->send_nfree++] = i;
+}
+
+/* process all completions, returns the number processed */
+static size_t uring_reap(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	size_t n = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+		switch (cqe->user_data) {
+		case URING_DATA_RECV:
+			uring_recv_complete(s, cqe);
+			break;
+		case URING_DATA_CANCEL:
+			break;
+		default:
+			uring_send_complete(s, cqe);
+			break;
+		}
+		uring_cqe_seen(&u->ring);
+		n++;
+	}
+	uring_recv_provide(s);
+	uring_recv_arm(s);
+	return n;
+}
+
+static size_t pkt_uring_send(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	struct pktqueue *restrict q = s->pkt.queue;
+	const size_t count = q->mq_send_len;
+	size_t nsend = 0;
+	while (nsend < count && u->send_nfree > 0) {
+		struct msgframe **frames = q->mq_send + nsend;
+		size_t n = 1;
+#if HAVE_UDP_GSO
+		if (s->pkt.gso) {
+			n = gso_count(frames, count - nsend);
+		}
+#endif
+		struct io_uring_sqe *restrict sqe = uring_get_sqe(&u->ring);
+		if (sqe == NULL) {
+			break;
+		}
+		const uint16_t i = u->send_free[--u->send_nfree];
+		struct uring_send *restrict slot = &u->send[i];
+		for (size_t j = 0; j < n; j++) {
+			slot->frames[j] = frames[j];
+			slot->iov[j] = SENDMSG_IOV(frames[j]);
+		}
+		slot->n = n;
+		slot->hdr = SENDMSG_HDR(frames[0], slot->iov);
+		slot->hdr.msg_iovlen = n;
+#if HAVE_UDP_GSO || HAVE_SO_TXTIME
+		send_set_control(s, &slot->hdr, slot->control, frames, n);
+#endif
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = s->pkt.fd;
+		sqe->addr = (uint64_t)(uintptr_t)&slot->hdr;
+		sqe->len = 1;
+		sqe->user_data = i;
+		nsend += n;
+	}
+	if (nsend == 0) {
+		return 0;
+	}
+	/* the frames are owned by the send slots until completion */
+	const size_t remain = count - nsend;
+	for (size_t i = 0; i < remain; i++) {
+		q->mq_send[i] = q->mq_send[nsend + i];
+	}
+	q->mq_send_len = remain;
+	if (uring_submit(&u->ring, 0) < 0) {
+		const int err = errno;
+		/* unconsumed entries are submitted next time */
+		if (!IS_TRANSIENT_ERROR(err) && err != EBUSY) {
+			LOGE_F("io_uring_enter: %s", strerror(err));
+		}
+	}
+	s->pkt.last_send_time = ev_now(s->loop);
+	return nsend;
+}
+
+static void
+pkt_uring_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	UNUSED(loop);
+	CHECK_REVENTS(revents, EV_READ);
+	struct server *restrict s = watcher->data;
+	struct pkt_uring *restrict u = s->pkt.uring;
+	uint64_t value;
+	if (read(u->efd, &value, sizeof(value)) < 0) {
+		const int err = errno;
+		if (!IS_TRANSIENT_ERROR(err)) {
+			LOGE_F("eventfd read: %s", strerror(err));
+		}
+	}
+	(void)uring_reap(s);
+	(void)uring_submit(&u->ring, 0);
+	(void)queue_dispatch(s);
+	if (s->pkt.queue->mq_send_len > 0) {
+		/* the send slots may have been released */
+		pkt_notify_send(s);
+	}
+}
+
+static void pkt_uring_free(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	struct pktqueue *restrict q = s->pkt.queue;
+	if (u->ring.fd != -1) {
+		/* all frames owned by the kernel must be returned first */
+		u->stopping = true;
+		struct io_uring_sqe *restrict sqe = uring_get_sqe(&u->ring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+			sqe->user_data = URING_DATA_CANCEL;
+		}
+		while (u->recv_armed ||
+		       u->send_nfree < ARRAY_SIZE(u->send_free)) {
+			if (uring_submit(&u->ring, 1) < 0) {
+				const int err = errno;
+				LOGE_F("io_uring_enter: %s", strerror(err));
+				break;
+			}
+			(void)uring_reap(s);
+		}
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(u->recv_frames); i++) {
+		if (u->recv_frames[i] != NULL) {
+			msgframe_delete(q, u->recv_frames[i]);
+		}
+	}
+	uring_buf_ring_free(&u->ring, &u->bufs);
+	uring_close(&u->ring);
+	if (u->efd != -1) {
+		CLOSE_FD(u->efd);
+	}
+	free(u);
+	s->pkt.uring = NULL;
+}
+
+bool pkt_uring_start(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = calloc(1, sizeof(struct pkt_uring));
+	if (u == NULL) {
+		LOGOOM();
+		return false;
+	}
+	u->ring.fd = -1;
+	u->efd = -1;
+	for (size_t i = 0; i < URING_SEND_SLOTS; i++) {
+		u->send_free[i] = (uint16_t)(URING_SEND_SLOTS - 1 - i);
+	}
+	u->send_nfree = URING_SEND_SLOTS;
+	s->pkt.uring = u;
+	if (!uring_init(&u->ring, URING_ENTRIES, URING_CQ_ENTRIES)) {
+		pkt_uring_free(s);
+		return false;
+	}
+	u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->efd < 0) {
+		const int err = errno;
+		LOGE_F("eventfd: %s", strerror(err));
+		pkt_uring_free(s);
+		return false;
+	}
+	if (!uring_register_eventfd(&u->ring, u->efd) ||
+	    !uring_buf_ring_init(
+		    &u->ring, &u->bufs, URING_RECV_BUFS, URING_BGID)) {
+		pkt_uring_free(s);
+		return false;
+	}
+	for (size_t i = 0; i < URING_RECV_BUFS; i++) {
+		u->recv_empty[i] = (uint16_t)i;
+	}
+	u->recv_nempty = URING_RECV_BUFS;
+	uring_recv_provide(s);
+	if (u->recv_nempty > 0) {
+		pkt_uring_free(s);
+		return false;
+	}
+	u->recv_hdr = (struct msghdr){
+		.msg_namelen = sizeof(union sockaddr_max),
+	};
+	uring_recv_arm(s);
+	if (uring_submit(&u->ring, 0) < 0) {
+		const int err = errno;
+		LOGE_F("io_uring_enter: %s", strerror(err));
+		u->recv_armed = false;
+		pkt_uring_free(s);
+		return false;
+	}
+
+	struct ev_io *restrict w_event = &u->w_event;
+	ev_io_init(w_event, pkt_uring_cb, u->efd, EV_READ);
+	w_event->data = s;
+	ev_io_start(s->loop, w_event);
+	LOGD_F("udp io_uring: enabled, fd=%d", u->ring.fd);
+	return true;
+}
+
+void pkt_uring_stop(struct server *restrict s)
+{
+	struct pkt_uring *restrict u = s->pkt.uring;
+	if (u == NULL) {
+		return;
+	}
+	ev_io_stop(s->loop, &u->w_event);
+	pkt_uring_free(s);
+}
+
+#endif /* WITH_IO_URING */
+
 static void pkt_flush(struct server *restrict s)
 {
+#if WITH_IO_URING
+	if (s->pkt.uring != NULL) {
+		while (pkt_uring_send(s) > 0) {
+			;
+		}
+		return;
+	}
+#endif
 	const int fd = s->pkt.w_write.fd;
 	while (pkt_send(s, fd) > 0) {
 		;
@@ -361,13 +1160,52 @@ void pkt_write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 	pkt_flush(s);
 }
 
-void pkt_notify_send(struct server *restrict s)
+void pkt_flush_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents)
 {
+	CHECK_REVENTS(revents, EV_PREPARE);
+	struct server *restrict s = watcher->data;
+	/* while the watcher is active, so that it is not restarted */
+	queue_flush_pack(s);
+	ev_prepare_stop(loop, watcher);
 	struct pktqueue *restrict q = s->pkt.queue;
-	pkt_flush(s);
 	struct ev_io *restrict w_write = &s->pkt.w_write;
-	if (q->mq_send_len > 0 && !ev_is_active(w_write)) {
+	if (q->mq_send_len == 0 || ev_is_active(w_write)) {
+		return;
+	}
+	pkt_flush(s);
+#if WITH_IO_URING
+	if (s->pkt.uring != NULL) {
+		/* resumed when the send slots are released, see pkt_uring_cb */
+		return;
+	}
+#endif
+	if (q->mq_send_len > 0) {
 		LOGD_F("pkt send fd=%d start", w_write->fd);
-		ev_io_start(s->loop, w_write);
+		ev_io_start(loop, w_write);
+	}
+}
+
+/* packets are sent in batches:
+ *   a full batch is sent immediately, the rest are deferred until all events
+ * in the current loop iteration have been processed, see pkt_flush_cb
+ */
+void pkt_notify_send(struct server *restrict s)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	struct ev_io *restrict w_write = &s->pkt.w_write;
+	struct ev_prepare *restrict w_flush = &s->pkt.w_flush;
+	if (ev_is_active(w_write)) {
+		/* wait for the socket to be writable */
+		if (q->mq_pack_len > 0 && !ev_is_active(w_flush)) {
+			ev_prepare_start(s->loop, w_flush);
+		}
+		return;
+	}
+	if (q->mq_send_len >= MMSG_BATCH_SIZE) {
+		pkt_flush(s);
+	}
+	if ((q->mq_send_len > 0 || q->mq_pack_len > 0) &&
+	    !ev_is_active(w_flush)) {
+		ev_prepare_start(s->loop, w_flush);
 	}
 }
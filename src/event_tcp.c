@@ -10,13 +10,18 @@
 #include "util.h"
 
 #include "algo/hashtable.h"
+#include "utils/arraysize.h"
 #include "utils/debug.h"
+#include "utils/minmax.h"
 #include "utils/slog.h"
 
+#include "ikcp.h"
+
 #include <ev.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <errno.h>
@@ -87,6 +92,44 @@ static void accept_one(
 	session_tcp_start(ss, fd);
 }
 
+static void accept_stream(
+	struct server *restrict s, const int fd,
+	const struct sockaddr *client_sa)
+{
+	struct session *restrict mux = session_mux(s);
+	if (mux == NULL) {
+		LOGOOM();
+		CLOSE_FD(fd);
+		return;
+	}
+	const uint32_t id = conv_new(s, &mux->raddr.sa);
+	struct session *restrict ss = stream_new(s, mux, id);
+	if (ss == NULL) {
+		LOGOOM();
+		CLOSE_FD(fd);
+		return;
+	}
+	ss->tcp_state = STATE_CONNECTED;
+	if (!stream_dial(ss)) {
+		LOGOOM();
+		CLOSE_FD(fd);
+		session_free(ss);
+		return;
+	}
+	void *elem = ss;
+	s->sessions = table_set(s->sessions, SESSION_GETKEY(ss), &elem);
+	assert(elem == NULL);
+	if (LOGLEVEL(INFO)) {
+		char addr_str[64];
+		format_sa(client_sa, addr_str, sizeof(addr_str));
+		LOG_F(INFO,
+		      "session [%08" PRIX32 "] tcp: accepted %s, "
+		      "stream on [%08" PRIX32 "]",
+		      id, addr_str, mux->conv);
+	}
+	session_tcp_start(ss, fd);
+}
+
 void tcp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 {
 	CHECK_REVENTS(revents, EV_READ);
@@ -135,12 +178,42 @@ void tcp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 			CLOSE_FD(fd);
 			return;
 		}
-		accept_one(s, fd, &addr.sa);
+		if (conf->kcp_mux) {
+			accept_stream(s, fd, &addr.sa);
+		} else {
+			accept_one(s, fd, &addr.sa);
+		}
 	}
 }
 
+/* wake up the streams waiting for the carrier, striped streams of the
+ * group may send on any of them */
+static void mux_notify(struct session *restrict mux)
+{
+	if (!kcp_cansend(mux)) {
+		return;
+	}
+	struct session *m = mux;
+	do {
+		if (m->stream.blocked) {
+			m->stream.blocked = false;
+			struct session *restrict ss = m->stream.next;
+			while (ss != NULL) {
+				struct session *restrict next = ss->stream.next;
+				tcp_notify(ss);
+				ss = next;
+			}
+		}
+		m = m->stream.stripe;
+	} while (m != NULL && m != mux);
+}
+
 void tcp_notify(struct session *restrict ss)
 {
+	if (ss->is_mux) {
+		mux_notify(ss);
+		return;
+	}
 	switch (ss->tcp_state) {
 	case STATE_CONNECTED:
 	case STATE_LINGER:
@@ -154,11 +227,17 @@ void tcp_notify(struct session *restrict ss)
 		/* finish this connection gracefully */
 		session_tcp_stop(ss);
 		LOGD_F("session [%08" PRIX32 "] tcp: close", ss->conv);
+		if (ss->is_stream) {
+			/* nothing left to send */
+			session_kcp_stop(ss);
+		}
 		return;
 	}
 	int events = 0;
 	if (kcp_cansend(ss)) {
 		events |= EV_READ;
+	} else if (ss->is_stream && ss->stream.mux != NULL) {
+		ss->stream.mux->stream.blocked = true;
 	}
 	if (is_linger || has_data) {
 		events |= EV_WRITE;
@@ -166,21 +245,89 @@ void tcp_notify(struct session *restrict ss)
 	modify_io_events(ss->server->loop, &ss->w_socket, events);
 }
 
+/* a plain session reads straight into the kcp segments, returns: OK=0,
+ * wait=1, closed=-1 */
+static int tcp_recv_push(struct session *restrict ss)
+{
+	switch (ss->kcp_state) {
+	case STATE_CONNECT:
+	case STATE_CONNECTED:
+		break;
+	default:
+		return -1;
+	}
+	struct iovec iov[PUSH_MAX_SEG];
+	const int niov = kcp_push_reserve(ss, iov, (int)ARRAY_SIZE(iov));
+	if (niov <= 0) {
+		LOGOOM();
+		return -1;
+	}
+	/* the header is written in front once the length is known */
+	struct iovec data[PUSH_MAX_SEG];
+	memcpy(data, iov, sizeof(iov[0]) * (size_t)niov);
+	data[0].iov_base = (unsigned char *)data[0].iov_base + TLV_HEADER_SIZE;
+	data[0].iov_len -= TLV_HEADER_SIZE;
+	size_t cap = 0;
+	for (int i = 0; i < niov; i++) {
+		cap += data[i].iov_len;
+	}
+
+	const int fd = ss->w_socket.fd;
+	const ssize_t nread = readv(fd, data, niov);
+	if (nread < 0) {
+		const int err = errno;
+		/* an idle session does not hold the room */
+		kcp_push_cancel(ss);
+		if (IS_TRANSIENT_ERROR(err)) {
+			return 1;
+		}
+		LOGE_F("session [%08" PRIX32 "] tcp recv: %s", ss->conv,
+		       strerror(err));
+		return -1;
+	}
+	if (nread == 0) {
+		kcp_push_cancel(ss);
+		LOGI_F("session [%08" PRIX32 "] tcp: "
+		       "connection closed by peer",
+		       ss->conv);
+		return -1;
+	}
+	const size_t len = (size_t)nread;
+	if (!kcp_push_commit(ss, iov, len)) {
+		return -1;
+	}
+	if (ss->kcp_flush >= 1) {
+		session_kcp_flush(ss);
+	}
+	ss->stats.tcp_rx += len;
+	ss->server->stats.tcp_rx += len;
+	LOGV_F("session [%08" PRIX32 "] "
+	       "tcp fd=%d: recv %zu bytes, cap: %zu bytes",
+	       ss->conv, fd, len, cap - len);
+	return 0;
+}
+
 /* returns: OK=0, wait=1, closed=-1 */
 static int tcp_recv(struct session *restrict ss)
 {
 	if (!kcp_cansend(ss)) {
 		return 1;
 	}
+	if (!ss->is_stream) {
+		return tcp_recv_push(ss);
+	}
 
-	/* reserve some space to encode header in place */
-	size_t cap = TLV_MAX_LENGTH - TLV_HEADER_SIZE - ss->rbuf->len;
+	/* reserve some space to encode header in place, and never send more
+	 * than the peer can buffer */
+	size_t cap = TLV_MAX_LENGTH - CHUNK_HEADER_SIZE - ss->rbuf->len;
+	cap = MIN(cap, ss->stream.credit - ss->rbuf->len);
 	if (cap == 0) {
 		return 1;
 	}
 
 	const int fd = ss->w_socket.fd;
-	unsigned char *buf = ss->rbuf->data + TLV_HEADER_SIZE + ss->rbuf->len;
+	unsigned char *buf =
+		ss->rbuf->data + CHUNK_HEADER_SIZE + ss->rbuf->len;
 	size_t len = 0;
 	/* Receive message from client socket */
 	const ssize_t nread = recv(fd, buf, cap, 0);
@@ -235,18 +382,113 @@ static void tcp_recv_all(struct session *restrict ss)
 	}
 }
 
+/* the iovecs for the payloads waiting for tcp, in place in the segments */
+static int wbuf_iov(
+	const struct session *restrict ss, struct iovec *restrict iov,
+	const struct iovec *restrict seg, const int nseg, size_t *len)
+{
+	UNUSED(nseg);
+	int niov = 0, i = 0;
+	/* the offset of seg[i] */
+	size_t base = 0;
+	for (size_t j = ss->wbuf_ipush; j < ss->wbuf_npush; j++) {
+		const struct wbuf_span *restrict p = &ss->wbuf_push[j];
+		size_t off = (j == ss->wbuf_ipush) ? ss->wbuf_flush : p->off;
+		const size_t end = (size_t)p->off + p->len;
+		*len += end - off;
+		while (off < end) {
+			while (base + seg[i].iov_len <= off) {
+				base += seg[i].iov_len;
+				i++;
+				assert(i < nseg);
+			}
+			const size_t n = MIN(end, base + seg[i].iov_len) - off;
+			iov[niov++] = (struct iovec){
+				.iov_base = (unsigned char *)seg[i].iov_base +
+					    (off - base),
+				.iov_len = n,
+			};
+			off += n;
+		}
+	}
+	return niov;
+}
+
+/* move wbuf_flush over n bytes written */
+static void wbuf_sent(struct session *restrict ss, size_t n)
+{
+	if (ss->wbuf_npush == 0) {
+		ss->wbuf_flush += n;
+		return;
+	}
+	while (n > 0) {
+		const struct wbuf_span *restrict p =
+			&ss->wbuf_push[ss->wbuf_ipush];
+		const size_t end = (size_t)p->off + p->len;
+		const size_t k = MIN(n, end - ss->wbuf_flush);
+		ss->wbuf_flush += k;
+		n -= k;
+		if (ss->wbuf_flush < end) {
+			continue;
+		}
+		if (++ss->wbuf_ipush == ss->wbuf_npush) {
+			/* the messages are all done */
+			assert(n == 0);
+			ss->wbuf_flush = ss->wbuf_next;
+			ss->wbuf_ipush = ss->wbuf_npush = 0;
+			return;
+		}
+		ss->wbuf_flush = ss->wbuf_push[ss->wbuf_ipush].off;
+	}
+}
+
+/* the segments are released as soon as tcp has taken their bytes */
+static void wbuf_release(struct session *restrict ss)
+{
+	const size_t n = ss->wbuf_flush;
+	if (ss->is_stream || n == 0) {
+		return;
+	}
+	kcp_consume(ss, n);
+	if (ss->wbuf_ipush < ss->wbuf_npush) {
+		/* the rest of the span in progress */
+		struct wbuf_span *restrict p = &ss->wbuf_push[ss->wbuf_ipush];
+		p->len -= (uint32_t)(n - p->off);
+		p->off = (uint32_t)n;
+	}
+	for (size_t i = ss->wbuf_ipush; i < ss->wbuf_npush; i++) {
+		ss->wbuf_push[i].off -= (uint32_t)n;
+	}
+	ss->wbuf_flush = 0;
+	ss->wbuf_next -= n;
+}
+
 /* returns: OK=0, wait=1, closed=-1 */
 static int tcp_send(struct session *restrict ss)
 {
 	assert(ss->wbuf_next >= ss->wbuf_flush);
-	const size_t len = ss->wbuf_next - ss->wbuf_flush;
-	if (len == 0) {
+	if (ss->wbuf_flush == ss->wbuf_next) {
 		return 1;
 	}
+	/* the payloads of all parsed messages at once */
+	struct iovec iov[WBUF_MAX_SEG + WBUF_MAX_PUSH];
+	int niov = 0;
+	size_t len = 0;
+	if (ss->is_stream) {
+		iov[niov++] = (struct iovec){
+			.iov_base = ss->wbuf->data + ss->wbuf_flush,
+			.iov_len = ss->wbuf_next - ss->wbuf_flush,
+		};
+		len = ss->wbuf_next - ss->wbuf_flush;
+	} else {
+		struct iovec seg[WBUF_MAX_SEG];
+		const int nseg =
+			ikcp_peekv(ss->kcp, seg, (int)ARRAY_SIZE(seg));
+		niov = wbuf_iov(ss, iov, seg, nseg, &len);
+	}
 
 	const int fd = ss->w_socket.fd;
-	unsigned char *buf = ss->wbuf->data + ss->wbuf_flush;
-	const ssize_t ret = send(fd, buf, len, 0);
+	const ssize_t ret = writev(fd, iov, niov);
 	if (ret < 0) {
 		const int err = errno;
 		if (IS_TRANSIENT_ERROR(err)) {
@@ -260,12 +502,13 @@ static int tcp_send(struct session *restrict ss)
 		return 1;
 	}
 	assert(ret <= INT_MAX);
-	ss->wbuf_flush += (size_t)ret;
+	wbuf_sent(ss, (size_t)ret);
+	wbuf_release(ss);
 	ss->stats.tcp_tx += (uintmax_t)ret;
 	ss->server->stats.tcp_tx += (uintmax_t)ret;
 	LOGV_F("session [%08" PRIX32 "] tcp fd=%d: "
-	       "send %zd/%zu bytes",
-	       ss->conv, fd, ret, len);
+	       "send %zd/%zu bytes in %d pieces",
+	       ss->conv, fd, ret, len, niov);
 	if ((size_t)ret < len) {
 		return 0;
 	}
@@ -323,8 +566,9 @@ void tcp_socket_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 
 	if (revents & EV_WRITE) {
 		tcp_flush(ss);
+		/* streams return the credit as soon as possible */
 		if (ss->tcp_state == STATE_CONNECTED &&
-		    ss->wbuf_flush == ss->wbuf_next) {
+		    (ss->wbuf_flush == ss->wbuf_next || ss->is_stream)) {
 			session_read_cb(ss);
 			return;
 		}
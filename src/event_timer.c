@@ -42,6 +42,10 @@ static bool timeout_filt(
 		}
 		break;
 	case STATE_CONNECTED:
+		if (ss->is_stream) {
+			/* the carrier watches the peer */
+			break;
+		}
 		if (ss->last_recv != TSTAMP_NIL) {
 			not_seen = now - ss->last_recv;
 		}
@@ -58,8 +62,25 @@ static bool timeout_filt(
 			       ss->conv);
 			(void)kcp_sendmsg(ss, SMSG_KEEPALIVE);
 		}
+		if (s->conf->kcp_autotune) {
+			/* give back the windows of an idle session */
+			kcp_autotune(ss);
+		}
 		break;
 	case STATE_LINGER:
+		if (ss->is_stream) {
+			/* flushing after the peer has closed */
+			if (ss->last_recv != TSTAMP_NIL) {
+				not_seen = now - ss->last_recv;
+			}
+			if (not_seen > s->linger) {
+				LOGD_F("session [%08" PRIX32 "] timeout: linger",
+				       ss->conv);
+				session_tcp_stop(ss);
+				session_kcp_stop(ss);
+			}
+			break;
+		}
 		if (ss->last_send != TSTAMP_NIL) {
 			not_seen = now - ss->last_send;
 		}
@@ -195,5 +216,7 @@ void timeout_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents)
 	s->sessions = table_filter(s->sessions, timeout_filt, s);
 
 	/* mcache maintenance */
-	mcache_shrink(msgpool, 1);
+	for (int i = 0; i < MSGPOOL_CLASSES; i++) {
+		mcache_shrink(msgpool[i], 1);
+	}
 }
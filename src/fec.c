@@ -0,0 +1,513 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+#include "fec.h"
+
+#include "pktqueue.h"
+#include "util.h"
+
+#include "utils/debug.h"
+#include "utils/minmax.h"
+#include "utils/serialize.h"
+#include "utils/slog.h"
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* GF(2^8) reduced by x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[510], gf_log[256];
+static uint8_t gf_mul_table[256][256];
+#if HAVE_X86_SIMD
+/* products of each low and high nibble, looked up by byte shuffles */
+static uint8_t gf_nibble_table[256][2][16];
+#endif
+
+static inline uint8_t gf_mul(const uint8_t a, const uint8_t b)
+{
+	return gf_mul_table[a][b];
+}
+
+static inline uint8_t gf_inv(const uint8_t a)
+{
+	assert(a != 0);
+	return gf_exp[255 - gf_log[a]];
+}
+
+static void gf_mul_add_scalar(
+	uint8_t *restrict dst, const uint8_t *restrict src, const uint8_t c,
+	const size_t n)
+{
+	const uint8_t *restrict t = gf_mul_table[c];
+	for (size_t i = 0; i < n; i++) {
+		dst[i] ^= t[src[i]];
+	}
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("ssse3"))) static void gf_mul_add_ssse3(
+	uint8_t *restrict dst, const uint8_t *restrict src, const uint8_t c,
+	const size_t n)
+{
+	const __m128i lo =
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c][0]);
+	const __m128i hi =
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c][1]);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i p = _mm_xor_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+			_mm_shuffle_epi8(
+				hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+		const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+	}
+	gf_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2"))) static void gf_mul_add_avx2(
+	uint8_t *restrict dst, const uint8_t *restrict src, const uint8_t c,
+	const size_t n)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c][0]));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c][1]));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		const __m256i x =
+			_mm256_loadu_si256((const __m256i *)(src + i));
+		const __m256i p = _mm256_xor_si256(
+			_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+			_mm256_shuffle_epi8(
+				hi, _mm256_and_si256(
+					    _mm256_srli_epi64(x, 4), mask)));
+		const __m256i d =
+			_mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256(
+			(__m256i *)(dst + i), _mm256_xor_si256(d, p));
+	}
+	gf_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+#endif /* HAVE_X86_SIMD */
+
+static void (*gf_mul_add_impl)(
+	uint8_t *restrict dst, const uint8_t *restrict src, uint8_t c,
+	size_t n) = gf_mul_add_scalar;
+
+/* dst += c * src */
+static void gf_mul_add(
+	uint8_t *restrict dst, const uint8_t *restrict src, const uint8_t c,
+	const size_t n)
+{
+	switch (c) {
+	case 0:
+		return;
+	case 1:
+		for (size_t i = 0; i < n; i++) {
+			dst[i] ^= src[i];
+		}
+		return;
+	}
+	gf_mul_add_impl(dst, src, c, n);
+}
+
+void fec_init(void)
+{
+	unsigned x = 1;
+	for (int i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+		gf_log[x] = (uint8_t)i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= GF_POLY;
+		}
+	}
+	for (int a = 1; a < 256; a++) {
+		for (int b = 1; b < 256; b++) {
+			gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+		}
+	}
+#if HAVE_X86_SIMD
+	for (int c = 0; c < 256; c++) {
+		for (int i = 0; i < 16; i++) {
+			gf_nibble_table[c][0][i] =
+				gf_mul((uint8_t)c, (uint8_t)i);
+			gf_nibble_table[c][1][i] =
+				gf_mul((uint8_t)c, (uint8_t)(i << 4));
+		}
+	}
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gf_mul_add_impl = gf_mul_add_avx2;
+		LOGD("fec: using avx2");
+	} else if (__builtin_cpu_supports("ssse3")) {
+		gf_mul_add_impl = gf_mul_add_ssse3;
+		LOGD("fec: using ssse3");
+	}
+#endif
+}
+
+/* Gauss-Jordan elimination on an n by n matrix, rows are stride apart */
+static bool gf_invert(uint8_t *restrict a, uint8_t *restrict inv, const int n)
+{
+	const int stride = FEC_MAX_PARITY_SHARDS;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			inv[i * stride + j] = (i == j) ? 1 : 0;
+		}
+	}
+	for (int col = 0; col < n; col++) {
+		int pivot = col;
+		while (pivot < n && a[pivot * stride + col] == 0) {
+			pivot++;
+		}
+		if (pivot == n) {
+			return false;
+		}
+		if (pivot != col) {
+			for (int j = 0; j < n; j++) {
+				uint8_t t = a[col * stride + j];
+				a[col * stride + j] = a[pivot * stride + j];
+				a[pivot * stride + j] = t;
+				t = inv[col * stride + j];
+				inv[col * stride + j] = inv[pivot * stride + j];
+				inv[pivot * stride + j] = t;
+			}
+		}
+		const uint8_t scale = gf_inv(a[col * stride + col]);
+		for (int j = 0; j < n; j++) {
+			a[col * stride + j] =
+				gf_mul(a[col * stride + j], scale);
+			inv[col * stride + j] =
+				gf_mul(inv[col * stride + j], scale);
+		}
+		for (int i = 0; i < n; i++) {
+			const uint8_t f = a[i * stride + col];
+			if (i == col || f == 0) {
+				continue;
+			}
+			for (int j = 0; j < n; j++) {
+				a[i * stride + j] ^=
+					gf_mul(f, a[col * stride + j]);
+				inv[i * stride + j] ^=
+					gf_mul(f, inv[col * stride + j]);
+			}
+		}
+	}
+	return true;
+}
+
+struct fec_shard {
+	struct msgframe *msg;
+	const unsigned char *data;
+	size_t len;
+};
+
+struct fec_block {
+	uint32_t id;
+	int nrecv, ndata;
+	bool valid, done;
+	struct fec_shard *shards;
+};
+
+/* blocks that may still be completed by reordered shards */
+#define FEC_BLOCKS 4
+
+struct fec {
+	int k, m;
+	/* the largest shard, the rows below are this far apart */
+	size_t size;
+	/* systematic cauchy code, m rows by k columns */
+	uint8_t *matrix;
+	struct {
+		uint32_t seq;
+		int index;
+		size_t len;
+		/* m rows of size */
+		unsigned char *parity;
+	} enc;
+	struct fec_block blocks[FEC_BLOCKS];
+	/* allocated on first recovery */
+	unsigned char *scratch;
+};
+
+struct fec *fec_new(
+	const int data_shards, const int parity_shards, const size_t size)
+{
+	assert(0 < data_shards && data_shards <= FEC_MAX_DATA_SHARDS);
+	assert(0 < parity_shards && parity_shards <= FEC_MAX_PARITY_SHARDS);
+	const size_t k = (size_t)data_shards, m = (size_t)parity_shards;
+	const size_t nshards = FEC_BLOCKS * (k + m);
+	struct fec *restrict fec = malloc(
+		sizeof(struct fec) + nshards * sizeof(struct fec_shard) +
+		m * k);
+	if (fec == NULL) {
+		return NULL;
+	}
+	struct fec_shard *shards = (struct fec_shard *)(fec + 1);
+	*fec = (struct fec){
+		.k = data_shards,
+		.m = parity_shards,
+		.size = size,
+		.matrix = (uint8_t *)(shards + nshards),
+	};
+	fec->enc.parity = calloc(m, size);
+	if (fec->enc.parity == NULL) {
+		free(fec);
+		return NULL;
+	}
+	for (size_t i = 0; i < nshards; i++) {
+		shards[i] = (struct fec_shard){ .msg = NULL };
+	}
+	for (size_t i = 0; i < FEC_BLOCKS; i++) {
+		fec->blocks[i].shards = shards + i * (k + m);
+	}
+	/* x_j = k + j, y_i = i, all distinct since k + m <= 256 */
+	for (size_t j = 0; j < m; j++) {
+		for (size_t i = 0; i < k; i++) {
+			fec->matrix[j * k + i] = gf_inv((uint8_t)((k + j) ^ i));
+		}
+	}
+	return fec;
+}
+
+static void
+fec_block_reset(struct fec *restrict fec, struct pktqueue *restrict q,
+		struct fec_block *restrict b)
+{
+	const int n = fec->k + fec->m;
+	for (int i = 0; i < n; i++) {
+		struct fec_shard *restrict shard = &b->shards[i];
+		if (shard->msg != NULL) {
+			msgframe_unref(q, shard->msg);
+			shard->msg = NULL;
+		}
+	}
+	b->nrecv = b->ndata = 0;
+}
+
+void fec_free(struct fec *restrict fec, struct pktqueue *restrict q)
+{
+	if (fec == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < FEC_BLOCKS; i++) {
+		fec_block_reset(fec, q, &fec->blocks[i]);
+	}
+	free(fec->enc.parity);
+	free(fec->scratch);
+	free(fec);
+}
+
+size_t fec_encode(
+	struct fec *restrict fec, struct pktqueue *restrict q,
+	struct msgframe *restrict msg, const uint32_t conv,
+	struct msgframe **restrict parity)
+{
+	const int k = fec->k, m = fec->m;
+	unsigned char *restrict packet = msg->buf + msg->off;
+	const size_t size = msg->len;
+	assert(msg->off + FEC_DATA_HEADER_SIZE + size <= msg->cap);
+	assert(sizeof(uint16_t) + size <= fec->size);
+	fec_header_write(
+		packet, (struct fec_header){
+				.seq = fec->enc.seq++,
+				.flag = FEC_FLAG_DATA,
+			});
+	unsigned char *restrict shard = packet + FEC_HEADER_SIZE;
+	write_uint16(shard, (uint16_t)size);
+	const size_t len = sizeof(uint16_t) + size;
+	msg->len = (uint16_t)(FEC_HEADER_SIZE + len);
+
+	/* parity is accumulated as the data shards go out */
+	const int index = fec->enc.index;
+	for (int j = 0; j < m; j++) {
+		gf_mul_add(
+			fec->enc.parity + (size_t)j * fec->size, shard,
+			fec->matrix[j * k + index], len);
+	}
+	fec->enc.len = MAX(fec->enc.len, len);
+	if (++fec->enc.index < k) {
+		return 0;
+	}
+
+	const size_t parity_len = fec->enc.len;
+	size_t n = 0;
+	for (int j = 0; j < m; j++) {
+		unsigned char *restrict row =
+			fec->enc.parity + (size_t)j * fec->size;
+		/* the sequence is consumed even if the frame is lost */
+		const uint32_t seq = fec->enc.seq++;
+		struct msgframe *restrict out =
+			msgframe_alloc(q, FEC_PARITY_HEADER_SIZE + parity_len);
+		if (out != NULL) {
+			unsigned char *restrict d = out->buf + out->off;
+			fec_header_write(
+				d, (struct fec_header){
+					   .seq = seq,
+					   .flag = FEC_FLAG_PARITY,
+				   });
+			write_uint32(d + FEC_HEADER_SIZE, conv);
+			memcpy(d + FEC_PARITY_HEADER_SIZE, row, parity_len);
+			out->len = (uint16_t)(FEC_PARITY_HEADER_SIZE +
+					      parity_len);
+			parity[n++] = out;
+		} else {
+			LOGOOM();
+		}
+		memset(row, 0, parity_len);
+	}
+	fec->enc.index = 0;
+	fec->enc.len = 0;
+	return n;
+}
+
+static size_t fec_reconstruct(
+	struct fec *restrict fec, struct pktqueue *restrict q,
+	const struct fec_block *restrict b, const struct msgframe *from,
+	struct msgframe **restrict recovered)
+{
+	const int k = fec->k, m = fec->m;
+	int missing[FEC_MAX_PARITY_SHARDS], rows[FEC_MAX_PARITY_SHARDS];
+	int e = 0, r = 0;
+	size_t len = 0;
+	for (int i = 0; i < k + m; i++) {
+		const struct fec_shard *restrict shard = &b->shards[i];
+		if (shard->msg == NULL) {
+			if (i < k) {
+				assert(e < m);
+				missing[e++] = i;
+			}
+			continue;
+		}
+		len = MAX(len, shard->len);
+		/* data shards come first, so e is final here */
+		if (i >= k && r < e) {
+			rows[r++] = i - k;
+		}
+	}
+	if (r < e) {
+		return 0;
+	}
+	if (fec->scratch == NULL) {
+		fec->scratch = malloc((size_t)(2 * m) * fec->size);
+		if (fec->scratch == NULL) {
+			LOGOOM();
+			return 0;
+		}
+	}
+	unsigned char *restrict syndrome = fec->scratch;
+	unsigned char *restrict data = fec->scratch + (size_t)m * fec->size;
+
+	/* subtract the received data shards from the chosen parity */
+	uint8_t a[FEC_MAX_PARITY_SHARDS * FEC_MAX_PARITY_SHARDS];
+	uint8_t inv[FEC_MAX_PARITY_SHARDS * FEC_MAX_PARITY_SHARDS];
+	for (int t = 0; t < e; t++) {
+		unsigned char *restrict row = syndrome + (size_t)t * fec->size;
+		const struct fec_shard *restrict p = &b->shards[k + rows[t]];
+		memcpy(row, p->data, p->len);
+		memset(row + p->len, 0, len - p->len);
+		const uint8_t *restrict coeff = fec->matrix + rows[t] * k;
+		for (int i = 0; i < k; i++) {
+			const struct fec_shard *restrict d = &b->shards[i];
+			if (d->msg != NULL) {
+				gf_mul_add(row, d->data, coeff[i], d->len);
+			}
+		}
+		for (int u = 0; u < e; u++) {
+			a[t * FEC_MAX_PARITY_SHARDS + u] = coeff[missing[u]];
+		}
+	}
+	/* any square submatrix of a cauchy matrix is invertible */
+	if (!gf_invert(a, inv, e)) {
+		return 0;
+	}
+
+	size_t n = 0;
+	for (int u = 0; u < e; u++) {
+		unsigned char *restrict d = data + (size_t)u * fec->size;
+		memset(d, 0, len);
+		for (int t = 0; t < e; t++) {
+			gf_mul_add(
+				d, syndrome + (size_t)t * fec->size,
+				inv[u * FEC_MAX_PARITY_SHARDS + t], len);
+		}
+		const size_t size = read_uint16(d);
+		if (size == 0 || sizeof(uint16_t) + size > len) {
+			continue;
+		}
+		struct msgframe *restrict msg = msgframe_alloc(q, size);
+		if (msg == NULL) {
+			LOGOOM();
+			break;
+		}
+		msg->ts = from->ts;
+		msg->addr = from->addr;
+		memcpy(msg->buf + msg->off, d + sizeof(uint16_t), size);
+		msg->len = (uint16_t)size;
+		recovered[n++] = msg;
+	}
+	return n;
+}
+
+size_t fec_decode(
+	struct fec *restrict fec, struct pktqueue *restrict q,
+	struct msgframe *restrict msg, const uint32_t seq, const bool is_parity,
+	const unsigned char *shard, const size_t len,
+	struct msgframe **restrict recovered)
+{
+	const int k = fec->k;
+	const uint32_t nshards = (uint32_t)(k + fec->m);
+	const uint32_t id = seq / nshards;
+	const int index = (int)(seq % nshards);
+	if (is_parity != (index >= k)) {
+		return 0;
+	}
+	struct fec_block *restrict b = &fec->blocks[id % FEC_BLOCKS];
+	if (!b->valid || b->id != id) {
+		if (b->valid && (int32_t)(id - b->id) < 0) {
+			/* too late to help */
+			return 0;
+		}
+		fec_block_reset(fec, q, b);
+		b->id = id;
+		b->valid = true;
+		b->done = false;
+	}
+	if (b->done || b->shards[index].msg != NULL) {
+		return 0;
+	}
+	msgframe_ref(msg);
+	b->shards[index] = (struct fec_shard){
+		.msg = msg,
+		.data = shard,
+		.len = len,
+	};
+	b->nrecv++;
+	if (!is_parity) {
+		b->ndata++;
+	}
+	if (b->ndata < k && b->nrecv < k) {
+		return 0;
+	}
+	size_t n = 0;
+	if (b->ndata < k) {
+		n = fec_reconstruct(fec, q, b, msg, recovered);
+	}
+	b->done = true;
+	fec_block_reset(fec, q, b);
+	return n;
+}
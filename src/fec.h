@@ -0,0 +1,78 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "utils/serialize.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct msgframe;
+struct pktqueue;
+
+#define FEC_MAX_DATA_SHARDS 128
+#define FEC_MAX_PARITY_SHARDS 32
+
+/* every datagram is prefixed with a shard header when fec is enabled */
+struct fec_header {
+	uint32_t seq;
+	uint16_t flag;
+};
+
+enum fec_flags {
+	/* not protected, used by session 0 */
+	FEC_FLAG_NONE = 0x00f0,
+	/* followed by: size (uint16), kcp packet */
+	FEC_FLAG_DATA = 0x00f1,
+	/* followed by: conv (uint32), parity of the data shards */
+	FEC_FLAG_PARITY = 0x00f2,
+};
+
+#define FEC_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint16_t))
+#define FEC_DATA_HEADER_SIZE (FEC_HEADER_SIZE + sizeof(uint16_t))
+#define FEC_PARITY_HEADER_SIZE (FEC_HEADER_SIZE + sizeof(uint32_t))
+/* parity shards cover the size field too, reserve it for them */
+#define FEC_OVERHEAD (FEC_PARITY_HEADER_SIZE + sizeof(uint16_t))
+
+static inline struct fec_header fec_header_read(const unsigned char *d)
+{
+	return (struct fec_header){
+		.seq = read_uint32(d),
+		.flag = read_uint16(d + sizeof(uint32_t)),
+	};
+}
+
+static inline void
+fec_header_write(unsigned char *d, const struct fec_header header)
+{
+	write_uint32(d, header.seq);
+	write_uint16(d + sizeof(uint32_t), header.flag);
+}
+
+/* builds the GF(256) tables, call once before any worker starts */
+void fec_init(void);
+
+struct fec;
+
+/* size: the largest shard, no more than a frame */
+struct fec *fec_new(int data_shards, int parity_shards, size_t size);
+void fec_free(struct fec *fec, struct pktqueue *q);
+
+/* msg contains a kcp packet after FEC_DATA_HEADER_SIZE bytes of headroom,
+ * writes the data header in place and returns the parity frames once the
+ * block is complete */
+size_t fec_encode(
+	struct fec *fec, struct pktqueue *q, struct msgframe *msg,
+	uint32_t conv, struct msgframe **parity);
+
+/* shard points into msg, which is retained until the block is done;
+ * returns the recovered frames, each containing a kcp packet */
+size_t fec_decode(
+	struct fec *fec, struct pktqueue *q, struct msgframe *msg,
+	uint32_t seq, bool is_parity, const unsigned char *shard, size_t len,
+	struct msgframe **recovered);
+
+#endif /* FEC_H */
@@ -20,6 +20,7 @@
 #endif
 
 /* std */
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -37,10 +38,28 @@ static struct {
 	bool daemonize : 1;
 } args = { 0 };
 
+/* each worker runs an independent server in its own thread, see workers_start */
+struct worker {
+	pthread_t thread;
+	struct ev_loop *loop;
+	struct server *server;
+	struct config *conf;
+	struct ev_async w_notify;
+	int id;
+	bool running;
+	/* protects the fields below */
+	pthread_mutex_t mu;
+	struct config *new_conf;
+	bool stop;
+};
+
 static struct {
 	struct ev_signal w_sighup;
 	struct ev_signal w_sigint;
 	struct ev_signal w_sigterm;
+
+	struct worker *workers;
+	size_t num_workers;
 } app;
 
 void signal_cb(struct ev_loop *loop, struct ev_signal *watcher, int revents);
@@ -138,6 +157,189 @@ static void parse_args(int argc, char **argv)
 	slog_level = LOG_LEVEL_NOTICE + args.verbosity;
 }
 
+/* only the main thread serves http */
+static struct config *worker_conf_read(void)
+{
+	struct config *conf = conf_read(args.conf_path);
+	if (conf == NULL) {
+		return NULL;
+	}
+	UTIL_SAFE_FREE(conf->http_listen);
+	return conf;
+}
+
+static void
+worker_notify_cb(struct ev_loop *loop, struct ev_async *watcher, int revents)
+{
+	CHECK_REVENTS(revents, EV_ASYNC);
+	struct worker *restrict w = watcher->data;
+	(void)pthread_mutex_lock(&w->mu);
+	struct config *conf = w->new_conf;
+	w->new_conf = NULL;
+	const bool stop = w->stop;
+	(void)pthread_mutex_unlock(&w->mu);
+	if (conf != NULL) {
+		w->server->conf = conf;
+		conf_free(w->conf);
+		w->conf = conf;
+		(void)server_resolve(w->server);
+	}
+	if (stop) {
+		ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+static void worker_free(struct worker *restrict w)
+{
+	if (w->server != NULL) {
+		server_stop(w->server);
+		server_free(w->server);
+		w->server = NULL;
+	}
+	if (w->loop != NULL) {
+		ev_loop_destroy(w->loop);
+		w->loop = NULL;
+	}
+	(void)pthread_mutex_destroy(&w->mu);
+	if (w->new_conf != NULL) {
+		conf_free(w->new_conf);
+		w->new_conf = NULL;
+	}
+	if (w->conf != NULL) {
+		conf_free(w->conf);
+		w->conf = NULL;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *restrict w = arg;
+	loadlibs_thread();
+	LOGD_F("worker %d: start", w->id);
+	ev_run(w->loop, 0);
+	server_stop(w->server);
+	server_free(w->server);
+	w->server = NULL;
+	unloadlibs_thread();
+	return NULL;
+}
+
+/* the main thread is worker 0, setup the others:
+ *   sessions are pinned to the worker owning the socket they arrived on, so
+ * the data path has no shared state. The sockets are bound here, before
+ * daemonizing and dropping privileges, see workers_run.
+ */
+static bool workers_start(const struct config *restrict conf)
+{
+	const size_t n = (size_t)conf->workers - 1;
+	if (n == 0) {
+		return true;
+	}
+	app.workers = calloc(n, sizeof(struct worker));
+	if (app.workers == NULL) {
+		LOGOOM();
+		return false;
+	}
+	for (size_t i = 0; i < n; i++) {
+		struct worker *restrict w = &app.workers[i];
+		(void)pthread_mutex_init(&w->mu, NULL);
+		w->id = (int)i + 1;
+		app.num_workers++;
+		w->conf = worker_conf_read();
+		if (w->conf == NULL) {
+			return false;
+		}
+		w->loop = ev_loop_new(0);
+		if (w->loop == NULL) {
+			LOGE("ev_loop_new failed");
+			return false;
+		}
+		struct ev_async *restrict w_notify = &w->w_notify;
+		ev_async_init(w_notify, worker_notify_cb);
+		ev_set_priority(w_notify, EV_MAXPRI);
+		w_notify->data = w;
+		ev_async_start(w->loop, w_notify);
+		w->server = server_new(w->loop, w->conf);
+		if (w->server == NULL) {
+			return false;
+		}
+		if (!server_start(w->server)) {
+			server_free(w->server);
+			w->server = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool workers_run(void)
+{
+	/* signals are handled by the main thread */
+	sigset_t set, oldset;
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	bool ok = true;
+	for (size_t i = 0; i < app.num_workers; i++) {
+		struct worker *restrict w = &app.workers[i];
+		const int err = pthread_create(&w->thread, NULL, worker_main, w);
+		if (err != 0) {
+			LOGE_F("pthread_create: %s", strerror(err));
+			ok = false;
+			break;
+		}
+		w->running = true;
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ok && app.num_workers > 0) {
+		LOGI_F("%zu workers started", app.num_workers + 1);
+	}
+	return ok;
+}
+
+static void workers_stop(void)
+{
+	for (size_t i = 0; i < app.num_workers; i++) {
+		struct worker *restrict w = &app.workers[i];
+		if (!w->running) {
+			continue;
+		}
+		(void)pthread_mutex_lock(&w->mu);
+		w->stop = true;
+		(void)pthread_mutex_unlock(&w->mu);
+		ev_async_send(w->loop, &w->w_notify);
+	}
+	for (size_t i = 0; i < app.num_workers; i++) {
+		struct worker *restrict w = &app.workers[i];
+		if (w->running) {
+			(void)pthread_join(w->thread, NULL);
+			w->running = false;
+		}
+		worker_free(w);
+	}
+	UTIL_SAFE_FREE(app.workers);
+	app.num_workers = 0;
+}
+
+static void workers_reload(void)
+{
+	for (size_t i = 0; i < app.num_workers; i++) {
+		struct worker *restrict w = &app.workers[i];
+		struct config *conf = worker_conf_read();
+		if (conf == NULL) {
+			LOGE_F("worker %d: failed to read config", w->id);
+			continue;
+		}
+		(void)pthread_mutex_lock(&w->mu);
+		struct config *old = w->new_conf;
+		w->new_conf = conf;
+		(void)pthread_mutex_unlock(&w->mu);
+		if (old != NULL) {
+			conf_free(old);
+		}
+		ev_async_send(w->loop, &w->w_notify);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	init(argc, argv);
@@ -179,6 +381,14 @@ int main(int argc, char **argv)
 		conf_free(conf);
 		return EXIT_FAILURE;
 	}
+	if (!workers_start(conf)) {
+		LOGE_F("failed to start %s workers", conf_modestr(conf));
+		workers_stop();
+		server_stop(s);
+		server_free(s);
+		conf_free(conf);
+		return EXIT_FAILURE;
+	}
 
 	{
 		struct user_ident ident, *pident = NULL;
@@ -216,6 +426,14 @@ int main(int argc, char **argv)
 		ev_signal_start(loop, w_sigterm);
 	}
 
+	if (!workers_run()) {
+		workers_stop();
+		server_stop(s);
+		server_free(s);
+		conf_free(conf);
+		return EXIT_FAILURE;
+	}
+
 #if WITH_SYSTEMD
 	(void)sd_notify(0, "READY=1");
 #endif
@@ -223,6 +441,7 @@ int main(int argc, char **argv)
 	LOGN_F("%s start", conf_modestr(conf));
 	ev_run(loop, 0);
 
+	workers_stop();
 	server_stop(s);
 	server_free(s);
 	LOGN_F("%s shutdown gracefully", conf_modestr(conf));
@@ -253,6 +472,7 @@ void signal_cb(struct ev_loop *loop, struct ev_signal *watcher, int revents)
 		s->conf = conf;
 		LOGN("config successfully reloaded");
 		(void)server_resolve(s);
+		workers_reload();
 #if WITH_SYSTEMD
 		(void)sd_notify(0, "READY=1");
 #endif
@@ -6,6 +6,7 @@
 #include "conf.h"
 #include "crypto.h"
 #include "event.h"
+#include "fec.h"
 #include "nonce.h"
 #include "obfs.h"
 #include "server.h"
@@ -17,6 +18,7 @@
 #include "math/rand.h"
 #include "utils/debug.h"
 #include "utils/minmax.h"
+#include "utils/serialize.h"
 #include "utils/slog.h"
 
 #include "ikcp.h"
@@ -33,6 +35,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* size of a kcp segment header */
+#define KCP_SEGMENT_HEADER 24
+/* random padding added to short packets when sealing */
+#define SEAL_MAX_PAD 15
+
 #define MSG_LOGVV(what, msg)                                                   \
 	do {                                                                   \
 		if (!LOGLEVEL(VERYVERBOSE)) {                                  \
@@ -106,6 +113,23 @@ static bool crypto_seal_inplace(
 }
 #endif /* WITH_CRYPTO */
 
+static struct session *queue_find(
+	struct server *restrict s, const struct sockaddr *sa,
+	const uint32_t conv)
+{
+	unsigned char sskey[SESSION_KEY_SIZE];
+	SESSION_MAKEKEY(sskey, sa, conv);
+	const struct hashkey hkey = {
+		.len = sizeof(sskey),
+		.data = sskey,
+	};
+	struct session *ss;
+	if (!table_find(s->sessions, hkey, (void **)&ss)) {
+		return NULL;
+	}
+	return ss;
+}
+
 static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 {
 	MSG_LOGVV("queue_recv", msg);
@@ -117,14 +141,8 @@ static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 	}
 
 	const struct sockaddr *sa = &msg->addr.sa;
-	unsigned char sskey[SESSION_KEY_SIZE];
-	SESSION_MAKEKEY(sskey, sa, conv);
-	const struct hashkey hkey = {
-		.len = sizeof(sskey),
-		.data = sskey,
-	};
-	struct session *restrict ss;
-	if (!table_find(s->sessions, hkey, (void **)&ss)) {
+	struct session *restrict ss = queue_find(s, sa, conv);
+	if (ss == NULL) {
 		if ((s->conf->mode & MODE_SERVER) == 0) {
 			if (LOGLEVEL(WARNING)) {
 				LOG_RATELIMITED_F(
@@ -135,6 +153,15 @@ static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 			ss0_reset(s, sa, conv);
 			return;
 		}
+		if (msg->len >= KCP_SEGMENT_HEADER &&
+		    ikcp_getuna(kcp_packet) != 0) {
+			/* it has received data from us, probably from before a
+			 * restart; a shared carrier must not stall new streams */
+			LOGD_F("session [%08" PRIX32 "] kcp: stale, reset",
+			       conv);
+			ss0_reset(s, sa, conv);
+			return;
+		}
 		/* accept new kcp session */
 		ss = session_new(s, &msg->addr, conv);
 		if (ss == NULL) {
@@ -154,6 +181,10 @@ static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 		ss->kcp_state = STATE_CONNECT;
 	}
 
+	if (ss->is_stream) {
+		/* stream ids share the key space, but are not kcp convs */
+		return;
+	}
 	const ev_tstamp now = ev_now(s->loop);
 	if (!sa_equals(sa, &ss->raddr.sa)) {
 		if (ss->last_reset == TSTAMP_NIL ||
@@ -183,8 +214,9 @@ static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 		return;
 	}
 
-	const int r =
-		ikcp_input(ss->kcp, (const char *)kcp_packet, (long)msg->len);
+	kcp_notify_update(ss);
+	const int r = ikcp_input_ref(
+		ss->kcp, (const char *)kcp_packet, (long)msg->len, msg);
 	if (r < 0) {
 		LOGW_F("ikcp_input: %d", r);
 		return;
@@ -192,12 +224,91 @@ static void queue_recv(struct server *restrict s, struct msgframe *restrict msg)
 	ss->stats.kcp_rx += msg->len;
 	s->stats.kcp_rx += msg->len;
 	if (ss->kcp_flush >= 2) {
-		/* flush acks */
-		session_kcp_flush(ss);
+		/* flush acks by the ack policy */
+		kcp_notify_ack(ss);
 	}
 	session_read_cb(ss);
 }
 
+/* a datagram may carry the kcp packets of several sessions, see queue_pack */
+static void
+queue_recv_packed(struct server *restrict s, struct msgframe *restrict msg)
+{
+	const uint16_t off = msg->off, len = msg->len;
+	uint16_t pos = 0;
+	while (pos < len) {
+		const unsigned char *packet = msg->buf + off + pos;
+		long n = (long)(len - pos);
+		if (n >= KCP_SEGMENT_HEADER && ikcp_getconv(packet) != 0) {
+			n = ikcp_span(packet, n);
+		}
+		msg->off = off + pos;
+		msg->len = (uint16_t)n;
+		queue_recv(s, msg);
+		pos += (uint16_t)n;
+	}
+	msg->off = off;
+	msg->len = len;
+}
+
+/* strip the shard header, then try to recover the lost data shards */
+static void
+queue_recv_fec(struct server *restrict s, struct msgframe *restrict msg)
+{
+	if (msg->len < FEC_HEADER_SIZE) {
+		return;
+	}
+	struct pktqueue *restrict q = s->pkt.queue;
+	const unsigned char *packet = msg->buf + msg->off;
+	const struct fec_header header = fec_header_read(packet);
+	const unsigned char *shard = packet + FEC_HEADER_SIZE;
+	size_t len = msg->len - FEC_HEADER_SIZE;
+	struct session *restrict ss;
+	bool is_parity;
+	switch (header.flag) {
+	case FEC_FLAG_NONE:
+		msg->off += FEC_HEADER_SIZE;
+		msg->len = (uint16_t)len;
+		queue_recv(s, msg);
+		return;
+	case FEC_FLAG_DATA: {
+		if (len < sizeof(uint16_t) + sizeof(uint32_t) ||
+		    read_uint16(shard) != len - sizeof(uint16_t)) {
+			return;
+		}
+		msg->off += FEC_DATA_HEADER_SIZE;
+		msg->len = (uint16_t)(len - sizeof(uint16_t));
+		/* deliver first, the session may be accepted here */
+		queue_recv(s, msg);
+		const uint32_t conv = ikcp_getconv(msg->buf + msg->off);
+		ss = queue_find(s, &msg->addr.sa, conv);
+		is_parity = false;
+	} break;
+	case FEC_FLAG_PARITY: {
+		if (len <= sizeof(uint32_t)) {
+			return;
+		}
+		const uint32_t conv = read_uint32(shard);
+		ss = queue_find(s, &msg->addr.sa, conv);
+		shard += sizeof(uint32_t);
+		len -= sizeof(uint32_t);
+		is_parity = true;
+	} break;
+	default:
+		return;
+	}
+	if (ss == NULL || ss->fec == NULL) {
+		return;
+	}
+	struct msgframe *recovered[FEC_MAX_PARITY_SHARDS];
+	const size_t n = fec_decode(
+		ss->fec, q, msg, header.seq, is_parity, shard, len, recovered);
+	for (size_t i = 0; i < n; i++) {
+		queue_recv(s, recovered[i]);
+		msgframe_unref(q, recovered[i]);
+	}
+}
+
 size_t queue_dispatch(struct server *restrict s)
 {
 	struct pktqueue *restrict q = s->pkt.queue;
@@ -220,7 +331,7 @@ size_t queue_dispatch(struct server *restrict s)
 #endif
 #if WITH_CRYPTO
 		if (q->crypto != NULL) {
-			size_t cap = MAX_PACKET_SIZE - msg->off;
+			size_t cap = msg->cap - msg->off;
 			size_t len = msg->len;
 			if (!crypto_open_inplace(
 				    q, msg->buf + msg->off, &len, cap)) {
@@ -236,9 +347,13 @@ size_t queue_dispatch(struct server *restrict s)
 			obfs_ctx_auth(ctx, true);
 		}
 #endif
-		queue_recv(s, msg);
+		if (s->conf->kcp_parityshard > 0) {
+			queue_recv_fec(s, msg);
+		} else {
+			queue_recv_packed(s, msg);
+		}
 		nbrecv += msg->len;
-		msgframe_delete(q, msg);
+		msgframe_unref(q, msg);
 	}
 	q->mq_recv_len = 0;
 	return nbrecv;
@@ -250,10 +365,13 @@ bool queue_send(struct server *restrict s, struct msgframe *restrict msg)
 	MSG_LOGVV("queue_send", msg);
 #if WITH_CRYPTO
 	if (q->crypto != NULL) {
-		const size_t cap = MAX_PACKET_SIZE - (size_t)msg->off;
+		const size_t cap = (size_t)msg->cap - (size_t)msg->off;
 		size_t len = msg->len;
 		assert(len <= cap);
-		const size_t pad = rand64n(MIN(q->mss - len, 15));
+		/* discovered path mtu may be larger than mss, see pmtud.c */
+		const size_t pad =
+			len < q->mss ? rand64n(MIN(q->mss - len, SEAL_MAX_PAD))
+				     : 0;
 		if (!crypto_seal_inplace(
 			    q, msg->buf + msg->off, &len, cap, pad)) {
 			return false;
@@ -289,6 +407,96 @@ bool queue_send(struct server *restrict s, struct msgframe *restrict msg)
 	return true;
 }
 
+static void queue_unpack_slot(struct pktqueue *restrict q, const size_t i)
+{
+	q->mq_pack_len--;
+	memmove(q->mq_pack + i, q->mq_pack + i + 1,
+		(q->mq_pack_len - i) * sizeof(struct msgframe *));
+}
+
+/* a pending frame may be a small one, move it to a frame of mss */
+static bool queue_pack_room(
+	struct pktqueue *restrict q, const size_t i, const size_t n)
+{
+	struct msgframe *restrict p = q->mq_pack[i];
+	if ((size_t)p->off + p->len + n + q->msg_seal <= p->cap) {
+		return true;
+	}
+	struct msgframe *restrict msg = msgframe_alloc(q, q->mss);
+	if (msg == NULL) {
+		LOGOOM();
+		return false;
+	}
+	msg->addr = p->addr;
+#if HAVE_SO_TXTIME
+	msg->txtime = p->txtime;
+#endif
+	memcpy(msg->buf + msg->off, p->buf + p->off, p->len);
+	msg->len = p->len;
+	msgframe_delete(q, p);
+	q->mq_pack[i] = msg;
+	return true;
+}
+
+/* packets are appended to the pending frame of the same peer while there is
+ * room, the frame is sent when it is full or when the loop is about to block,
+ * see pkt_flush_cb; packets to a peer are never reordered */
+bool queue_pack(struct server *restrict s, struct msgframe *restrict msg)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	if (!s->conf->kcp_pack) {
+		return queue_send(s, msg);
+	}
+	const size_t mss = q->mss;
+	bool ok = true;
+	for (size_t i = 0; i < q->mq_pack_len; i++) {
+		struct msgframe *p = q->mq_pack[i];
+		if (!sa_equals(&p->addr.sa, &msg->addr.sa)) {
+			continue;
+		}
+		if ((size_t)p->len + msg->len <= mss &&
+		    queue_pack_room(q, i, msg->len)) {
+			p = q->mq_pack[i];
+			memcpy(p->buf + p->off + p->len, msg->buf + msg->off,
+			       msg->len);
+			p->len += msg->len;
+#if HAVE_SO_TXTIME
+			/* the later packet must not leave early */
+			p->txtime = MAX(p->txtime, msg->txtime);
+#endif
+			msgframe_delete(q, msg);
+			if ((size_t)p->len + KCP_SEGMENT_HEADER > mss) {
+				queue_unpack_slot(q, i);
+				return queue_send(s, p);
+			}
+			return true;
+		}
+		queue_unpack_slot(q, i);
+		ok = queue_send(s, p);
+		break;
+	}
+	if ((size_t)msg->len + KCP_SEGMENT_HEADER > mss) {
+		return queue_send(s, msg) && ok;
+	}
+	if (q->mq_pack_len >= PACK_SLOTS) {
+		struct msgframe *restrict p = q->mq_pack[0];
+		queue_unpack_slot(q, 0);
+		ok = queue_send(s, p) && ok;
+	}
+	q->mq_pack[q->mq_pack_len++] = msg;
+	pkt_notify_send(s);
+	return ok;
+}
+
+void queue_flush_pack(struct server *restrict s)
+{
+	struct pktqueue *restrict q = s->pkt.queue;
+	for (size_t i = 0; i < q->mq_pack_len; i++) {
+		(void)queue_send(s, q->mq_pack[i]);
+	}
+	q->mq_pack_len = 0;
+}
+
 #if WITH_CRYPTO
 static bool queue_new_crypto(
 	struct pktqueue *restrict q, const struct config *restrict conf)
@@ -313,6 +521,8 @@ static bool queue_new_crypto(
 			return false;
 		}
 	}
+	q->msg_seal = (uint16_t)(q->crypto->overhead + q->crypto->nonce_size +
+				 SEAL_MAX_PAD);
 	q->noncegen = noncegen_create(
 		q->crypto->noncegen_method, q->crypto->nonce_size,
 		(conf->mode & MODE_SERVER) != 0);
@@ -340,12 +550,27 @@ struct pktqueue *queue_new(struct server *restrict s)
 		.mq_recv = malloc(recv_cap * sizeof(struct msgframe *)),
 		.mq_recv_cap = recv_cap,
 		.msg_offset = 0,
+		/* jumbo frames only if the mtu may take them */
+		.msg_size = (conf->kcp_mtu <= ETHER_PACKET_SIZE &&
+			     !conf->kcp_pmtud)
+				    ? ETHER_PACKET_SIZE
+				    : MAX_PACKET_SIZE,
 	};
 	if (q->mq_send == NULL || q->mq_recv == NULL) {
 		LOGOOM();
 		queue_free(q);
 		return NULL;
 	}
+#if HAVE_UDP_GRO
+	if (conf->udp_gro) {
+		q->gro_area = malloc((size_t)GRO_BATCH_SIZE * GRO_AREA_SIZE);
+		if (q->gro_area == NULL) {
+			LOGOOM();
+			queue_free(q);
+			return NULL;
+		}
+	}
+#endif
 #if WITH_CRYPTO
 	if (!queue_new_crypto(q, conf)) {
 		queue_free(q);
@@ -381,18 +606,24 @@ void queue_free(struct pktqueue *restrict q)
 {
 	if (q->mq_send != NULL) {
 		for (; q->mq_send_len > 0; q->mq_send_len--) {
-			msgframe_delete(q, q->mq_send[q->mq_send_len]);
+			msgframe_delete(q, q->mq_send[q->mq_send_len - 1]);
 		}
 		free(q->mq_send);
 		q->mq_send = NULL;
 	}
 	if (q->mq_recv != NULL) {
 		for (; q->mq_recv_len > 0; q->mq_recv_len--) {
-			msgframe_delete(q, q->mq_recv[q->mq_recv_len]);
+			msgframe_delete(q, q->mq_recv[q->mq_recv_len - 1]);
 		}
 		free(q->mq_recv);
 		q->mq_recv = NULL;
 	}
+	for (; q->mq_pack_len > 0; q->mq_pack_len--) {
+		msgframe_delete(q, q->mq_pack[q->mq_pack_len - 1]);
+	}
+#if HAVE_UDP_GRO
+	UTIL_SAFE_FREE(q->gro_area);
+#endif
 #if WITH_CRYPTO
 	if (q->crypto != NULL) {
 		crypto_free(q->crypto);
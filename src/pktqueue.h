@@ -11,19 +11,48 @@
 
 #include <ev.h>
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define MAX_PACKET_SIZE 1500
+/* jumbo frames */
+#define MAX_PACKET_SIZE 9000
+/* payload sizes of the frame pools, see msgpool */
+#define SMALL_PACKET_SIZE 256
+#define ETHER_PACKET_SIZE 1500
 #define MMSG_BATCH_SIZE 128
+/* coalesced datagrams are received in a separate area */
+#define GRO_BATCH_SIZE 16
+#define GRO_AREA_SIZE 65536
+/* small kcp packets to different peers waiting to be coalesced */
+#define PACK_SLOTS 16
 
 struct msgframe {
-	union sockaddr_max addr;
+	ev_tstamp ts;
 	uint16_t len;
 	uint16_t off;
-	ev_tstamp ts;
-	unsigned char buf[MAX_PACKET_SIZE];
+	/* the size of buf, decides the pool */
+	uint16_t cap;
+	/* a path mtu probe, may be larger than the local mtu allows */
+	bool probe : 1;
+#if HAVE_UDP_GSO
+	/* sent as a datagram of its own, never segmented */
+	bool nogso : 1;
+#endif
+	/* kcp segments may borrow the payload of a received frame */
+	uint32_t refs;
+#if HAVE_SO_TXTIME
+	/* earliest departure in CLOCK_MONOTONIC nanoseconds, 0 for now */
+	uint64_t txtime;
+#endif
+#if WITH_IO_URING
+	/* io_uring receives the header, the address and the payload
+	 * contiguously, so keep them in that order */
+	unsigned char uring_hdr[16];
+#endif
+	union sockaddr_max addr;
+	unsigned char buf[];
 };
 
 struct pktqueue {
@@ -31,8 +60,17 @@ struct pktqueue {
 	size_t mq_send_len, mq_send_cap;
 	struct msgframe **mq_recv;
 	size_t mq_recv_len, mq_recv_cap;
+	struct msgframe *mq_pack[PACK_SLOTS];
+	size_t mq_pack_len;
 	uint16_t msg_offset;
+	/* the size of received frames, by kcp.mtu and pmtud */
+	uint16_t msg_size;
+	/* the room for sealing after the plaintext */
+	uint16_t msg_seal;
 	uint16_t mss;
+#if HAVE_UDP_GRO
+	unsigned char *gro_area;
+#endif
 #if WITH_CRYPTO
 	struct crypto *crypto;
 	struct noncegen *noncegen;
@@ -47,20 +85,82 @@ struct server;
 struct pktqueue *queue_new(struct server *s);
 void queue_free(struct pktqueue *q);
 
-static inline struct msgframe *msgframe_new(struct pktqueue *restrict q)
+static inline enum msgpool_class msgpool_class(const size_t size)
+{
+	if (size <= SMALL_PACKET_SIZE) {
+		return MSGPOOL_SMALL;
+	}
+	if (size <= ETHER_PACKET_SIZE) {
+		return MSGPOOL_ETHER;
+	}
+	assert(size <= MAX_PACKET_SIZE);
+	return MSGPOOL_JUMBO;
+}
+
+static inline size_t msgpool_size(const enum msgpool_class c)
+{
+	switch (c) {
+	case MSGPOOL_SMALL:
+		return SMALL_PACKET_SIZE;
+	case MSGPOOL_ETHER:
+		return ETHER_PACKET_SIZE;
+	default:
+		break;
+	}
+	return MAX_PACKET_SIZE;
+}
+
+static inline struct msgframe *
+msgframe_get(struct pktqueue *restrict q, const size_t size)
 {
-	struct msgframe *restrict msg = mcache_get(msgpool);
+	const enum msgpool_class c = msgpool_class(size);
+	struct msgframe *restrict msg = mcache_get(msgpool[c]);
 	if (msg == NULL) {
 		return NULL;
 	}
 	msg->off = q->msg_offset;
+	msg->cap = (uint16_t)msgpool_size(c);
+	msg->refs = 1;
+	msg->probe = false;
+#if HAVE_UDP_GSO
+	msg->nogso = false;
+#endif
+#if HAVE_SO_TXTIME
+	msg->txtime = 0;
+#endif
 	return msg;
 }
 
+/* a frame to receive a datagram */
+static inline struct msgframe *msgframe_new(struct pktqueue *restrict q)
+{
+	return msgframe_get(q, q->msg_size);
+}
+
+/* a frame to send n bytes of plaintext */
+static inline struct msgframe *
+msgframe_alloc(struct pktqueue *restrict q, const size_t n)
+{
+	return msgframe_get(q, q->msg_offset + n + q->msg_seal);
+}
+
 static inline void msgframe_delete(struct pktqueue *q, struct msgframe *msg)
 {
 	UNUSED(q);
-	mcache_put(msgpool, msg);
+	mcache_put(msgpool[msgpool_class(msg->cap)], msg);
+}
+
+static inline void msgframe_ref(struct msgframe *msg)
+{
+	msg->refs++;
+}
+
+static inline void msgframe_unref(struct pktqueue *q, struct msgframe *msg)
+{
+	assert(msg->refs > 0);
+	if (--msg->refs == 0) {
+		msgframe_delete(q, msg);
+	}
 }
 
 /* process mq_recv */
@@ -69,4 +169,11 @@ size_t queue_dispatch(struct server *s);
 /* send a plain packet */
 bool queue_send(struct server *s, struct msgframe *msg);
 
+/* send a plain kcp packet, which may be coalesced with the packets of other
+ * sessions to the same peer */
+bool queue_pack(struct server *s, struct msgframe *msg);
+
+/* send the coalesced packets */
+void queue_flush_pack(struct server *s);
+
 #endif /* PACKET_H */
@@ -0,0 +1,406 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+/* pmtud.c - packetization layer path mtu discovery */
+
+#include "pmtud.h"
+
+#include "conf.h"
+#include "pktqueue.h"
+#include "server.h"
+#include "session.h"
+#include "sockutil.h"
+#include "util.h"
+
+#include "algo/hashtable.h"
+#include "utils/debug.h"
+#include "utils/minmax.h"
+#include "utils/slog.h"
+
+#include <ev.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a probe not acknowledged in time is sent again, then considered lost */
+#define PMTUD_PROBE_TIMEOUT 1.0
+#define PMTUD_MAX_PROBES 3
+/* the size in use is probed regularly, which also keeps the server updated */
+#define PMTUD_CONFIRM_INTERVAL 30.0
+/* search for a larger size again, the path may have changed */
+#define PMTUD_RAISE_INTERVAL 600.0
+/* the server falls back for a peer that has stopped confirming */
+#define PMTUD_PEER_TIMEOUT (4.0 * PMTUD_CONFIRM_INTERVAL)
+
+#define PEER_KEY_SIZE (sizeof(union sockaddr_max))
+
+struct pmtud_peer {
+	unsigned char key[PEER_KEY_SIZE];
+	union sockaddr_max addr;
+	size_t mss;
+	ev_tstamp last_seen;
+};
+
+#define PEER_GETKEY(peer)                                                      \
+	((struct hashkey){                                                     \
+		.len = PEER_KEY_SIZE,                                          \
+		.data = (peer)->key,                                           \
+	})
+
+struct pmtud {
+	struct server *server;
+	/* peers using larger packets than pktqueue.mss */
+	struct hashtable *peers;
+	struct ev_timer w_probe, w_timeout;
+	/* client: the peer being probed */
+	union sockaddr_max addr;
+	/* client: sizes up to lo are known to work, sizes above hi are known
+	 * to fail; there is a search going on while lo < hi */
+	size_t lo, hi;
+	/* client: the size of the probe in flight, 0 if none */
+	size_t probe;
+	uint32_t seq;
+	int tries;
+	ev_tstamp last_search, last_confirm;
+};
+
+/* from kcp.mtu to pktqueue.mss */
+static size_t pmtud_overhead(const struct server *restrict s)
+{
+	return (size_t)s->conf->kcp_mtu - (size_t)s->pkt.queue->mss;
+}
+
+size_t pmtud_max(const struct server *restrict s)
+{
+	return (size_t)s->pkt.queue->msg_size - pmtud_overhead(s);
+}
+
+static struct pmtud_peer *
+peer_find(const struct pmtud *restrict p, const struct sockaddr *sa)
+{
+	unsigned char key[PEER_KEY_SIZE];
+	const size_t n = getsocklen(sa);
+	memcpy(key, sa, n);
+	memset(key + n, 0, sizeof(key) - n);
+	const struct hashkey hkey = {
+		.len = sizeof(key),
+		.data = key,
+	};
+	struct pmtud_peer *peer;
+	if (!table_find(p->peers, hkey, (void **)&peer)) {
+		return NULL;
+	}
+	return peer;
+}
+
+size_t pmtud_mss(const struct server *restrict s, const struct sockaddr *sa)
+{
+	const struct pmtud *restrict p = s->pmtud;
+	if (p != NULL) {
+		const struct pmtud_peer *restrict peer = peer_find(p, sa);
+		if (peer != NULL) {
+			return peer->mss;
+		}
+	}
+	return s->pkt.queue->mss;
+}
+
+struct setmss_ctx {
+	const struct sockaddr *sa;
+	size_t mss;
+};
+
+static bool setmss_iter(
+	const struct hashtable *t, const struct hashkey key, void *element,
+	void *user)
+{
+	UNUSED(t);
+	struct session *restrict ss = element;
+	(void)key, assert(key.data == ss->key);
+	const struct setmss_ctx *restrict ctx = user;
+	if (ss->kcp != NULL && sa_equals(&ss->raddr.sa, ctx->sa)) {
+		session_kcp_setmss(ss, ctx->mss);
+	}
+	return true;
+}
+
+/* records the size for a peer and applies it to the existing sessions */
+static void peer_set(
+	struct pmtud *restrict p, const struct sockaddr *sa, const size_t mss)
+{
+	struct server *restrict s = p->server;
+	const size_t base = s->pkt.queue->mss;
+	struct pmtud_peer *restrict peer = peer_find(p, sa);
+	if (peer != NULL) {
+		peer->last_seen = ev_now(s->loop);
+		if (peer->mss == mss) {
+			return;
+		}
+		if (mss <= base) {
+			p->peers = table_del(p->peers, PEER_GETKEY(peer), NULL);
+			free(peer);
+		} else {
+			peer->mss = mss;
+		}
+	} else {
+		if (mss <= base) {
+			return;
+		}
+		if (table_size(p->peers) >= MAX_SESSIONS) {
+			LOGW("path mtu: too many peers");
+			return;
+		}
+		peer = malloc(sizeof(struct pmtud_peer));
+		if (peer == NULL) {
+			LOGOOM();
+			return;
+		}
+		*peer = (struct pmtud_peer){
+			.mss = mss,
+			.last_seen = ev_now(s->loop),
+		};
+		copy_sa(&peer->addr.sa, sa);
+		const size_t n = getsocklen(sa);
+		memcpy(peer->key, sa, n);
+		memset(peer->key + n, 0, sizeof(peer->key) - n);
+		void *elem = peer;
+		p->peers = table_set(p->peers, PEER_GETKEY(peer), &elem);
+		assert(elem == NULL);
+	}
+	if (LOGLEVEL(INFO)) {
+		char addr_str[64];
+		format_sa(sa, addr_str, sizeof(addr_str));
+		/* in the unit of kcp.mtu */
+		LOG_F(INFO, "path mtu of %s: %zu", addr_str,
+		      MAX(mss, base) + pmtud_overhead(s));
+	}
+	struct setmss_ctx ctx = {
+		.sa = sa,
+		.mss = MAX(mss, base),
+	};
+	table_iterate(s->sessions, setmss_iter, &ctx);
+}
+
+void pmtud_on_probe(
+	struct pmtud *restrict p, const struct sockaddr *sa, const size_t mss)
+{
+	const struct server *restrict s = p->server;
+	peer_set(p, sa, CLAMP(mss, s->pkt.queue->mss, pmtud_max(s)));
+}
+
+static void pmtud_search(struct pmtud *restrict p, const size_t lo)
+{
+	p->lo = lo;
+	p->hi = pmtud_max(p->server);
+	p->probe = 0;
+	p->last_search = ev_now(p->server->loop);
+}
+
+static void pmtud_send(struct pmtud *restrict p, const size_t size)
+{
+	struct server *restrict s = p->server;
+	if (p->probe != size) {
+		p->probe = size;
+		p->seq++;
+		p->tries = 0;
+	}
+	p->tries++;
+	/* tell the server the size in use */
+	const size_t mss = pmtud_mss(s, &p->addr.sa);
+	(void)ss0_probe(s, &p->addr.sa, p->seq, mss, size);
+}
+
+/* client: sends the next probe, returns the time until the next update */
+static ev_tstamp pmtud_update(struct pmtud *restrict p)
+{
+	struct server *restrict s = p->server;
+	if (!s->pkt.connected) {
+		return PMTUD_PROBE_TIMEOUT;
+	}
+	const struct sockaddr *sa = &s->pkt.kcp_connect.sa;
+	const size_t base = s->pkt.queue->mss;
+	if (!sa_equals(sa, &p->addr.sa)) {
+		copy_sa(&p->addr.sa, sa);
+		pmtud_search(p, base);
+	}
+	if (p->probe != 0) {
+		if (p->tries < PMTUD_MAX_PROBES) {
+			pmtud_send(p, p->probe);
+			return PMTUD_PROBE_TIMEOUT;
+		}
+		/* the probe is lost */
+		const size_t mss = pmtud_mss(s, sa);
+		if (p->probe > mss) {
+			p->hi = p->probe - 1;
+		} else if (mss > base) {
+			/* larger packets are no longer passing, sessions with
+			 * larger segments in flight are reset */
+			LOGW("path mtu: confirmation lost, falling back");
+			peer_set(p, sa, base);
+			pmtud_search(p, base);
+		}
+		p->probe = 0;
+	}
+	const ev_tstamp now = ev_now(s->loop);
+	if (p->lo >= p->hi && p->lo < pmtud_max(s) &&
+	    now - p->last_search >= PMTUD_RAISE_INTERVAL) {
+		pmtud_search(p, p->lo);
+	}
+	if (p->lo < p->hi) {
+		/* most paths take the largest size or that of ethernet, try
+		 * them first */
+		const size_t max = pmtud_max(s);
+		const size_t ether = ETHER_PACKET_SIZE - pmtud_overhead(s);
+		size_t size = p->lo + (p->hi - p->lo + 1) / 2;
+		if (p->hi == max) {
+			size = max;
+		} else if (p->lo < ether && ether <= p->hi) {
+			size = ether;
+		}
+		pmtud_send(p, size);
+		return PMTUD_PROBE_TIMEOUT;
+	}
+	peer_set(p, sa, p->lo);
+	if (p->last_confirm == TSTAMP_NIL ||
+	    now - p->last_confirm >= PMTUD_CONFIRM_INTERVAL) {
+		p->last_confirm = now;
+		pmtud_send(p, p->lo);
+		return PMTUD_PROBE_TIMEOUT;
+	}
+	return p->last_confirm + PMTUD_CONFIRM_INTERVAL - now;
+}
+
+void pmtud_on_ack(
+	struct pmtud *restrict p, const struct sockaddr *sa, const uint32_t seq)
+{
+	if (p->probe == 0 || seq != p->seq || !sa_equals(sa, &p->addr.sa)) {
+		return;
+	}
+	if (p->probe > p->lo) {
+		/* use it while searching on */
+		p->lo = p->probe;
+		peer_set(p, sa, p->lo);
+	}
+	p->probe = 0;
+	/* go on without waiting for the timer */
+	struct ev_timer *restrict w_probe = &p->w_probe;
+	w_probe->repeat = pmtud_update(p);
+	ev_timer_again(p->server->loop, w_probe);
+}
+
+static void
+pmtud_probe_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+	CHECK_REVENTS(revents, EV_TIMER);
+	struct pmtud *restrict p = watcher->data;
+	watcher->repeat = pmtud_update(p);
+	ev_timer_again(loop, watcher);
+}
+
+static bool peer_timeout_filt(
+	const struct hashtable *t, const struct hashkey key, void *element,
+	void *user)
+{
+	UNUSED(t);
+	struct pmtud *restrict p = user;
+	struct server *restrict s = p->server;
+	struct pmtud_peer *restrict peer = element;
+	(void)key, assert(key.data == peer->key);
+	const double not_seen = ev_now(s->loop) - peer->last_seen;
+	if (not_seen < PMTUD_PEER_TIMEOUT) {
+		return true;
+	}
+	struct setmss_ctx ctx = {
+		.sa = &peer->addr.sa,
+		.mss = s->pkt.queue->mss,
+	};
+	table_iterate(s->sessions, setmss_iter, &ctx);
+	free(peer);
+	return false;
+}
+
+static void
+pmtud_timeout_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+	UNUSED(loop);
+	CHECK_REVENTS(revents, EV_TIMER);
+	struct pmtud *restrict p = watcher->data;
+	p->peers = table_filter(p->peers, peer_timeout_filt, p);
+}
+
+struct pmtud *pmtud_new(struct server *restrict s)
+{
+	struct pmtud *restrict p = malloc(sizeof(struct pmtud));
+	if (p == NULL) {
+		LOGOOM();
+		return NULL;
+	}
+	*p = (struct pmtud){
+		.server = s,
+		.last_search = TSTAMP_NIL,
+		.last_confirm = TSTAMP_NIL,
+	};
+	p->peers = table_new(TABLE_DEFAULT);
+	if (p->peers == NULL) {
+		LOGOOM();
+		free(p);
+		return NULL;
+	}
+	{
+		struct ev_timer *restrict w_probe = &p->w_probe;
+		ev_timer_init(w_probe, pmtud_probe_cb, 1.0, PMTUD_PROBE_TIMEOUT);
+		ev_set_priority(w_probe, EV_MINPRI);
+		w_probe->data = p;
+
+		struct ev_timer *restrict w_timeout = &p->w_timeout;
+		ev_timer_init(w_timeout, pmtud_timeout_cb, 10.0, 10.0);
+		ev_set_priority(w_timeout, EV_MINPRI);
+		w_timeout->data = p;
+	}
+	return p;
+}
+
+void pmtud_start(struct pmtud *restrict p)
+{
+	struct server *restrict s = p->server;
+	if ((s->conf->mode & MODE_CLIENT) != 0) {
+		ev_timer_start(s->loop, &p->w_probe);
+	}
+	ev_timer_start(s->loop, &p->w_timeout);
+}
+
+static bool peer_shutdown_filt(
+	const struct hashtable *t, const struct hashkey key, void *element,
+	void *user)
+{
+	UNUSED(t);
+	UNUSED(user);
+	struct pmtud_peer *restrict peer = element;
+	(void)key, assert(key.data == peer->key);
+	free(peer);
+	return false;
+}
+
+void pmtud_stop(struct pmtud *restrict p)
+{
+	struct ev_loop *loop = p->server->loop;
+	ev_timer_stop(loop, &p->w_probe);
+	ev_timer_stop(loop, &p->w_timeout);
+	p->peers = table_filter(p->peers, peer_shutdown_filt, NULL);
+	p->addr = (union sockaddr_max){ .sa.sa_family = AF_UNSPEC };
+	p->probe = 0;
+	p->last_confirm = TSTAMP_NIL;
+}
+
+void pmtud_free(struct pmtud *p)
+{
+	if (p == NULL) {
+		return;
+	}
+	table_free(p->peers);
+	free(p);
+}
@@ -0,0 +1,35 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+#ifndef PMTUD_H
+#define PMTUD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct server;
+struct sockaddr;
+struct pmtud;
+
+/* packetization layer path mtu discovery (RFC 8899): the client probes the
+ * largest packet that makes a round trip to the server over session 0, both
+ * sides then use it for the kcp sessions between them; sizes here are in
+ * the same unit as pktqueue.mss */
+
+struct pmtud *pmtud_new(struct server *s);
+void pmtud_start(struct pmtud *p);
+void pmtud_stop(struct pmtud *p);
+void pmtud_free(struct pmtud *p);
+
+/* the largest packet a received frame can carry */
+size_t pmtud_max(const struct server *s);
+/* the packet size to use for the kcp sessions of a peer */
+size_t pmtud_mss(const struct server *s, const struct sockaddr *sa);
+
+/* server: a probe carrying the path mtu confirmed by the client */
+void pmtud_on_probe(struct pmtud *p, const struct sockaddr *sa, size_t mss);
+/* client: a probe has made the round trip */
+void pmtud_on_ack(struct pmtud *p, const struct sockaddr *sa, uint32_t seq);
+
+#endif /* PMTUD_H */
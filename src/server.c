@@ -8,6 +8,7 @@
 #include "event.h"
 #include "obfs.h"
 #include "pktqueue.h"
+#include "pmtud.h"
 #include "session.h"
 #include "sockutil.h"
 #include "util.h"
@@ -147,6 +148,25 @@ static bool udp_init(
 	}
 	socket_set_reuseport(udp->fd, conf->udp_reuseport);
 	socket_set_buffer(udp->fd, conf->udp_sndbuf, conf->udp_rcvbuf);
+	udp->gso = socket_udp_gso(udp->fd);
+	LOGD_F("udp gso: %s", udp->gso ? "enabled" : "disabled");
+	if (conf->udp_gro) {
+		udp->gro = socket_set_udp_gro(udp->fd);
+	}
+	if (conf->udp_pacing) {
+		/* the departure time is ignored unless the egress qdisc is fq
+		 * or etf, which cannot be told from here */
+		if (conf->udp_txtime) {
+			udp->txtime = socket_set_txtime(udp->fd);
+		}
+		LOGI_F("udp pacing: %s",
+		       udp->txtime ? "SO_TXTIME, requires the fq or etf qdisc" :
+				     "token bucket");
+	}
+	if (conf->kcp_pmtud) {
+		/* the probes must not be fragmented */
+		(void)socket_set_dontfrag(udp->fd, udp_af);
+	}
 	return true;
 }
 
@@ -360,11 +380,22 @@ static bool udp_start(struct server *restrict s)
 	struct ev_io *restrict w_read = &udp->w_read;
 	ev_io_init(w_read, pkt_read_cb, udp->fd, EV_READ);
 	w_read->data = s;
-	ev_io_start(s->loop, w_read);
 
 	struct ev_io *restrict w_write = &udp->w_write;
 	ev_io_init(w_write, pkt_write_cb, udp->fd, EV_WRITE);
 	w_write->data = s;
+
+	if (s->conf->udp_io_uring) {
+#if WITH_IO_URING
+		if (pkt_uring_start(s)) {
+			return true;
+		}
+		LOGW("io_uring is unavailable, fallback to the default path");
+#else
+		LOGW("io_uring: not supported in current build");
+#endif
+	}
+	ev_io_start(s->loop, w_read);
 	return true;
 }
 
@@ -404,11 +435,6 @@ struct server *server_new(struct ev_loop *loop, struct config *restrict conf)
 	};
 
 	{
-		const double interval = conf->kcp_interval * 1e-3;
-		struct ev_timer *restrict w_kcp_update = &s->w_kcp_update;
-		ev_timer_init(w_kcp_update, kcp_update_cb, interval, interval);
-		w_kcp_update->data = s;
-
 		struct ev_timer *restrict w_keepalive = &s->w_keepalive;
 		ev_timer_init(w_keepalive, keepalive_cb, 0.0, s->keepalive);
 		ev_set_priority(w_keepalive, EV_MINPRI);
@@ -423,6 +449,10 @@ struct server *server_new(struct ev_loop *loop, struct config *restrict conf)
 		ev_timer_init(w_timeout, timeout_cb, 10.0, 10.0);
 		ev_set_priority(w_timeout, EV_MINPRI);
 		w_timeout->data = s;
+
+		struct ev_prepare *restrict w_flush = &s->pkt.w_flush;
+		ev_prepare_init(w_flush, pkt_flush_cb);
+		w_flush->data = s;
 	}
 
 	if ((conf->mode & (MODE_CLIENT | MODE_RENDEZVOUS)) == 0) {
@@ -450,6 +480,13 @@ struct server *server_new(struct ev_loop *loop, struct config *restrict conf)
 		server_free(s);
 		return false;
 	}
+	if (conf->kcp_pmtud) {
+		s->pmtud = pmtud_new(s);
+		if (s->pmtud == NULL) {
+			server_free(s);
+			return NULL;
+		}
+	}
 	return s;
 }
 
@@ -469,12 +506,14 @@ bool server_start(struct server *s)
 		}
 	}
 	s->last_resolve_time = now;
-	ev_timer_start(loop, &s->w_kcp_update);
 	if (s->keepalive > 0.0) {
 		ev_timer_start(loop, &s->w_keepalive);
 		ev_timer_start(loop, &s->w_resolve);
 	}
 	ev_timer_start(loop, &s->w_timeout);
+	if (s->pmtud != NULL) {
+		pmtud_start(s->pmtud);
+	}
 
 	struct pktqueue *restrict q = s->pkt.queue;
 #if WITH_OBFS
@@ -563,13 +602,19 @@ void server_stop(struct server *restrict s)
 {
 	struct ev_loop *loop = s->loop;
 	listener_stop(loop, &s->listener);
-	ev_timer_stop(loop, &s->w_kcp_update);
 	ev_timer_stop(loop, &s->w_keepalive);
 	ev_timer_stop(loop, &s->w_resolve);
 	ev_timer_stop(loop, &s->w_timeout);
+	ev_prepare_stop(loop, &s->pkt.w_flush);
+	if (s->pmtud != NULL) {
+		pmtud_stop(s->pmtud);
+	}
 	const size_t num = table_size(s->sessions);
 	s->sessions = table_filter(s->sessions, shutdown_filt, NULL);
 	LOGI_F("%zu sessions closed", num);
+#if WITH_IO_URING
+	pkt_uring_stop(s);
+#endif
 #if WITH_OBFS
 	if (s->pkt.queue->obfs != NULL) {
 		obfs_stop(s->pkt.queue->obfs, s);
@@ -584,6 +629,7 @@ void server_stop(struct server *restrict s)
 void server_free(struct server *restrict s)
 {
 	udp_free(&s->pkt);
+	pmtud_free(s->pmtud);
 	if (s->sessions != NULL) {
 		table_free(s->sessions);
 		s->sessions = NULL;
@@ -676,16 +722,20 @@ static bool print_session_iter(
 	FORMAT_BYTES(kcp_tx, (double)ss->stats.tcp_rx);
 
 	int rtt = -1, rto = -1;
+	uint32_t sndwnd = 0, rcvwnd = 0;
 	if (ss->kcp != NULL) {
 		rtt = CLAMP(ss->kcp->rx_srtt, INT_MIN, INT_MAX);
 		rto = CLAMP(ss->kcp->rx_rto, INT_MIN, INT_MAX);
+		sndwnd = ss->kcp->snd_wnd;
+		rcvwnd = ss->kcp->rcv_wnd;
 	}
 	ctx->buf = VBUF_APPENDF(
 		ctx->buf,
 		"[%08" PRIX32 "] %c peer=%s seen=%.0lfs "
-		"rtt=%d rto=%d waitsnd=%zu rx/tx=%s/%s\n",
+		"rtt=%d rto=%d wnd=%" PRIu32 "/%" PRIu32 " waitsnd=%zu "
+		"rx/tx=%s/%s\n",
 		ss->conv, session_state_char[state], addr_str, not_seen, rtt,
-		rto, waitsnd, kcp_rx, kcp_tx);
+		rto, sndwnd, rcvwnd, waitsnd, kcp_rx, kcp_tx);
 #undef FORMAT_BYTES
 
 	return true;
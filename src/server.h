@@ -25,7 +25,11 @@ struct listener {
 
 struct pktconn {
 	struct ev_io w_read, w_write;
+	struct ev_prepare w_flush;
 	struct pktqueue *queue;
+#if WITH_IO_URING
+	struct pkt_uring *uring;
+#endif
 	int fd;
 	int domain;
 	union sockaddr_max kcp_connect;
@@ -35,6 +39,9 @@ struct pktconn {
 
 	bool listened : 1;
 	bool connected : 1;
+	bool gso : 1;
+	bool gro : 1;
+	bool txtime : 1;
 	union sockaddr_max server_addr[2];
 	union sockaddr_max rendezvous_server;
 	union sockaddr_max rendezvous_local;
@@ -43,6 +50,8 @@ struct pktconn {
 #define MAX_SESSIONS 65535
 
 struct config;
+struct session;
+struct pmtud;
 
 struct link_stats {
 	uintmax_t tcp_rx, tcp_tx;
@@ -57,6 +66,12 @@ struct server {
 	struct pktconn pkt;
 	uint32_t m_conv;
 	struct hashtable *sessions;
+	/* client: the session carrying new streams, see session_mux */
+	struct session *mux;
+	/* segments in the auto-tuned windows of all sessions */
+	size_t wnd_total;
+	/* path mtu discovery, NULL if disabled */
+	struct pmtud *pmtud;
 	struct {
 		union sockaddr_max connect;
 
@@ -67,7 +82,6 @@ struct server {
 		double ping_timeout;
 	};
 	struct {
-		struct ev_timer w_kcp_update;
 		struct ev_timer w_keepalive;
 		struct ev_timer w_resolve;
 		struct ev_timer w_timeout;
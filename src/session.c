@@ -5,7 +5,9 @@
 
 #include "conf.h"
 #include "event.h"
+#include "fec.h"
 #include "pktqueue.h"
+#include "pmtud.h"
 #include "server.h"
 #include "sockutil.h"
 #include "util.h"
@@ -15,6 +17,7 @@
 #include "utils/buffer.h"
 #include "utils/debug.h"
 #include "utils/formats.h"
+#include "utils/minmax.h"
 #include "utils/serialize.h"
 #include "utils/slog.h"
 
@@ -23,10 +26,12 @@
 #include <ev.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -45,6 +50,16 @@ static void kcp_log(const char *log, struct IKCPCB *kcp, void *user)
 	LOGV_F("session [%08" PRIX32 "] kcp internal: %s", ss->conv, log);
 }
 
+/* the kcp packets must fit in datagrams carrying mss bytes */
+static int kcp_mtu(const struct config *restrict conf, size_t mss)
+{
+	if (conf->kcp_parityshard > 0) {
+		/* parity shards are slightly larger than the kcp packets */
+		mss -= FEC_OVERHEAD;
+	}
+	return (int)mss;
+}
+
 static ikcpcb *
 kcp_new(struct session *restrict ss, const struct config *restrict conf,
 	uint32_t conv)
@@ -53,24 +68,250 @@ kcp_new(struct session *restrict ss, const struct config *restrict conf,
 	if (kcp == NULL) {
 		return NULL;
 	}
-	ikcp_wndsize(kcp, conf->kcp_sndwnd, conf->kcp_rcvwnd);
-	ikcp_setmtu(kcp, (int)ss->server->pkt.queue->mss);
+	if (conf->kcp_autotune) {
+		/* grown on demand, see kcp_autotune */
+		ikcp_wndsize(
+			kcp, (int)AUTOTUNE_SNDWND_FLOOR(conf),
+			(int)AUTOTUNE_RCVWND_FLOOR(conf));
+	} else {
+		ikcp_wndsize(kcp, conf->kcp_sndwnd, conf->kcp_rcvwnd);
+	}
+	ikcp_setmtu(kcp, kcp_mtu(conf, pmtud_mss(ss->server, &ss->raddr.sa)));
 	ikcp_nodelay(
 		kcp, conf->kcp_nodelay, conf->kcp_interval, conf->kcp_resend,
 		conf->kcp_nc);
+	ikcp_sack(kcp, conf->kcp_sack);
+	if (conf->kcp_flush >= 2) {
+		ikcp_ackpolicy(kcp, conf->kcp_ackfreq, conf->kcp_ackdelay);
+	}
+	if (conf->udp_pacing) {
+		ikcp_pacing(
+			kcp, ss->server->pkt.txtime ? IKCP_PACING_EXTERNAL :
+						      IKCP_PACING_WINDOW);
+	}
+	if (conf->kcp_cc != NULL &&
+	    ikcp_setcc(kcp, ikcp_findcc(conf->kcp_cc)) != 0) {
+		ikcp_release(kcp);
+		return NULL;
+	}
 	ikcp_setoutput(kcp, kcp_output);
+	ikcp_setoutbuf(kcp, kcp_outbuf);
+	ikcp_setref(kcp, kcp_retain, kcp_release);
 	if (LOGLEVEL(VERBOSE)) {
 		kcp->logmask = -1;
 		kcp->writelog = kcp_log;
 	}
+	if (conf->kcp_autotune) {
+		ss->server->wnd_total += kcp->snd_wnd + kcp->rcv_wnd;
+		ss->tune.ts = TSTAMP2MS(ev_now(ss->server->loop));
+	}
 	return kcp;
 }
 
-static void consume_wbuf(struct session *restrict ss, const size_t n)
+/* the data received over kcp, looked at in place */
+struct ss_input {
+	struct iovec iov[WBUF_MAX_SEG];
+	int niov;
+	size_t len;
+	/* parsing goes forward, so does the segment last looked at */
+	int cur;
+	size_t base;
+};
+
+static void ss_input(struct session *restrict ss, struct ss_input *restrict in)
+{
+	in->niov = ikcp_peekv(ss->kcp, in->iov, (int)ARRAY_SIZE(in->iov));
+	in->len = 0;
+	for (int i = 0; i < in->niov; i++) {
+		in->len += in->iov[i].iov_len;
+	}
+	in->cur = 0;
+	in->base = 0;
+}
+
+/* the segment holding the byte at offset off */
+static int input_seek(struct ss_input *restrict in, const size_t off)
+{
+	assert(off < in->len);
+	if (off < in->base) {
+		in->cur = 0;
+		in->base = 0;
+	}
+	while (off >= in->base + in->iov[in->cur].iov_len) {
+		in->base += in->iov[in->cur].iov_len;
+		in->cur++;
+	}
+	return in->cur;
+}
+
+/* copies n bytes at offset off out of the segments */
+static void input_copy(
+	struct ss_input *restrict in, const size_t off,
+	unsigned char *restrict dst, size_t n)
 {
-	VBUF_CONSUME(ss->wbuf, n);
-	ss->wbuf_flush = 0;
-	ss->wbuf_next = 0;
+	assert(off + n <= in->len);
+	if (n == 0) {
+		return;
+	}
+	int i = input_seek(in, off);
+	size_t pos = off - in->base;
+	while (n > 0) {
+		const size_t k = MIN(n, in->iov[i].iov_len - pos);
+		memcpy(dst, (const unsigned char *)in->iov[i].iov_base + pos, k);
+		dst += k, n -= k;
+		pos = 0;
+		i++;
+	}
+}
+
+/* n bytes at offset off, copied to dst only if they are split */
+static const unsigned char *input_peek(
+	struct ss_input *restrict in, const size_t off,
+	unsigned char *restrict dst, const size_t n)
+{
+	assert(n > 0 && off + n <= in->len);
+	const int i = input_seek(in, off);
+	const size_t pos = off - in->base;
+	if (pos + n <= in->iov[i].iov_len) {
+		return (const unsigned char *)in->iov[i].iov_base + pos;
+	}
+	input_copy(in, off, dst, n);
+	return dst;
+}
+
+/* a chunk of a striped stream that has overtaken the earlier ones */
+struct stripe_chunk {
+	struct stripe_chunk *next;
+	uint32_t off;
+	size_t len;
+	unsigned char data[];
+};
+
+/* carriers in the stripe group, 1 if the carrier is not striped */
+static size_t stripe_count(const struct session *restrict mux)
+{
+	size_t n = 1;
+	for (const struct session *m = mux->stream.stripe;
+	     m != NULL && m != mux; m = m->stream.stripe) {
+		n++;
+	}
+	return n;
+}
+
+static bool
+stripe_member(const struct session *restrict mux, const struct session *m)
+{
+	const struct session *it = mux;
+	do {
+		if (it == m) {
+			return true;
+		}
+		it = it->stream.stripe;
+	} while (it != NULL && it != mux);
+	return false;
+}
+
+static void stripe_link(struct session *restrict mux, struct session *m)
+{
+	if (mux->stream.stripe == NULL) {
+		mux->stream.stripe = mux;
+	}
+	m->stream.stripe = mux->stream.stripe;
+	mux->stream.stripe = m;
+}
+
+/* bytes a stream may buffer, as much as the kcp sessions carrying it */
+static size_t stream_window(const struct session *restrict mux)
+{
+	const struct config *restrict conf = mux->server->conf;
+	const size_t window =
+		MAX((size_t)STREAM_INITIAL_WINDOW,
+		    (size_t)conf->kcp_rcvwnd * (size_t)conf->kcp_mtu);
+	return window * stripe_count(mux);
+}
+
+/* tell the peer about the rest of the window, a striped stream is
+ * confirmed this way before it is spread over the carriers */
+static bool stream_sendinitwnd(struct session *restrict ss)
+{
+	const size_t window = ss->stream.window;
+	if (window <= STREAM_INITIAL_WINDOW && !ss->stream.is_striped) {
+		return true;
+	}
+	return stream_sendwnd(
+		ss->stream.mux, ss->conv,
+		(uint32_t)(window - MIN(window, STREAM_INITIAL_WINDOW)));
+}
+
+static void stream_drop_early(struct session *restrict ss)
+{
+	struct stripe_chunk *c = ss->stream.early;
+	while (c != NULL) {
+		struct stripe_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	ss->stream.early = NULL;
+}
+
+static void stream_unlink(struct session *restrict ss)
+{
+	if (ss->stream.mux == NULL) {
+		return;
+	}
+	struct session *restrict prev = ss->stream.prev;
+	struct session *restrict next = ss->stream.next;
+	prev->stream.next = next;
+	if (next != NULL) {
+		next->stream.prev = prev;
+	}
+	ss->stream.mux = ss->stream.prev = ss->stream.next = NULL;
+}
+
+/* the streams cannot outlive the carrier, and the striped ones are broken
+ * by the loss of any carrier of the group */
+static void mux_stop(struct session *restrict mux)
+{
+	struct server *restrict s = mux->server;
+	if (s->mux == mux) {
+		s->mux = NULL;
+	}
+	struct session *restrict m = mux->stream.stripe;
+	mux->stream.stripe = NULL;
+	while (m != NULL && m != mux) {
+		struct session *restrict next = m->stream.stripe;
+		m->stream.stripe = NULL;
+		session_kcp_close(m);
+		m = next;
+	}
+	struct session *restrict ss = mux->stream.next;
+	while (ss != NULL) {
+		struct session *restrict next = ss->stream.next;
+		session_tcp_stop(ss);
+		session_kcp_stop(ss);
+		ss = next;
+	}
+	assert(mux->stream.next == NULL);
+}
+
+static struct session *
+stream_find(struct session *restrict mux, const uint32_t id)
+{
+	unsigned char sskey[SESSION_KEY_SIZE];
+	SESSION_MAKEKEY(sskey, &mux->raddr.sa, id);
+	const struct hashkey hkey = {
+		.len = sizeof(sskey),
+		.data = sskey,
+	};
+	struct session *ss;
+	if (!table_find(mux->server->sessions, hkey, (void **)&ss)) {
+		return NULL;
+	}
+	if (!ss->is_stream || ss->stream.mux == NULL ||
+	    !stripe_member(mux, ss->stream.mux)) {
+		return NULL;
+	}
+	return ss;
 }
 
 static bool forward_dial(struct session *restrict ss, const struct sockaddr *sa)
@@ -116,8 +357,351 @@ static bool forward_dial(struct session *restrict ss, const struct sockaddr *sa)
 	return true;
 }
 
+static void stream_accept(struct session *restrict mux, const uint32_t id)
+{
+	struct server *restrict s = mux->server;
+	unsigned char sskey[SESSION_KEY_SIZE];
+	SESSION_MAKEKEY(sskey, &mux->raddr.sa, id);
+	const struct hashkey hkey = {
+		.len = sizeof(sskey),
+		.data = sskey,
+	};
+	struct session *restrict ss;
+	if (table_find(s->sessions, hkey, (void **)&ss)) {
+		if (!ss->is_stream || ss->kcp_state != STATE_TIME_WAIT) {
+			LOGW_F("session [%08" PRIX32 "] stream: "
+			       "id [%08" PRIX32 "] is in use",
+			       mux->conv, id);
+			return;
+		}
+		/* the peer has reused the id of a closed stream */
+		s->sessions = table_del(s->sessions, hkey, NULL);
+		session_free(ss);
+	}
+	ss = stream_new(s, mux, id);
+	if (ss == NULL) {
+		LOGOOM();
+		(void)stream_sendmsg(mux, id, SMSG_STREAM_EOF);
+		return;
+	}
+	void *elem = ss;
+	s->sessions = table_set(s->sessions, SESSION_GETKEY(ss), &elem);
+	assert(elem == NULL);
+	LOGD_F("session [%08" PRIX32 "] stream: accepted on [%08" PRIX32 "]",
+	       id, mux->conv);
+	if (!forward_dial(ss, &s->connect.sa) || !stream_sendinitwnd(ss)) {
+		session_tcp_stop(ss);
+		session_kcp_close(ss);
+	}
+}
+
+/* find or accept the carriers listed by the peer, the first one is mux */
+static bool stripe_join(
+	struct session *restrict mux, const unsigned char *b, const size_t n)
+{
+	struct server *restrict s = mux->server;
+	struct session *members[STRIPE_MAX];
+	if (read_uint32(b) != mux->conv) {
+		return false;
+	}
+	for (size_t i = 1; i < n; i++) {
+		const uint32_t conv = read_uint32(b + i * sizeof(uint32_t));
+		struct session *restrict m = NULL;
+		for (size_t j = 0; j < i; j++) {
+			if (read_uint32(b + j * sizeof(uint32_t)) == conv) {
+				return false;
+			}
+		}
+		unsigned char sskey[SESSION_KEY_SIZE];
+		SESSION_MAKEKEY(sskey, &mux->raddr.sa, conv);
+		const struct hashkey hkey = {
+			.len = sizeof(sskey),
+			.data = sskey,
+		};
+		if (table_find(s->sessions, hkey, (void **)&m)) {
+			if (m->is_stream ||
+			    (!m->is_mux && m->tcp_state != STATE_INIT)) {
+				return false;
+			}
+			if (m->kcp_state != STATE_CONNECT &&
+			    m->kcp_state != STATE_CONNECTED) {
+				return false;
+			}
+			/* in the known group, or in none yet */
+			if (mux->stream.stripe != NULL ?
+				    !stripe_member(mux, m) :
+				    m->stream.stripe != NULL) {
+				return false;
+			}
+		} else if (mux->stream.stripe != NULL) {
+			return false;
+		}
+		members[i] = m;
+	}
+	if (mux->stream.stripe != NULL) {
+		/* the group is known */
+		return stripe_count(mux) == n;
+	}
+	for (size_t i = 1; i < n; i++) {
+		struct session *restrict m = members[i];
+		if (m == NULL) {
+			/* the peer may not have sent anything on it yet */
+			const uint32_t conv =
+				read_uint32(b + i * sizeof(uint32_t));
+			m = session_new(s, &mux->raddr, conv);
+			if (m == NULL) {
+				LOGOOM();
+				return false;
+			}
+			m->is_accepted = mux->is_accepted;
+			m->kcp_state = STATE_CONNECTED;
+			void *elem = m;
+			s->sessions = table_set(
+				s->sessions, SESSION_GETKEY(m), &elem);
+			assert(elem == NULL);
+		}
+		m->is_mux = true;
+		stripe_link(mux, m);
+		LOGD_F("session [%08" PRIX32 "] kcp: striping with [%08" PRIX32
+		       "]",
+		       m->conv, mux->conv);
+	}
+	return true;
+}
+
+/* append to the tcp buffer, the stream is closed on error */
+static bool stream_deliver(
+	struct session *restrict ss, const unsigned char *data, const size_t n)
+{
+	const size_t len = ss->wbuf->len;
+	ss->wbuf = VBUF_APPEND(ss->wbuf, data, n);
+	if (ss->wbuf->len != len + n) {
+		LOGOOM();
+		session_tcp_stop(ss);
+		session_kcp_close(ss);
+		return false;
+	}
+	ss->wbuf_next = ss->wbuf->len;
+	ss->stream.rcv_off += (uint32_t)n;
+	return true;
+}
+
+static void stream_on_push(
+	struct session *restrict ss, const unsigned char *data, const size_t n)
+{
+	if (ss->kcp_state != STATE_CONNECTED) {
+		return;
+	}
+	if (ss->wbuf->len + n > ss->stream.window) {
+		LOGE_F("session [%08" PRIX32 "] stream: window exceeded",
+		       ss->conv);
+		session_tcp_stop(ss);
+		session_kcp_close(ss);
+		return;
+	}
+	if (!stream_deliver(ss, data, n)) {
+		return;
+	}
+	ss->last_recv = ev_now(ss->server->loop);
+	tcp_flush(ss);
+	session_read_cb(ss);
+}
+
+/* keep a chunk until the earlier ones have arrived on other carriers */
+static bool stream_hold(
+	struct session *restrict ss, const uint32_t off,
+	const unsigned char *data, const size_t n)
+{
+	struct stripe_chunk **p = &ss->stream.early;
+	while (*p != NULL && (int32_t)((*p)->off - off) < 0) {
+		p = &(*p)->next;
+	}
+	if (*p != NULL && (*p)->off == off) {
+		LOGE_F("session [%08" PRIX32 "] stream: duplicated chunk",
+		       ss->conv);
+		return false;
+	}
+	struct stripe_chunk *restrict c =
+		malloc(sizeof(struct stripe_chunk) + n);
+	if (c == NULL) {
+		LOGOOM();
+		return false;
+	}
+	c->next = *p;
+	c->off = off;
+	c->len = n;
+	memcpy(c->data, data, n);
+	*p = c;
+	return true;
+}
+
+static void stream_on_eof(struct session *restrict ss)
+{
+	LOGI_F("session [%08" PRIX32 "] stream: "
+	       "connection closed by peer",
+	       ss->conv);
+	ss->last_recv = ev_now(ss->server->loop);
+	if (ss->tcp_state == STATE_TIME_WAIT) {
+		session_kcp_stop(ss);
+		return;
+	}
+	ss->kcp_state = STATE_LINGER;
+	ss->tcp_state = STATE_LINGER;
+	tcp_notify(ss);
+}
+
+static void stream_on_chunk(
+	struct session *restrict ss, const uint32_t off,
+	const unsigned char *data, const size_t n)
+{
+	if (ss->kcp_state != STATE_CONNECTED) {
+		return;
+	}
+	const size_t ahead = (size_t)(uint32_t)(off - ss->stream.rcv_off);
+	if (ahead > ss->stream.window ||
+	    ss->wbuf->len + ahead + n > ss->stream.window) {
+		LOGE_F("session [%08" PRIX32 "] stream: window exceeded",
+		       ss->conv);
+		session_tcp_stop(ss);
+		session_kcp_close(ss);
+		return;
+	}
+	ss->last_recv = ev_now(ss->server->loop);
+	if (ahead > 0) {
+		if (!stream_hold(ss, off, data, n)) {
+			session_tcp_stop(ss);
+			session_kcp_close(ss);
+		}
+		return;
+	}
+	if (!stream_deliver(ss, data, n)) {
+		return;
+	}
+	struct stripe_chunk *c;
+	while ((c = ss->stream.early) != NULL &&
+	       c->off == ss->stream.rcv_off) {
+		ss->stream.early = c->next;
+		const bool ok = stream_deliver(ss, c->data, c->len);
+		free(c);
+		if (!ok) {
+			return;
+		}
+	}
+	tcp_flush(ss);
+	if (ss->stream.has_eof && ss->stream.eof_off == ss->stream.rcv_off &&
+	    ss->kcp_state == STATE_CONNECTED) {
+		stream_on_eof(ss);
+		return;
+	}
+	session_read_cb(ss);
+}
+
+/* stream messages are handled by the carrier, which never waits for tcp */
+static bool stream_on_msg(
+	struct session *restrict mux, const struct tlv_header *restrict hdr,
+	const unsigned char *msgbuf)
+{
+	const uint32_t id = read_uint32(msgbuf + TLV_HEADER_SIZE);
+	if (hdr->msg == SMSG_STREAM_DIAL) {
+		/* a striped stream lists the carriers of its group */
+		const size_t n = ((size_t)hdr->len - STREAM_HEADER_SIZE) /
+				 sizeof(uint32_t);
+		if (hdr->len != STREAM_HEADER_SIZE + n * sizeof(uint32_t) ||
+		    n > STRIPE_MAX) {
+			return false;
+		}
+		if (!mux->is_mux) {
+			if (mux->tcp_state != STATE_INIT) {
+				return false;
+			}
+			mux->is_mux = true;
+		}
+		if (n > 0 &&
+		    !stripe_join(mux, msgbuf + STREAM_HEADER_SIZE, n)) {
+			LOGW_F("session [%08" PRIX32 "] stream: "
+			       "unexpected stripe group",
+			       mux->conv);
+			return stream_sendmsg(mux, id, SMSG_STREAM_EOF);
+		}
+		stream_accept(mux, id);
+		return true;
+	}
+	if (!mux->is_mux) {
+		return false;
+	}
+	struct session *restrict ss = stream_find(mux, id);
+	switch (hdr->msg) {
+	case SMSG_STREAM_PUSH: {
+		const size_t n = (size_t)hdr->len - STREAM_HEADER_SIZE;
+		LOGV_F("session [%08" PRIX32 "] msg: push, %zu bytes", id, n);
+		if (ss != NULL) {
+			stream_on_push(ss, msgbuf + STREAM_HEADER_SIZE, n);
+		}
+		return true;
+	}
+	case SMSG_STREAM_CHUNK: {
+		if (hdr->len < CHUNK_HEADER_SIZE) {
+			return false;
+		}
+		const uint32_t off = read_uint32(msgbuf + STREAM_HEADER_SIZE);
+		const size_t n = (size_t)hdr->len - CHUNK_HEADER_SIZE;
+		LOGV_F("session [%08" PRIX32 "] msg: chunk, "
+		       "%zu bytes at %" PRIu32,
+		       id, n, off);
+		if (ss != NULL) {
+			stream_on_chunk(ss, off, msgbuf + CHUNK_HEADER_SIZE, n);
+		}
+		return true;
+	}
+	case SMSG_STREAM_EOF: {
+		/* followed by the final offset for a striped stream */
+		if (hdr->len != STREAM_HEADER_SIZE &&
+		    hdr->len != STREAM_HEADER_SIZE + sizeof(uint32_t)) {
+			return false;
+		}
+		if (ss == NULL || ss->kcp_state != STATE_CONNECTED) {
+			return true;
+		}
+		if (hdr->len > STREAM_HEADER_SIZE) {
+			const uint32_t off =
+				read_uint32(msgbuf + STREAM_HEADER_SIZE);
+			if (off != ss->stream.rcv_off) {
+				/* the last chunks are still on the way */
+				ss->stream.eof_off = off;
+				ss->stream.has_eof = true;
+				return true;
+			}
+		}
+		stream_on_eof(ss);
+		return true;
+	}
+	case SMSG_STREAM_WINDOW: {
+		if (hdr->len != STREAM_HEADER_SIZE + sizeof(uint32_t)) {
+			return false;
+		}
+		const uint32_t n = read_uint32(msgbuf + STREAM_HEADER_SIZE);
+		LOGV_F("session [%08" PRIX32 "] msg: window, %" PRIu32
+		       " bytes",
+		       id, n);
+		if (ss == NULL || ss->kcp_state != STATE_CONNECTED) {
+			return true;
+		}
+		ss->stream.credit += n;
+		ss->stream.is_acked = true;
+		tcp_notify(ss);
+		return true;
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+/* msgbuf: the whole message, NULL for SMSG_PUSH whose payload is sent to
+ * tcp from the kcp segments */
 static bool session_on_msg(
-	struct session *restrict ss, const struct tlv_header *restrict hdr)
+	struct session *restrict ss, const struct tlv_header *restrict hdr,
+	const unsigned char *msgbuf)
 {
 	switch (hdr->msg) {
 	case SMSG_DIAL: {
@@ -125,7 +709,7 @@ static bool session_on_msg(
 			break;
 		}
 		LOGD_F("session [%08" PRIX32 "] msg: dial", ss->conv);
-		if (ss->tcp_state != STATE_INIT) {
+		if (ss->tcp_state != STATE_INIT || ss->is_mux) {
 			break;
 		}
 		if (!forward_dial(ss, &ss->server->connect.sa)) {
@@ -134,10 +718,12 @@ static bool session_on_msg(
 		return true;
 	}
 	case SMSG_PUSH: {
+		if (ss->is_mux) {
+			break;
+		}
 		const size_t navail = (size_t)hdr->len - TLV_HEADER_SIZE;
 		LOGV_F("session [%08" PRIX32 "] msg: push, %zu bytes", ss->conv,
 		       navail);
-		ss->wbuf_flush = TLV_HEADER_SIZE;
 		return true;
 	}
 	case SMSG_EOF: {
@@ -149,7 +735,9 @@ static bool session_on_msg(
 		       ss->conv);
 		ss->kcp_state = STATE_LINGER;
 		ss->tcp_state = STATE_LINGER;
-		ss->wbuf_flush = ss->wbuf_next;
+		if (ss->is_mux) {
+			mux_stop(ss);
+		}
 		return true;
 	}
 	case SMSG_KEEPALIVE: {
@@ -164,6 +752,18 @@ static bool session_on_msg(
 		}
 		return true;
 	}
+	case SMSG_STREAM_DIAL:
+	case SMSG_STREAM_PUSH:
+	case SMSG_STREAM_EOF:
+	case SMSG_STREAM_WINDOW:
+	case SMSG_STREAM_CHUNK:
+		if (hdr->len < STREAM_HEADER_SIZE) {
+			break;
+		}
+		if (!stream_on_msg(ss, hdr, msgbuf)) {
+			break;
+		}
+		return true;
 	}
 	LOGE_F("session [%08" PRIX32 "] msg: error "
 	       "msg=%04" PRIX16 ", len=%04" PRIX16,
@@ -171,43 +771,136 @@ static bool session_on_msg(
 	return false;
 }
 
-/* returns: OK=0, wait=1, error=-1 */
-static int ss_process(struct session *restrict ss)
+/* the payload at wbuf_next, in pieces only if the receive window is too
+ * small to hold it in whole */
+static int ss_parse_push(
+	struct session *restrict ss, const struct ss_input *restrict in)
 {
-	if (ss->wbuf_flush < ss->wbuf_next) {
-		/* tcp flushing is in progress */
+	const struct IKCPCB *restrict kcp = ss->kcp;
+	const size_t off = ss->wbuf_next;
+	const size_t n = MIN(ss->wbuf_left, in->len - off);
+	if (n == 0) {
 		return 1;
 	}
-	if (ss->wbuf_flush > 0) {
-		/* tcp flushing is done */
-		consume_wbuf(ss, ss->wbuf_flush);
-	}
-	kcp_recv(ss);
-	if (ss->wbuf->len < TLV_HEADER_SIZE) {
-		/* no header available */
+	if (n < ss->wbuf_left && kcp->nrcv_que < kcp->rcv_wnd &&
+	    in->niov < (int)ARRAY_SIZE(in->iov)) {
+		/* the rest is on the way */
 		return 1;
 	}
-	const struct tlv_header hdr = tlv_header_read(ss->wbuf->data);
-	if (hdr.len < TLV_HEADER_SIZE && hdr.len > TLV_MAX_LENGTH) {
+	assert(ss->wbuf_npush < WBUF_MAX_PUSH);
+	ss->wbuf_push[ss->wbuf_npush++] = (struct wbuf_span){
+		.off = (uint32_t)off,
+		.len = (uint32_t)n,
+	};
+	ss->wbuf_next = off + n;
+	ss->wbuf_left -= n;
+	return 0;
+}
+
+/* handles the message at wbuf_next, returns: OK=0, incomplete=1, error=-1 */
+static int ss_parse(struct session *restrict ss, struct ss_input *restrict in)
+{
+	if (ss->wbuf_left > 0) {
+		return ss_parse_push(ss, in);
+	}
+	struct vbuffer *restrict wbuf = ss->wbuf;
+	const size_t off = ss->wbuf_next;
+	const size_t staged = wbuf->len;
+	unsigned char b[TLV_HEADER_SIZE];
+	const unsigned char *h = wbuf->data;
+	if (staged == 0) {
+		if (in->len < off + TLV_HEADER_SIZE) {
+			/* no header available */
+			return 1;
+		}
+		h = input_peek(in, off, b, sizeof(b));
+	}
+	const struct tlv_header hdr = tlv_header_read(h);
+	if (hdr.len < TLV_HEADER_SIZE || hdr.len > SESSION_BUF_SIZE) {
 		LOGE_F("unexpected message length: %" PRIu16, hdr.len);
 		return -1;
 	}
-	if (ss->wbuf->len < hdr.len) {
-		/* incomplete message */
-		return 1;
+	if (hdr.msg == SMSG_PUSH) {
+		/* never staged, the payload goes to tcp piece by piece */
+		assert(staged == 0);
+		if (!session_on_msg(ss, &hdr, NULL)) {
+			return -1;
+		}
+		ss->wbuf_next = off + TLV_HEADER_SIZE;
+		ss->wbuf_left = (size_t)hdr.len - TLV_HEADER_SIZE;
+		return 0;
 	}
-	ss->wbuf_next = hdr.len;
-	if (!session_on_msg(ss, &hdr)) {
+	/* the other messages are handled as a whole */
+	const size_t n = (size_t)hdr.len - staged;
+	if (in->len - off < n) {
+		if (off > 0 || in->len == 0) {
+			/* incomplete message */
+			return 1;
+		}
+		/* the receive window may be too small to hold it, set the
+		 * beginning aside to make room */
+		assert(staged + in->len <= wbuf->cap);
+		input_copy(in, 0, wbuf->data + staged, in->len);
+		wbuf->len += in->len;
+		kcp_consume(ss, in->len);
+		ss_input(ss, in);
+		return 0;
+	}
+	const unsigned char *msgbuf;
+	if (staged > 0) {
+		input_copy(in, off, wbuf->data + staged, n);
+		msgbuf = wbuf->data;
+	} else {
+		/* only a message split over segments is copied */
+		static _Thread_local unsigned char msg[SESSION_BUF_SIZE];
+		msgbuf = input_peek(in, off, msg, hdr.len);
+	}
+	ss->wbuf_next = off + n;
+	if (!session_on_msg(ss, &hdr, msgbuf)) {
 		/* malformed message */
 		return -1;
 	}
-	if (ss->wbuf_flush > 0) {
-		tcp_flush(ss);
-	} else {
+	wbuf->len = 0;
+	return 0;
+}
+
+/* returns: OK=0, wait=1, error=-1 */
+static int ss_process(struct session *restrict ss)
+{
+	if (ss->wbuf_flush < ss->wbuf_next) {
+		/* tcp flushing is in progress */
+		return 1;
+	}
+	if (ss->wbuf_next > 0) {
+		/* tcp flushing is done */
+		kcp_consume(ss, ss->wbuf_next);
+		ss->wbuf_flush = ss->wbuf_next = 0;
+		ss->wbuf_ipush = ss->wbuf_npush = 0;
+	}
+	struct ss_input in;
+	ss_input(ss, &in);
+	/* parse all messages received, so their payloads are written to tcp
+	 * together */
+	int ret = 1;
+	while (ss->kcp_state == STATE_CONNECTED &&
+	       ss->wbuf_npush < WBUF_MAX_PUSH) {
+		const int r = ss_parse(ss, &in);
+		if (r < 0) {
+			return -1;
+		}
+		if (r > 0) {
+			break;
+		}
+		ret = 0;
+	}
+	if (ss->wbuf_npush == 0) {
 		/* nothing to flush */
-		consume_wbuf(ss, ss->wbuf_next);
+		ss->wbuf_flush = ss->wbuf_next;
+		return ret;
 	}
-	return 0;
+	ss->wbuf_flush = ss->wbuf_push[0].off;
+	tcp_flush(ss);
+	return ret;
 }
 
 bool session_kcp_send(struct session *restrict ss)
@@ -219,7 +912,7 @@ bool session_kcp_send(struct session *restrict ss)
 	default:
 		return false;
 	}
-	if (ss->rbuf->len == 0) {
+	if (!ss->is_stream || ss->rbuf->len == 0) {
 		return true;
 	}
 	if (!kcp_push(ss)) {
@@ -231,8 +924,30 @@ bool session_kcp_send(struct session *restrict ss)
 	return true;
 }
 
+/* the data is queued in the carrier, so streams do not linger */
+static void stream_close(struct session *restrict ss)
+{
+	struct session *restrict mux = ss->stream.mux;
+	if (ss->kcp_state == STATE_CONNECTED && mux != NULL) {
+		LOGD_F("session [%08" PRIX32 "] stream: close", ss->conv);
+		const uint32_t id = ss->conv;
+		const bool ok =
+			ss->stream.is_striped ?
+				stream_sendeof(mux, id, ss->stream.snd_off) :
+				stream_sendmsg(mux, id, SMSG_STREAM_EOF);
+		if (ok && mux->kcp_flush >= 1) {
+			session_kcp_flush(ss);
+		}
+	}
+	session_kcp_stop(ss);
+}
+
 void session_kcp_close(struct session *restrict ss)
 {
+	if (ss->is_stream) {
+		stream_close(ss);
+		return;
+	}
 	switch (ss->kcp_state) {
 	case STATE_CONNECT:
 	case STATE_CONNECTED:
@@ -240,6 +955,9 @@ void session_kcp_close(struct session *restrict ss)
 	default:
 		return;
 	}
+	if (ss->is_mux) {
+		mux_stop(ss);
+	}
 	/* pass eof */
 	if (!kcp_sendmsg(ss, SMSG_EOF)) {
 		session_kcp_stop(ss);
@@ -252,11 +970,46 @@ void session_kcp_close(struct session *restrict ss)
 	}
 }
 
+void session_kcp_setmss(struct session *restrict ss, const size_t mss)
+{
+	const int mtu = kcp_mtu(ss->server->conf, mss);
+	if ((int)ss->kcp->mtu == mtu) {
+		return;
+	}
+	LOGD_F("session [%08" PRIX32 "] kcp: mtu %" PRIu32 " -> %d", ss->conv,
+	       ss->kcp->mtu, mtu);
+	if (ikcp_setmtu(ss->kcp, mtu) <= 0) {
+		return;
+	}
+	/* the segments in flight may never pass, do not wait for them */
+	LOGW_F("session [%08" PRIX32 "] kcp: reset, "
+	       "data in flight exceeds mtu %d",
+	       ss->conv, mtu);
+	ss0_reset(ss->server, &ss->raddr.sa, ss->conv);
+	ss->last_reset = ev_now(ss->server->loop);
+	session_tcp_stop(ss);
+	session_kcp_stop(ss);
+}
+
 /* kcp flush is only invoked when idle.
  *   i.e. if the server is perfectly 100% loaded, flush will never work
  */
 void session_kcp_flush(struct session *restrict ss)
 {
+	if (ss->is_stream) {
+		struct session *restrict mux = ss->stream.mux;
+		if (mux == NULL) {
+			return;
+		}
+		if (ss->stream.is_striped) {
+			/* the chunks may be on any carrier of the group */
+			for (struct session *m = mux->stream.stripe;
+			     m != NULL && m != mux; m = m->stream.stripe) {
+				session_kcp_flush(m);
+			}
+		}
+		ss = mux;
+	}
 	struct ev_idle *restrict w_flush = &ss->w_flush;
 	if (ev_is_active(w_flush)) {
 		return;
@@ -280,11 +1033,24 @@ void session_tcp_stop(struct session *restrict ss)
 
 void session_kcp_stop(struct session *restrict ss)
 {
+	if (ss->is_stream) {
+		stream_unlink(ss);
+		stream_drop_early(ss);
+	} else if (ss->is_mux) {
+		mux_stop(ss);
+	}
 	ss->kcp_state = STATE_TIME_WAIT;
+	ev_timer_stop(ss->server->loop, &ss->w_update);
 	if (ss->kcp != NULL) {
+		if (ss->server->conf->kcp_autotune) {
+			ss->server->wnd_total -=
+				ss->kcp->snd_wnd + ss->kcp->rcv_wnd;
+		}
 		ikcp_release(ss->kcp);
 		ss->kcp = NULL;
 	}
+	fec_free(ss->fec, ss->server->pkt.queue);
+	ss->fec = NULL;
 	ss->rbuf = VBUF_FREE(ss->rbuf);
 	ss->wbuf = VBUF_FREE(ss->wbuf);
 }
@@ -308,8 +1074,46 @@ void session_free(struct session *restrict ss)
 	free(ss);
 }
 
+/* return the credit for the data sent to tcp */
+static void stream_read_cb(struct session *restrict ss)
+{
+	if (ss->wbuf == NULL) {
+		/* closed */
+		return;
+	}
+	if (ss->wbuf_flush > 0) {
+		ss->stream.consumed += ss->wbuf_flush;
+		VBUF_CONSUME(ss->wbuf, ss->wbuf_flush);
+		ss->wbuf_next -= ss->wbuf_flush;
+		ss->wbuf_flush = 0;
+		if (ss->wbuf->len == 0 && ss->wbuf->cap > SESSION_BUF_SIZE) {
+			/* give back the memory of a burst */
+			ss->wbuf = VBUF_RESIZE(ss->wbuf, SESSION_BUF_SIZE);
+		}
+	}
+	struct session *restrict mux = ss->stream.mux;
+	const size_t window = ss->stream.window;
+	if (ss->kcp_state == STATE_CONNECTED && mux != NULL &&
+	    ss->stream.consumed >= window / 4) {
+		if (!stream_sendwnd(mux, ss->conv, (uint32_t)ss->stream.consumed)) {
+			session_tcp_stop(ss);
+			session_kcp_close(ss);
+			return;
+		}
+		ss->stream.consumed = 0;
+		if (mux->kcp_flush >= 1) {
+			session_kcp_flush(mux);
+		}
+	}
+	tcp_notify(ss);
+}
+
 void session_read_cb(struct session *restrict ss)
 {
+	if (ss->is_stream) {
+		stream_read_cb(ss);
+		return;
+	}
 	int ret = 0;
 	while (ss->kcp_state == STATE_CONNECTED && ret == 0) {
 		ret = ss_process(ss);
@@ -336,11 +1140,12 @@ ss_flush_cb(struct ev_loop *loop, struct ev_idle *watcher, int revents)
 	default:
 		return;
 	}
+	kcp_notify_update(ss);
 	ikcp_flush(ss->kcp);
 	tcp_notify(ss);
 }
 
-struct session *session_new(
+static struct session *session_alloc(
 	struct server *restrict s, const union sockaddr_max *addr,
 	const uint32_t conv)
 {
@@ -365,25 +1170,168 @@ struct session *session_new(
 	ss->w_socket.data = ss;
 	ev_idle_init(&ss->w_flush, ss_flush_cb);
 	ss->w_flush.data = ss;
+	ev_timer_init(&ss->w_update, kcp_update_cb, 0.0, 0.0);
+	ss->w_update.data = ss;
 	/* individually allocated buffers can be freed early */
-	ss->rbuf = VBUF_NEW(SESSION_BUF_SIZE);
-	if (ss->rbuf == NULL) {
-		session_free(ss);
-		return NULL;
-	}
 	ss->wbuf = VBUF_NEW(SESSION_BUF_SIZE);
 	if (ss->wbuf == NULL) {
 		session_free(ss);
 		return NULL;
 	}
+	return ss;
+}
+
+struct session *session_new(
+	struct server *restrict s, const union sockaddr_max *addr,
+	const uint32_t conv)
+{
+	struct session *restrict ss = session_alloc(s, addr, conv);
+	if (ss == NULL) {
+		return NULL;
+	}
 	ss->kcp = kcp_new(ss, s->conf, conv);
 	if (ss->kcp == NULL) {
 		session_free(ss);
 		return NULL;
 	}
+	if (s->conf->kcp_parityshard > 0) {
+		ss->fec = fec_new(
+			s->conf->kcp_datashard, s->conf->kcp_parityshard,
+			s->pkt.queue->msg_size);
+		if (ss->fec == NULL) {
+			session_free(ss);
+			return NULL;
+		}
+	}
 	return ss;
 }
 
+static struct session *
+mux_new(struct server *restrict s, const union sockaddr_max *addr)
+{
+	const uint32_t conv = conv_new(s, &addr->sa);
+	struct session *restrict mux = session_new(s, addr, conv);
+	if (mux == NULL) {
+		return NULL;
+	}
+	mux->is_mux = true;
+	mux->kcp_state = STATE_CONNECT;
+	void *elem = mux;
+	s->sessions = table_set(s->sessions, SESSION_GETKEY(mux), &elem);
+	assert(elem == NULL);
+	return mux;
+}
+
+struct session *session_mux(struct server *restrict s)
+{
+	const union sockaddr_max *addr = &s->pkt.kcp_connect;
+	struct session *restrict mux = s->mux;
+	if (mux != NULL && mux->kcp->state == 0 &&
+	    sa_equals(&mux->raddr.sa, &addr->sa)) {
+		if (mux->stream.stripe != NULL) {
+			/* take turns to carry the stream messages */
+			s->mux = mux->stream.stripe;
+		}
+		return mux;
+	}
+	/* the peer has moved or stopped acking, the existing streams stay
+	 * on the old carrier */
+	mux = mux_new(s, addr);
+	if (mux == NULL) {
+		return NULL;
+	}
+	for (int i = 1; i < s->conf->kcp_stripe; i++) {
+		struct session *restrict m = mux_new(s, addr);
+		if (m == NULL) {
+			/* a smaller group still works */
+			break;
+		}
+		/* get connected before the first chunk */
+		(void)kcp_sendmsg(m, SMSG_KEEPALIVE);
+		stripe_link(mux, m);
+	}
+	LOGD_F("session [%08" PRIX32 "] kcp: carrying streams, %zu carriers",
+	       mux->conv, stripe_count(mux));
+	s->mux = mux;
+	return mux;
+}
+
+struct session *stream_new(
+	struct server *restrict s, struct session *restrict mux,
+	const uint32_t id)
+{
+	struct session *restrict ss = session_alloc(s, &mux->raddr, id);
+	if (ss == NULL) {
+		return NULL;
+	}
+	/* plain sessions read tcp into the kcp segments */
+	ss->rbuf = VBUF_NEW(SESSION_BUF_SIZE);
+	if (ss->rbuf == NULL) {
+		session_free(ss);
+		return NULL;
+	}
+	ss->is_stream = true;
+	ss->is_accepted = mux->is_accepted;
+	ss->kcp_state = STATE_CONNECTED;
+	ss->stream.credit = STREAM_INITIAL_WINDOW;
+	ss->stream.window = stream_window(mux);
+	ss->stream.is_striped = (mux->stream.stripe != NULL);
+	/* the peer has dialed it */
+	ss->stream.is_acked = mux->is_accepted;
+	ss->stream.mux = mux;
+	ss->stream.prev = mux;
+	ss->stream.next = mux->stream.next;
+	if (ss->stream.next != NULL) {
+		ss->stream.next->stream.prev = ss;
+	}
+	mux->stream.next = ss;
+	return ss;
+}
+
+bool stream_dial(struct session *restrict ss)
+{
+	struct session *restrict mux = ss->stream.mux;
+	uint32_t convs[STRIPE_MAX];
+	size_t n = 0;
+	if (ss->stream.is_striped) {
+		const struct session *m = mux;
+		do {
+			assert(n < STRIPE_MAX);
+			convs[n++] = m->conv;
+			m = m->stream.stripe;
+		} while (m != mux);
+	}
+	return stream_senddial(mux, ss->conv, convs, n) &&
+	       stream_sendinitwnd(ss);
+}
+
+struct session *stream_carrier(struct session *restrict ss)
+{
+	struct session *restrict mux = ss->stream.mux;
+	if (mux == NULL) {
+		return NULL;
+	}
+	if (!ss->stream.is_striped || !ss->stream.is_acked) {
+		/* keep the order until the peer knows the stream */
+		return kcp_cansend(mux) ? mux : NULL;
+	}
+	/* the least queued one, which avoids a carrier in loss recovery */
+	struct session *restrict best = NULL;
+	int best_wait = INT_MAX;
+	struct session *m = mux;
+	do {
+		if (kcp_cansend(m)) {
+			const int wait = ikcp_waitsnd(m->kcp);
+			if (wait < best_wait) {
+				best = m;
+				best_wait = wait;
+			}
+		}
+		m = m->stream.stripe;
+	} while (m != NULL && m != mux);
+	return best;
+}
+
 struct session0_header {
 	uint32_t zero;
 	uint16_t what;
@@ -487,17 +1435,33 @@ void ss0_reset(struct server *s, const struct sockaddr *sa, const uint32_t conv)
 	ss0_send(s, sa, S0MSG_RESET, b, sizeof(b));
 }
 
-bool ss0_send(
+/* the message is followed by pad zero bytes */
+static bool ss0_sendpad(
 	struct server *restrict s, const struct sockaddr *sa,
-	const uint16_t what, const unsigned char *b, const size_t n)
+	const uint16_t what, const unsigned char *b, const size_t n,
+	const size_t pad)
 {
-	struct msgframe *restrict msg = msgframe_new(s->pkt.queue);
+	const size_t hdrsize = s->conf->kcp_parityshard > 0 ? FEC_HEADER_SIZE
+							    : 0;
+	struct msgframe *restrict msg = msgframe_alloc(
+		s->pkt.queue, hdrsize + SESSION0_HEADER_SIZE + n + pad);
 	if (msg == NULL) {
 		LOGOOM();
 		return false;
 	}
 	copy_sa(&msg->addr.sa, sa);
 	unsigned char *packet = msg->buf + msg->off;
+	size_t hdrlen = 0;
+	if (s->conf->kcp_parityshard > 0) {
+		/* not protected, but still tagged as a shard */
+		fec_header_write(
+			packet, (struct fec_header){
+					.seq = 0,
+					.flag = FEC_FLAG_NONE,
+				});
+		hdrlen = FEC_HEADER_SIZE;
+		packet += hdrlen;
+	}
 	ss0_header_write(
 		packet, (struct session0_header){
 				.zero = 0,
@@ -506,10 +1470,37 @@ bool ss0_send(
 	if (n > 0) {
 		memcpy(packet + SESSION0_HEADER_SIZE, b, n);
 	}
-	msg->len = SESSION0_HEADER_SIZE + n;
+	if (pad > 0) {
+		memset(packet + SESSION0_HEADER_SIZE + n, 0, pad);
+	}
+	msg->len = hdrlen + SESSION0_HEADER_SIZE + n + pad;
+	/* only path mtu probes are padded */
+	msg->probe = pad > 0;
 	return queue_send(s, msg);
 }
 
+bool ss0_send(
+	struct server *restrict s, const struct sockaddr *sa,
+	const uint16_t what, const unsigned char *b, const size_t n)
+{
+	return ss0_sendpad(s, sa, what, b, n, 0);
+}
+
+bool ss0_probe(
+	struct server *restrict s, const struct sockaddr *sa,
+	const uint32_t seq, const size_t mss, const size_t size)
+{
+	unsigned char b[sizeof(uint32_t) + sizeof(uint16_t)];
+	write_uint32(b, seq);
+	write_uint16(b + sizeof(uint32_t), (uint16_t)mss);
+	size_t hdrlen = SESSION0_HEADER_SIZE + sizeof(b);
+	if (s->conf->kcp_parityshard > 0) {
+		hdrlen += FEC_HEADER_SIZE;
+	}
+	assert(size >= hdrlen);
+	return ss0_sendpad(s, sa, S0MSG_PROBE, b, sizeof(b), size - hdrlen);
+}
+
 static bool
 ss0_on_ping(struct server *restrict s, struct msgframe *restrict msg)
 {
@@ -590,7 +1581,7 @@ ss0_on_reset(struct server *restrict s, struct msgframe *restrict msg)
 	if (!table_find(s->sessions, hkey, (void **)&ss)) {
 		return true;
 	}
-	if (ss->kcp_state == STATE_TIME_WAIT) {
+	if (ss->kcp_state == STATE_TIME_WAIT || ss->is_stream) {
 		return true;
 	}
 	LOGI_F("session [%08" PRIX32 "] kcp: reset by peer", conv);
@@ -757,12 +1748,58 @@ ss0_on_punch(struct server *restrict s, struct msgframe *restrict msg)
 	return true;
 }
 
+static bool
+ss0_on_probe(struct server *restrict s, struct msgframe *restrict msg)
+{
+	if (msg->len < SESSION0_HEADER_SIZE + sizeof(uint32_t) +
+			       sizeof(uint16_t)) {
+		return false;
+	}
+	if (s->pmtud == NULL) {
+		/* not enabled, the peer keeps the configured mtu */
+		return true;
+	}
+	const unsigned char *msgbuf =
+		msg->buf + msg->off + SESSION0_HEADER_SIZE;
+	const uint32_t seq = read_uint32(msgbuf);
+	const uint16_t mss = read_uint16(msgbuf + sizeof(uint32_t));
+	pmtud_on_probe(s->pmtud, &msg->addr.sa, mss);
+	/* the echo is as large as the probe, so both directions are tested */
+	unsigned char b[sizeof(uint32_t)];
+	write_uint32(b, seq);
+	size_t max = pmtud_max(s);
+	if (s->conf->kcp_parityshard > 0) {
+		max -= FEC_HEADER_SIZE;
+	}
+	const size_t len = MIN((size_t)msg->len, max);
+	(void)ss0_sendpad(
+		s, &msg->addr.sa, S0MSG_PROBE_ACK, b, sizeof(b),
+		len - SESSION0_HEADER_SIZE - sizeof(b));
+	return true;
+}
+
+static bool
+ss0_on_probe_ack(struct server *restrict s, struct msgframe *restrict msg)
+{
+	if (msg->len < SESSION0_HEADER_SIZE + sizeof(uint32_t)) {
+		return false;
+	}
+	if (s->pmtud == NULL) {
+		return true;
+	}
+	const unsigned char *msgbuf =
+		msg->buf + msg->off + SESSION0_HEADER_SIZE;
+	pmtud_on_ack(s->pmtud, &msg->addr.sa, read_uint32(msgbuf));
+	return true;
+}
+
 typedef bool (*ss0_handler_type)(struct server *, struct msgframe *);
 
 static const ss0_handler_type ss0_handler[] = {
 	[S0MSG_PING] = ss0_on_ping,	  [S0MSG_PONG] = ss0_on_pong,
 	[S0MSG_RESET] = ss0_on_reset,	  [S0MSG_LISTEN] = ss0_on_listen,
 	[S0MSG_CONNECT] = ss0_on_connect, [S0MSG_PUNCH] = ss0_on_punch,
+	[S0MSG_PROBE] = ss0_on_probe,	  [S0MSG_PROBE_ACK] = ss0_on_probe_ack,
 };
 
 void session0(struct server *restrict s, struct msgframe *restrict msg)
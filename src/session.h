@@ -19,6 +19,7 @@
 struct sockaddr;
 struct server;
 struct msgframe;
+struct stripe_chunk;
 
 /* type-length-value pattern */
 struct tlv_header {
@@ -27,8 +28,20 @@ struct tlv_header {
 };
 
 #define TLV_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint16_t))
-/* reserve space for one more kcp segment */
-#define TLV_MAX_LENGTH (SESSION_BUF_SIZE - MAX_PACKET_SIZE)
+/* the largest message sent, older versions take one in whole into a buffer
+ * of SESSION_BUF_SIZE; not tied to the packet size */
+#define TLV_MAX_LENGTH (SESSION_BUF_SIZE - 1500)
+/* kcp segments a pushed message is read into, even at the smallest mtu */
+#define PUSH_MAX_SEG 32
+/* pushed messages parsed ahead and written to tcp at once */
+#define WBUF_MAX_PUSH 64
+/* received kcp segments looked at in place at once */
+#define WBUF_MAX_SEG 256
+
+/* a range of the data received over kcp, as offsets from the front */
+struct wbuf_span {
+	uint32_t off, len;
+};
 
 static inline struct tlv_header tlv_header_read(const unsigned char *d)
 {
@@ -51,8 +64,33 @@ enum session_messages {
 	SMSG_PUSH = 0x0001,
 	SMSG_EOF = 0x0002,
 	SMSG_KEEPALIVE = 0x0003,
+	/* multiplexed streams, followed by: stream id (uint32) */
+	SMSG_STREAM_DIAL = 0x0004,
+	SMSG_STREAM_PUSH = 0x0005,
+	SMSG_STREAM_EOF = 0x0006,
+	/* followed by: stream id (uint32), window increment (uint32) */
+	SMSG_STREAM_WINDOW = 0x0007,
+	/* striped streams, followed by: stream id (uint32), offset (uint32) */
+	SMSG_STREAM_CHUNK = 0x0008,
 };
 
+#define STREAM_HEADER_SIZE (TLV_HEADER_SIZE + sizeof(uint32_t))
+#define CHUNK_HEADER_SIZE (STREAM_HEADER_SIZE + sizeof(uint32_t))
+/* until the receiver tells its window */
+#define STREAM_INITIAL_WINDOW 65536
+/* carriers a striped stream may be spread over */
+#define STRIPE_MAX 8
+
+/* auto-tuned windows start from and never shrink below these, the receive
+ * window must hold the largest message */
+#define AUTOTUNE_MIN_SNDWND 32
+#define AUTOTUNE_MIN_RCVWND 128
+/* the floors in effect, a smaller configured window is the ceiling too */
+#define AUTOTUNE_SNDWND_FLOOR(conf)                                            \
+	MIN((uint32_t)(conf)->kcp_sndwnd, (uint32_t)AUTOTUNE_MIN_SNDWND)
+#define AUTOTUNE_RCVWND_FLOOR(conf)                                            \
+	MIN((uint32_t)(conf)->kcp_rcvwnd, (uint32_t)AUTOTUNE_MIN_RCVWND)
+
 enum session_state {
 	STATE_INIT,
 	STATE_CONNECT,
@@ -66,6 +104,7 @@ enum session_state {
 extern const char session_state_char[STATE_MAX];
 
 struct IKCPCB;
+struct fec;
 
 #define SESSION_BUF_SIZE 16384
 #define SESSION_KEY_SIZE (sizeof(uint32_t) + sizeof(union sockaddr_max))
@@ -74,6 +113,7 @@ struct session {
 	unsigned char key[SESSION_KEY_SIZE];
 	struct server *server;
 	struct IKCPCB *kcp;
+	struct fec *fec;
 	int tcp_state, kcp_state;
 	int kcp_flush;
 	uint32_t conv;
@@ -81,6 +121,7 @@ struct session {
 	struct {
 		struct ev_io w_socket;
 		struct ev_idle w_flush;
+		struct ev_timer w_update;
 	};
 	struct {
 		ev_tstamp created;
@@ -89,9 +130,57 @@ struct session {
 	};
 	struct {
 		bool is_accepted : 1;
+		/* carries streams instead of a tcp connection */
+		bool is_mux : 1;
+		bool is_stream : 1;
 	};
+	struct {
+		/* the session carrying this stream, NULL once it is gone */
+		struct session *mux;
+		/* streams of the same carrier, the list is headed by it */
+		struct session *prev, *next;
+		/* bytes the peer is ready to receive */
+		size_t credit;
+		/* bytes sent to tcp but not yet credited to the peer */
+		size_t consumed;
+		/* carrier: some streams are waiting for the send window */
+		bool blocked;
+		/* carrier: the next one of the same stripe group, circular */
+		struct session *stripe;
+		/* bytes this side may buffer */
+		size_t window;
+		/* striped stream: byte offsets of the next chunk to send and
+		 * to deliver, chunks arriving early are held in order */
+		uint32_t snd_off, rcv_off;
+		struct stripe_chunk *early;
+		/* striped stream: the offset where the peer has closed */
+		uint32_t eof_off;
+		bool is_striped : 1;
+		/* the peer knows the stream, chunks may take any carrier */
+		bool is_acked : 1;
+		bool has_eof : 1;
+	} stream;
+	/* rbuf: streams only, the data read from tcp to be chunked */
 	struct vbuffer *rbuf, *wbuf;
+	/* the data received over kcp is handled in place in the receive
+	 * queue, flush and next are offsets from its front; wbuf only holds
+	 * the beginning of a message that the queue may not fit in whole,
+	 * streams keep their data in wbuf and the offsets are into it */
 	size_t wbuf_flush, wbuf_next;
+	/* the payloads of the parsed messages, from wbuf_ipush on they are
+	 * waiting for tcp; if there are none, all bytes up to wbuf_next are */
+	struct wbuf_span wbuf_push[WBUF_MAX_PUSH];
+	size_t wbuf_ipush, wbuf_npush;
+	/* bytes of the payload pushed at wbuf_next still to come */
+	size_t wbuf_left;
+#if HAVE_SO_TXTIME
+	/* departure time of the next paced packet */
+	uint64_t tx_next;
+#endif
+	/* progress since the last window auto-tuning, see kcp_autotune */
+	struct {
+		uint32_t ts, snd_una, rcv_nxt;
+	} tune;
 
 	struct link_stats stats;
 };
@@ -118,12 +207,21 @@ struct session *
 session_new(struct server *s, const union sockaddr_max *addr, uint32_t conv);
 void session_free(struct session *ss);
 
+/* the session carrying new streams to the peer, created on demand */
+struct session *session_mux(struct server *s);
+struct session *
+stream_new(struct server *s, struct session *mux, uint32_t id);
+bool stream_dial(struct session *ss);
+/* the carrier with the most room for the next chunk of a stream */
+struct session *stream_carrier(struct session *ss);
+
 void session_tcp_start(struct session *ss, int fd);
 void session_tcp_stop(struct session *ss);
 void session_kcp_stop(struct session *ss);
 
 bool session_kcp_send(struct session *ss);
 void session_kcp_flush(struct session *ss);
+void session_kcp_setmss(struct session *ss, size_t mss);
 void session_kcp_close(struct session *ss);
 
 void session_read_cb(struct session *ss);
@@ -137,6 +235,9 @@ enum session0_messages {
 	S0MSG_LISTEN = 0x0003,
 	S0MSG_CONNECT = 0x0004,
 	S0MSG_PUNCH = 0x0005,
+	/* path mtu discovery, padded to the probed size */
+	S0MSG_PROBE = 0x0006,
+	S0MSG_PROBE_ACK = 0x0007,
 };
 
 enum inetaddr_type {
@@ -154,6 +255,9 @@ bool ss0_send(
 	struct server *s, const struct sockaddr *sa, uint16_t what,
 	const unsigned char *b, size_t n);
 void ss0_reset(struct server *s, const struct sockaddr *sa, uint32_t conv);
+bool ss0_probe(
+	struct server *s, const struct sockaddr *sa, uint32_t seq, size_t mss,
+	size_t size);
 
 void session0(struct server *restrict s, struct msgframe *restrict msg);
 
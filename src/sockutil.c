@@ -14,7 +14,14 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#if HAVE_UDP_GSO || HAVE_UDP_GRO
+#include <netinet/udp.h>
+#endif
 #include <sys/socket.h>
+#if HAVE_SO_TXTIME
+#include <linux/net_tstamp.h>
+#include <time.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
@@ -112,6 +119,97 @@ int socket_get_error(const int fd)
 	return value;
 }
 
+/* check if the kernel supports UDP generic segmentation offload */
+bool socket_udp_gso(const int fd)
+{
+#if HAVE_UDP_GSO
+	int value = 0;
+	socklen_t len = sizeof(value);
+	if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &value, &len)) {
+		const int err = errno;
+		LOGD_F("UDP_SEGMENT: %s", strerror(err));
+		return false;
+	}
+	return true;
+#else
+	(void)fd;
+	return false;
+#endif
+}
+
+/* enable UDP generic receive offload */
+bool socket_set_udp_gro(const int fd)
+{
+#if HAVE_UDP_GRO
+	int val = 1;
+	if (setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val))) {
+		const int err = errno;
+		LOGW_F("UDP_GRO: %s", strerror(err));
+		return false;
+	}
+	return true;
+#else
+	(void)fd;
+	LOGW_F("UDP_GRO: %s", "not supported in current build");
+	return false;
+#endif
+}
+
+/* let the kernel hold each packet until its departure time */
+bool socket_set_txtime(const int fd)
+{
+#if HAVE_SO_TXTIME
+	const struct sock_txtime val = {
+		.clockid = CLOCK_MONOTONIC,
+		.flags = 0,
+	};
+	if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &val, sizeof(val))) {
+		const int err = errno;
+		LOGW_F("SO_TXTIME: %s", strerror(err));
+		return false;
+	}
+	return true;
+#else
+	(void)fd;
+	LOGW_F("SO_TXTIME: %s", "not supported in current build");
+	return false;
+#endif
+}
+
+/* set the DF bit but never let the kernel cap the datagram size by its own
+ * path mtu cache, used by the path mtu probes */
+bool socket_set_dontfrag(const int fd, const int domain)
+{
+#if HAVE_PMTUDISC_PROBE
+	int val = IP_PMTUDISC_PROBE;
+	if (domain == AF_INET6) {
+		int val6 = IPV6_PMTUDISC_PROBE;
+		if (setsockopt(
+			    fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val6,
+			    sizeof(val6))) {
+			const int err = errno;
+			LOGW_F("IPV6_MTU_DISCOVER: %s", strerror(err));
+			return false;
+		}
+		/* also for ipv4-mapped addresses, may fail on v6only */
+		(void)setsockopt(
+			fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+		return true;
+	}
+	if (setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val))) {
+		const int err = errno;
+		LOGW_F("IP_MTU_DISCOVER: %s", strerror(err));
+		return false;
+	}
+	return true;
+#else
+	(void)fd;
+	(void)domain;
+	LOGW_F("IP_MTU_DISCOVER: %s", "not supported in current build");
+	return false;
+#endif
+}
+
 socklen_t getsocklen(const struct sockaddr *restrict sa)
 {
 	switch (sa->sa_family) {
@@ -31,6 +31,10 @@ void socket_set_tcp(int fd, bool nodelay, bool keepalive);
 void socket_set_buffer(int fd, int send, int recv);
 void socket_bind_netdev(int fd, const char *netdev);
 int socket_get_error(int fd);
+bool socket_udp_gso(int fd);
+bool socket_set_udp_gro(int fd);
+bool socket_set_txtime(int fd);
+bool socket_set_dontfrag(int fd, int domain);
 
 socklen_t getsocklen(const struct sockaddr *sa);
 void copy_sa(struct sockaddr *dst, const struct sockaddr *src);
@@ -0,0 +1,264 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+#include "uring.h"
+
+#if WITH_IO_URING
+
+#include "util.h"
+
+#include "utils/slog.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static int
+sys_io_uring_setup(const unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(
+	const int fd, const unsigned to_submit, const unsigned min_complete,
+	const unsigned flags)
+{
+	return (int)syscall(
+		SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+		(size_t)0);
+}
+
+static int sys_io_uring_register(
+	const int fd, const unsigned opcode, const void *arg,
+	const unsigned nr_args)
+{
+	return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#define RING_PTR(base, off) ((void *)((unsigned char *)(base) + (off)))
+
+bool uring_init(
+	struct uring *restrict r, const unsigned entries,
+	const unsigned cq_entries)
+{
+	*r = (struct uring){ .fd = -1 };
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = cq_entries,
+	};
+	const int fd = sys_io_uring_setup(entries, &p);
+	if (fd < 0) {
+		const int err = errno;
+		LOGE_F("io_uring_setup: %s", strerror(err));
+		return false;
+	}
+	r->fd = fd;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap && r->cq_ring_size > r->sq_ring_size) {
+		r->sq_ring_size = r->cq_ring_size;
+	}
+	r->sq_ring = mmap(
+		NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		const int err = errno;
+		LOGE_F("io_uring mmap: %s", strerror(err));
+		r->sq_ring = NULL;
+		uring_close(r);
+		return false;
+	}
+	if (single_mmap) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(
+			NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			const int err = errno;
+			LOGE_F("io_uring mmap: %s", strerror(err));
+			r->cq_ring = NULL;
+			uring_close(r);
+			return false;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq.sqes = mmap(
+		NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sq.sqes == MAP_FAILED) {
+		const int err = errno;
+		LOGE_F("io_uring mmap: %s", strerror(err));
+		r->sq.sqes = NULL;
+		uring_close(r);
+		return false;
+	}
+
+	r->sq.head = RING_PTR(r->sq_ring, p.sq_off.head);
+	r->sq.tail = RING_PTR(r->sq_ring, p.sq_off.tail);
+	r->sq.array = RING_PTR(r->sq_ring, p.sq_off.array);
+	r->sq.mask = *(unsigned *)RING_PTR(r->sq_ring, p.sq_off.ring_mask);
+	r->sq.entries = p.sq_entries;
+	r->sq.sqe_tail = *r->sq.tail;
+	r->cq.head = RING_PTR(r->cq_ring, p.cq_off.head);
+	r->cq.tail = RING_PTR(r->cq_ring, p.cq_off.tail);
+	r->cq.mask = *(unsigned *)RING_PTR(r->cq_ring, p.cq_off.ring_mask);
+	r->cq.entries = p.cq_entries;
+	r->cq.cqes = RING_PTR(r->cq_ring, p.cq_off.cqes);
+	/* the index array is an identity mapping */
+	for (unsigned i = 0; i < r->sq.entries; i++) {
+		r->sq.array[i] = i;
+	}
+	return true;
+}
+
+void uring_close(struct uring *restrict r)
+{
+	if (r->sq.sqes != NULL) {
+		(void)munmap(r->sq.sqes, r->sqes_size);
+		r->sq.sqes = NULL;
+	}
+	if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+		(void)munmap(r->cq_ring, r->cq_ring_size);
+	}
+	r->cq_ring = NULL;
+	if (r->sq_ring != NULL) {
+		(void)munmap(r->sq_ring, r->sq_ring_size);
+		r->sq_ring = NULL;
+	}
+	if (r->fd != -1) {
+		CLOSE_FD(r->fd);
+		r->fd = -1;
+	}
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *restrict r)
+{
+	const unsigned head = __atomic_load_n(r->sq.head, __ATOMIC_ACQUIRE);
+	if (r->sq.sqe_tail - head >= r->sq.entries) {
+		return NULL;
+	}
+	struct io_uring_sqe *restrict sqe =
+		&r->sq.sqes[r->sq.sqe_tail & r->sq.mask];
+	r->sq.sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_submit(struct uring *restrict r, const unsigned wait_nr)
+{
+	/* entries published earlier may have been left unconsumed */
+	const unsigned head = __atomic_load_n(r->sq.head, __ATOMIC_ACQUIRE);
+	const unsigned to_submit = r->sq.sqe_tail - head;
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+	__atomic_store_n(r->sq.tail, r->sq.sqe_tail, __ATOMIC_RELEASE);
+	const unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+	do {
+		ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *restrict r)
+{
+	const unsigned head = *r->cq.head;
+	const unsigned tail = __atomic_load_n(r->cq.tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return NULL;
+	}
+	return &r->cq.cqes[head & r->cq.mask];
+}
+
+void uring_cqe_seen(struct uring *restrict r)
+{
+	__atomic_store_n(r->cq.head, *r->cq.head + 1, __ATOMIC_RELEASE);
+}
+
+bool uring_register_eventfd(struct uring *restrict r, const int efd)
+{
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_EVENTFD, &efd, 1) !=
+	    0) {
+		const int err = errno;
+		LOGE_F("io_uring_register: %s", strerror(err));
+		return false;
+	}
+	return true;
+}
+
+bool uring_buf_ring_init(
+	struct uring *restrict r, struct uring_buf_ring *restrict b,
+	const unsigned entries, const uint16_t bgid)
+{
+	const size_t size = entries * sizeof(struct io_uring_buf);
+	void *ring = mmap(
+		NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		const int err = errno;
+		LOGE_F("mmap: %s", strerror(err));
+		return false;
+	}
+	const struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)ring,
+		.ring_entries = entries,
+		.bgid = bgid,
+	};
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) !=
+	    0) {
+		const int err = errno;
+		LOGE_F("io_uring_register: %s", strerror(err));
+		(void)munmap(ring, size);
+		return false;
+	}
+	*b = (struct uring_buf_ring){
+		.br = ring,
+		.entries = entries,
+		.mask = entries - 1,
+		.bgid = bgid,
+		.tail = 0,
+	};
+	return true;
+}
+
+void uring_buf_ring_free(
+	struct uring *restrict r, struct uring_buf_ring *restrict b)
+{
+	if (b->br == NULL) {
+		return;
+	}
+	const struct io_uring_buf_reg reg = { .bgid = b->bgid };
+	(void)sys_io_uring_register(
+		r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	(void)munmap(b->br, b->entries * sizeof(struct io_uring_buf));
+	b->br = NULL;
+}
+
+void uring_buf_ring_add(
+	struct uring_buf_ring *restrict b, void *addr, const uint32_t len,
+	const uint16_t bid)
+{
+	struct io_uring_buf *restrict buf = &b->br->bufs[b->tail & b->mask];
+	buf->addr = (uint64_t)(uintptr_t)addr;
+	buf->len = len;
+	buf->bid = bid;
+	b->tail++;
+}
+
+void uring_buf_ring_commit(struct uring_buf_ring *restrict b)
+{
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* WITH_IO_URING */
@@ -0,0 +1,67 @@
+/* kcptun-libev (c) 2019-2024 He Xian <hexian000@outlook.com>
+ * This code is licensed under MIT license (see LICENSE for details) */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if WITH_IO_URING
+
+#include <linux/io_uring.h>
+
+/* a minimal io_uring binding, only what the packet path needs */
+struct uring {
+	int fd;
+	struct {
+		unsigned *head, *tail, *array;
+		unsigned mask, entries;
+		/* local tail, published by uring_submit */
+		unsigned sqe_tail;
+		struct io_uring_sqe *sqes;
+	} sq;
+	struct {
+		unsigned *head, *tail;
+		unsigned mask, entries;
+		struct io_uring_cqe *cqes;
+	} cq;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+bool uring_init(struct uring *r, unsigned entries, unsigned cq_entries);
+void uring_close(struct uring *r);
+
+/* returns NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+/* submit all queued entries and optionally wait for completions */
+int uring_submit(struct uring *r, unsigned wait_nr);
+
+/* returns NULL if the completion queue is empty */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+bool uring_register_eventfd(struct uring *r, int efd);
+
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	unsigned entries, mask;
+	uint16_t bgid;
+	uint16_t tail;
+};
+
+bool uring_buf_ring_init(
+	struct uring *r, struct uring_buf_ring *b, unsigned entries,
+	uint16_t bgid);
+void uring_buf_ring_free(struct uring *r, struct uring_buf_ring *b);
+
+/* stage a buffer, visible to the kernel after uring_buf_ring_commit */
+void uring_buf_ring_add(
+	struct uring_buf_ring *b, void *addr, uint32_t len, uint16_t bid);
+void uring_buf_ring_commit(struct uring_buf_ring *b);
+
+#endif /* WITH_IO_URING */
+
+#endif /* URING_H */
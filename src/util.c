@@ -4,6 +4,7 @@
 #include "util.h"
 
 #include "crypto.h"
+#include "fec.h"
 #include "pktqueue.h"
 
 #include "math/rand.h"
@@ -49,7 +50,7 @@ bool check_rate_limit(
 	return true;
 }
 
-struct mcache *msgpool;
+_Thread_local struct mcache *msgpool[MSGPOOL_CLASSES];
 
 void init(int argc, char **argv)
 {
@@ -90,23 +91,50 @@ void loadlibs(void)
 
 #if WITH_CRYPTO
 	crypto_init();
+#endif
+	fec_init();
+	loadlibs_thread();
+}
+
+void unloadlibs(void)
+{
+	unloadlibs_thread();
+}
+
+void loadlibs_thread(void)
+{
+#if WITH_CRYPTO
 	srand64(((uint64_t)crypto_rand32() << 32u) | crypto_rand32());
 #else
-	srand64((uint64_t)time(NULL));
+	/* the address differs in each thread */
+	srand64((uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)msgpool);
 #endif
 
-	const size_t size =
-		MAX(sizeof(struct IKCPSEG) + MAX_PACKET_SIZE,
-		    sizeof(struct msgframe));
-	msgpool = mcache_new(MMSG_BATCH_SIZE * 2, size);
-	CHECKOOM(msgpool);
-	ikcp_segment_pool = msgpool;
+	/* kcp segments share the frame pools */
+	static_assert(
+		MSGPOOL_CLASSES == IKCP_SEGMENT_POOLS,
+		"kcp segment pools mismatch");
+	const size_t hdrsize =
+		MAX(sizeof(struct IKCPSEG), sizeof(struct msgframe));
+	for (int i = 0; i < MSGPOOL_CLASSES; i++) {
+		const size_t size = hdrsize + msgpool_size(i);
+		msgpool[i] = mcache_new(MMSG_BATCH_SIZE * 2, size);
+		CHECKOOM(msgpool[i]);
+		ikcp_segment_pool[i] = msgpool[i];
+	}
+	ikcp_segment_ref_pool =
+		mcache_new(MMSG_BATCH_SIZE * 2, sizeof(struct IKCPSEG));
+	CHECKOOM(ikcp_segment_ref_pool);
 }
 
-void unloadlibs(void)
+void unloadlibs_thread(void)
 {
-	mcache_free(msgpool);
-	ikcp_segment_pool = msgpool = NULL;
+	mcache_free(ikcp_segment_ref_pool);
+	ikcp_segment_ref_pool = NULL;
+	for (int i = 0; i < MSGPOOL_CLASSES; i++) {
+		mcache_free(msgpool[i]);
+		ikcp_segment_pool[i] = msgpool[i] = NULL;
+	}
 }
 
 #if WITH_CRYPTO
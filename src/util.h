@@ -47,7 +47,15 @@ static inline int64_t clock_cputime(void)
 #endif
 }
 
-extern struct mcache *msgpool;
+/* frames and kcp segments are pooled by the payload size */
+enum msgpool_class {
+	MSGPOOL_SMALL,
+	MSGPOOL_ETHER,
+	MSGPOOL_JUMBO,
+	MSGPOOL_CLASSES,
+};
+
+extern _Thread_local struct mcache *msgpool[MSGPOOL_CLASSES];
 
 #define UTIL_SAFE_FREE(x)                                                      \
 	do {                                                                   \
@@ -77,7 +85,7 @@ bool check_rate_limit(ev_tstamp *last, ev_tstamp now, double interval);
 
 #define RATELIMIT(now, interval, expr)                                         \
 	do {                                                                   \
-		static ev_tstamp last = TSTAMP_NIL;                            \
+		static _Thread_local ev_tstamp last = TSTAMP_NIL;              \
 		if (check_rate_limit(&last, (now), (interval))) {              \
 			expr;                                                  \
 		}                                                              \
@@ -91,6 +99,9 @@ bool check_rate_limit(ev_tstamp *last, ev_tstamp now, double interval);
 
 void init(int argc, char **argv);
 void loadlibs(void);
+/* setup the calling thread, loadlibs() does this for the main thread */
+void loadlibs_thread(void);
+void unloadlibs_thread(void);
 
 #if WITH_CRYPTO
 void genpsk(const char *method);